@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mpsc_queue.h"
+
+#define ACTOR_BATCH 64 // tasks an actor runs before giving its worker to someone else
+
+struct ActorTask {
+    ActorTask* next = nullptr;
+    virtual ~ActorTask() = default;
+    virtual void run() = 0;
+};
+
+template <typename Fn>
+struct ActorTaskFn : ActorTask {
+    Fn fn;
+    explicit ActorTaskFn(Fn f) : fn(std::move(f)) {}
+    void run() override { fn(); }
+};
+
+// Something with state that only its own tasks touch. Tasks posted to one actor
+// run one at a time, in the order they were posted; different actors run in
+// parallel on the pool. An actor is queued on the pool at most once at a time.
+struct Actor {
+    MpscQueue<ActorTask> inbox;
+    ActorTask* pending = nullptr; // taken from the inbox, oldest first; only the running worker touches it
+    std::atomic<bool> scheduled{false};
+    // Bumped after every batch, before scheduled is cleared. Two looks at an idle
+    // actor with the same count mean it ran nothing in between.
+    std::atomic<uint64_t> batches{0};
+};
+
+// Runs actors on a fixed set of threads. Every worker has its own run queue and
+// takes from the front; an idle worker steals from the back of the others'.
+// An actor that used up its batch goes to the back of the queue, so a busy actor
+// shares its worker fairly instead of starving the rest.
+class ActorPool {
+public:
+    void start(unsigned threads) {
+        workers_ = std::vector<Worker>(std::max(1u, threads));
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            workers_[0].queue.assign(early_.begin(), early_.end());
+            queued_.fetch_add((long)early_.size());
+            early_.clear();
+            started_.store(true, std::memory_order_release);
+        }
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            std::thread(&ActorPool::run_worker, this, i).detach();
+        }
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    template <typename Fn>
+    void post(Actor& actor, Fn fn) {
+        actor.inbox.push(new ActorTaskFn<Fn>(std::move(fn)));
+        if (!actor.scheduled.exchange(true, std::memory_order_acq_rel)) submit(actor);
+    }
+
+private:
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::deque<Actor*> queue;
+    };
+
+    // Workers queue onto themselves; other threads spread actors round-robin.
+    // Anything submitted before start() waits in the early queue.
+    void submit(Actor& actor) {
+        if (!started_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            if (!started_.load(std::memory_order_relaxed)) {
+                early_.push_back(&actor);
+                return;
+            }
+        }
+        size_t index = worker_index_ >= 0 ? (size_t)worker_index_ : next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+        {
+            std::lock_guard<std::mutex> lock(workers_[index].mutex);
+            workers_[index].queue.push_back(&actor);
+        }
+        queued_.fetch_add(1);
+        if (sleepers_.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    Actor* take(size_t self) {
+        {
+            std::lock_guard<std::mutex> lock(workers_[self].mutex);
+            auto& queue = workers_[self].queue;
+            if (!queue.empty()) {
+                Actor* actor = queue.front();
+                queue.pop_front();
+                return actor;
+            }
+        }
+        for (size_t k = 1; k < workers_.size(); ++k) {
+            Worker& victim = workers_[(self + k) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.queue.empty()) {
+                Actor* actor = victim.queue.back();
+                victim.queue.pop_back();
+                return actor;
+            }
+        }
+        return nullptr;
+    }
+
+    void run_actor(Actor& actor) {
+        for (int i = 0; i < ACTOR_BATCH; ++i) {
+            if (!actor.pending) actor.pending = actor.inbox.take_all();
+            if (!actor.pending) break;
+            ActorTask* task = actor.pending;
+            actor.pending = task->next;
+            task->run();
+            delete task;
+        }
+        actor.batches.fetch_add(1, std::memory_order_relaxed);
+        if (actor.pending || !actor.inbox.empty()) {
+            submit(actor);
+            return;
+        }
+        actor.scheduled.store(false);
+        // A post that saw scheduled == true just before the store is still ours to run.
+        if (!actor.inbox.empty() && !actor.scheduled.exchange(true)) submit(actor);
+    }
+
+    void run_worker(size_t self) {
+        worker_index_ = (int)self;
+        while (true) {
+            Actor* actor = take(self);
+            if (!actor) {
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                sleepers_.fetch_add(1);
+                wake_.wait(lock, [this] { return queued_.load() > 0; });
+                sleepers_.fetch_sub(1);
+                continue;
+            }
+            queued_.fetch_sub(1);
+            run_actor(*actor);
+        }
+    }
+
+    std::vector<Worker> workers_;
+    std::atomic<bool> started_{false};
+    std::atomic<size_t> next_worker_{0};
+    std::atomic<long> queued_{0}; // actors in run queues; briefly -1 when a worker takes one before submit counts it
+    std::atomic<int> sleepers_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::vector<Actor*> early_;
+    static inline thread_local int worker_index_ = -1;
+};
+
+inline ActorPool actor_pool;
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// Threads for the password KDF, which is slow on purpose and must not run on the
+// event loops. Jobs wait in a bounded queue. When it is full a new job is refused
+// at once, so a reconnect storm is turned away in microseconds instead of queueing
+// behind seconds of hashing. /search queries run here too, off the loops.
+class AuthPool {
+public:
+    void start(unsigned threads, size_t max_queued) {
+        max_queued_ = max_queued;
+        for (unsigned i = 0; i < std::max(1u, threads); ++i) {
+            std::thread(&AuthPool::run, this).detach();
+        }
+    }
+
+    // Returns false, without running the job, if the queue is full.
+    bool try_submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (jobs_.size() >= max_queued_) return false;
+            jobs_.push_back(std::move(job));
+        }
+        wake_.notify_one();
+        return true;
+    }
+
+    // For work that must not be refused, like replicating a signup from another
+    // cluster node: queued whatever the bound.
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        wake_.notify_one();
+    }
+
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.size();
+    }
+
+    // Nothing waiting and nothing being checked.
+    bool idle() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.empty() && running_ == 0;
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return !jobs_.empty(); });
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+                ++running_;
+            }
+            job();
+            std::lock_guard<std::mutex> lock(mutex_);
+            --running_;
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> jobs_;
+    size_t max_queued_ = 0;
+    size_t running_ = 0;
+};
+
+inline AuthPool auth_pool;
@@ -0,0 +1,487 @@
+// Microbenchmarks for the server's hot-path primitives. The benchmarks include
+// the headers the server is built from and call the real functions; no event
+// loop, listener or worker thread is started. Each result is the time, heap
+// allocations and heap bytes per operation, where an operation is what the
+// benchmark's name says it is (a user record, a line, a frame, a broadcast or
+// a reply).
+//
+// Allocations are counted by replacing the global operator new, so frames that
+// come from the slab pool in frame.h cost nothing here once the pool is warm,
+// just as in the server.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "user_store.h"
+
+#define BENCH_DEFAULT_MIN_TIME_MS 300
+#define BENCH_ROOM_LOOPS 4 // event loops the benchmark rooms are spread over, as with --reactors 4
+
+#ifdef __GNUC__
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+std::atomic<uint64_t> bench_allocations{0};
+std::atomic<uint64_t> bench_allocated_bytes{0};
+
+// Every form of operator new below allocates here, and every operator delete
+// frees through bench_free.
+void* bench_allocate(size_t size, std::align_val_t alignment) noexcept {
+    bench_allocations.fetch_add(1, std::memory_order_relaxed);
+    bench_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    size_t align = (size_t)alignment;
+    if (size == 0) size = 1;
+    if (align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) return std::malloc(size);
+#ifdef _WIN32
+    return _aligned_malloc(size, align);
+#else
+    return std::aligned_alloc(align, (size + align - 1) / align * align);
+#endif
+}
+
+void* bench_allocate_or_throw(size_t size, std::align_val_t alignment) {
+    if (void* block = bench_allocate(size, alignment)) return block;
+    throw std::bad_alloc();
+}
+
+// Kept out of line: inlined into a delete-expression, the free() would be seen
+// applied to operator new's result, which GCC reports as mismatched.
+BENCH_NOINLINE void bench_free(void* block, std::align_val_t alignment) noexcept {
+#ifdef _WIN32
+    if ((size_t)alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        _aligned_free(block);
+        return;
+    }
+#else
+    (void)alignment;
+#endif
+    std::free(block);
+}
+
+#define BENCH_DEFAULT_ALIGNMENT std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__)
+
+void* operator new(size_t size) { return bench_allocate_or_throw(size, BENCH_DEFAULT_ALIGNMENT); }
+void* operator new[](size_t size) { return bench_allocate_or_throw(size, BENCH_DEFAULT_ALIGNMENT); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return bench_allocate(size, BENCH_DEFAULT_ALIGNMENT); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return bench_allocate(size, BENCH_DEFAULT_ALIGNMENT); }
+void* operator new(size_t size, std::align_val_t alignment) { return bench_allocate_or_throw(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return bench_allocate_or_throw(size, alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return bench_allocate(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return bench_allocate(size, alignment); }
+void operator delete(void* block) noexcept { bench_free(block, BENCH_DEFAULT_ALIGNMENT); }
+void operator delete[](void* block) noexcept { bench_free(block, BENCH_DEFAULT_ALIGNMENT); }
+void operator delete(void* block, size_t) noexcept { bench_free(block, BENCH_DEFAULT_ALIGNMENT); }
+void operator delete[](void* block, size_t) noexcept { bench_free(block, BENCH_DEFAULT_ALIGNMENT); }
+void operator delete(void* block, const std::nothrow_t&) noexcept { bench_free(block, BENCH_DEFAULT_ALIGNMENT); }
+void operator delete[](void* block, const std::nothrow_t&) noexcept { bench_free(block, BENCH_DEFAULT_ALIGNMENT); }
+void operator delete(void* block, std::align_val_t alignment) noexcept { bench_free(block, alignment); }
+void operator delete[](void* block, std::align_val_t alignment) noexcept { bench_free(block, alignment); }
+void operator delete(void* block, size_t, std::align_val_t alignment) noexcept { bench_free(block, alignment); }
+void operator delete[](void* block, size_t, std::align_val_t alignment) noexcept { bench_free(block, alignment); }
+void operator delete(void* block, std::align_val_t alignment, const std::nothrow_t&) noexcept { bench_free(block, alignment); }
+void operator delete[](void* block, std::align_val_t alignment, const std::nothrow_t&) noexcept { bench_free(block, alignment); }
+
+struct BenchConfig {
+    std::string filter;
+    unsigned min_time_ms = BENCH_DEFAULT_MIN_TIME_MS;
+    std::string format = "table";
+    std::string baseline; // a --format csv file from an earlier run
+};
+
+BenchConfig bench_config;
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops = 0;
+    double ns_per_op = 0;
+    double allocs_per_op = 0;
+    double bytes_per_op = 0;
+};
+
+std::vector<BenchResult> bench_results;
+
+// Keeps the optimizer from discarding work whose result is otherwise unused.
+volatile size_t bench_sink = 0;
+
+// Handed to each benchmark body. Work done inside untimed() (resetting state
+// between calls) is left out of the time and allocation counts.
+class Bench {
+public:
+    template <typename Setup>
+    void untimed(Setup&& setup) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t allocations = bench_allocations.load(std::memory_order_relaxed);
+        uint64_t bytes = bench_allocated_bytes.load(std::memory_order_relaxed);
+        setup();
+        excluded_ += std::chrono::steady_clock::now() - start;
+        excluded_allocations_ += bench_allocations.load(std::memory_order_relaxed) - allocations;
+        excluded_bytes_ += bench_allocated_bytes.load(std::memory_order_relaxed) - bytes;
+    }
+
+    std::chrono::steady_clock::duration excluded_{};
+    uint64_t excluded_allocations_ = 0;
+    uint64_t excluded_bytes_ = 0;
+};
+
+bool bench_selected(const std::string& name) {
+    return bench_config.filter.empty() || name.find(bench_config.filter) != std::string::npos;
+}
+
+// Calls body(bench), which performs ops_per_call operations, once to warm up and
+// then in doubling batches until --min-time has passed.
+template <typename Body>
+void run_bench(const std::string& name, uint64_t ops_per_call, Body&& body) {
+    if (!bench_selected(name)) return;
+    Bench bench;
+    body(bench);
+    bench = Bench();
+    uint64_t calls = 0;
+    uint64_t allocations = bench_allocations.load(std::memory_order_relaxed);
+    uint64_t bytes = bench_allocated_bytes.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    auto min_time = std::chrono::milliseconds(bench_config.min_time_ms);
+    for (uint64_t batch = 1;; batch *= 2) {
+        for (uint64_t i = 0; i < batch; ++i) body(bench);
+        calls += batch;
+        if (std::chrono::steady_clock::now() - start - bench.excluded_ >= min_time) break;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start - bench.excluded_;
+    BenchResult result;
+    result.name = name;
+    result.ops = calls * ops_per_call;
+    result.ns_per_op = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / result.ops;
+    result.allocs_per_op = (double)(bench_allocations.load(std::memory_order_relaxed) - allocations - bench.excluded_allocations_) / result.ops;
+    result.bytes_per_op = (double)(bench_allocated_bytes.load(std::memory_order_relaxed) - bytes - bench.excluded_bytes_) / result.ops;
+    bench_results.push_back(result);
+    if (bench_config.format == "table") {
+        std::printf("%-40s %12llu %12.1f %10.2f %12.1f\n", name.c_str(), (unsigned long long)result.ops, result.ns_per_op,
+                    result.allocs_per_op, result.bytes_per_op);
+        std::fflush(stdout);
+    }
+}
+
+// users.csv as the server writes it: PBKDF2 hashes, a few admins.
+std::string make_user_file(const std::filesystem::path& dir, size_t users) {
+    std::string path = (dir / ("users-" + std::to_string(users) + ".csv")).string();
+    std::string contents;
+    contents.reserve(users * 140);
+    std::string hash = PASSWORD_HASH_PREFIX "100000$" + std::string(32, 'a') + "$" + std::string(64, 'b');
+    for (size_t i = 0; i < users; ++i) {
+        User user{"user" + std::to_string(i), hash, i % 1000 == 0, "Nick" + std::to_string(i)};
+        append_user_line(contents, user);
+    }
+    std::ofstream(path, std::ios::binary) << contents;
+    return path;
+}
+
+void bench_user_store(const std::filesystem::path& dir) {
+    for (size_t users : {10000, 100000, 1000000}) {
+        std::string count = users >= 1000000 ? std::to_string(users / 1000000) + "M" : std::to_string(users / 1000) + "k";
+        std::string name = "user_store/load_user_file/" + count + " (per user)";
+        if (!bench_selected(name)) continue;
+        std::string path = make_user_file(dir, users);
+        run_bench(name, users, [&](Bench& bench) {
+            bench.untimed([] { std::unordered_map<std::string, User>().swap(user_store.index); });
+            bench_sink = bench_sink + load_user_file(path);
+        });
+        std::unordered_map<std::string, User>().swap(user_store.index);
+        std::filesystem::remove(path);
+    }
+}
+
+// What a chatting client sends, most of it plain chat.
+const std::vector<std::string> BENCH_LINES = {
+    "hello everyone, how is it going today?",
+    "/msg bob are you coming to the standup in five minutes?",
+    "did anyone see the deploy notes from last night",
+    "/who",
+    "/join general",
+    "lol",
+    "/history 20",
+    "that build is green again, thanks for the fix",
+};
+
+void bench_commands() {
+    run_bench("command/tokenize_dispatch (per line)", BENCH_LINES.size(), [](Bench&) {
+        for (const std::string& line : BENCH_LINES) {
+            Tokenizer args(line);
+            std::string_view command = args.next();
+            const CommandEntry* entry = command.empty() || command.front() != '/' ? nullptr : find_command(command);
+            bench_sink = bench_sink + (entry ? entry->name.size() : 0) + args.next().size() + args.remainder().size();
+        }
+    });
+
+    // Inbound framing as a loop does it: receive into the ring, then take lines.
+    std::string text_input, binary_input;
+    size_t lines = 0;
+    while (text_input.size() < 60000) {
+        for (const std::string& line : BENCH_LINES) {
+            text_input += line + "\n";
+            FrameRef frame = encode_binary_frame(OP_LINE, {}, {line});
+            binary_input.append(frame.data(), frame.size());
+            ++lines;
+        }
+    }
+    for (bool binary : {false, true}) {
+        const std::string& input = binary ? binary_input : text_input;
+        run_bench(binary ? "framer/binary_frames (per frame)" : "framer/text_lines (per line)", lines, [&](Bench&) {
+            LineFramer framer(config.max_line_length);
+            if (binary) framer.set_length_prefixed();
+            size_t fed = 0;
+            std::string_view line;
+            while (fed < input.size()) {
+                char* dest = framer.write_ptr();
+                size_t n = std::min(framer.write_space(), input.size() - fed);
+                std::memcpy(dest, input.data() + fed, n);
+                framer.commit(n);
+                fed += n;
+                while (framer.next_line(line) == LineFramer::Result::Line) {
+                    if (binary) {
+                        BinaryMessage msg;
+                        bench_sink = bench_sink + decode_binary_message(line, msg);
+                    }
+                    bench_sink = bench_sink + line.size();
+                }
+            }
+        });
+    }
+}
+
+void bench_frames() {
+    std::string nickname = "Bobby", room = "general";
+    std::string message = "did anyone see the deploy notes from last night";
+    run_bench("frame/msg_text (per frame)", 1, [&](Bench&) {
+        // As send_chat builds it.
+        char id_buf[16];
+        int id_len = std::snprintf(id_buf, sizeof(id_buf), "%d", 4711);
+        FrameRef frame = encode_frame({"MSG ", std::string_view(id_buf, id_len), " ", nickname, " [", room, "] ", message});
+        bench_sink = bench_sink + frame.size();
+    });
+    run_bench("frame/sys_msg_text (per frame)", 1, [&](Bench&) {
+        // As enter_room announces a member.
+        FrameRef frame = encode_frame({"SYS_MSG [" + room + "] " + nickname + " has joined!"});
+        bench_sink = bench_sink + frame.size();
+    });
+    std::string line = "MSG 4711 " + nickname + " [" + room + "] " + message;
+    run_bench("frame/msg_binary_reencode (per frame)", 1, [&](Bench&) {
+        FrameRef frame = encode_binary_line(line, 3);
+        bench_sink = bench_sink + frame.size();
+    });
+}
+
+// A room with `members` clients spread over the loops, each with an outbound
+// queue but no socket. After a broadcast the queues are emptied as if every
+// write had gone through, which stands in for the socket.
+struct BenchRoom {
+    Room* room = nullptr;
+    std::vector<std::shared_ptr<ClientInfo>> clients;
+};
+
+BenchRoom make_bench_room(const std::string& name, size_t members, bool mixed_protocols) {
+    BenchRoom bench_room;
+    bench_room.room = intern_room(name);
+    auto presence = std::make_shared<RoomPresence>();
+    for (size_t i = 0; i < members; ++i) {
+        auto client = std::make_shared<ClientInfo>();
+        client->id = next_client_id.fetch_add(1);
+        client->username = "user" + std::to_string(client->id);
+        client->nickname = "Nick" + std::to_string(client->id);
+        client->loop_index = i % event_loops.size();
+        client->out = std::make_shared<Outbound>();
+        client->out->socket = INVALID_SOCKET;
+        client->out->loop = event_loops[client->loop_index].get();
+        client->out->conn = nullptr;
+        client->out->binary = mixed_protocols && i % 2 == 1;
+        client->room.store(bench_room.room);
+        RoomMembers& list = members_on_loop(*bench_room.room, *client);
+        std::lock_guard<std::mutex> lock(list.mutex);
+        add_member_locked(client, list);
+        presence->members.push_back({client->id, client->nickname, client->username});
+        bench_room.clients.push_back(std::move(client));
+    }
+    presence->version = 1;
+    bench_room.room->presence.store(std::move(presence));
+    presence_version.fetch_add(1, std::memory_order_release);
+    return bench_room;
+}
+
+// Empties every queue that got output, as a completed flush would.
+void bench_sink_outbound(EventLoop& loop) {
+    for (Outbound* out : loop.dirty) {
+        std::lock_guard<std::mutex> lock(out->mutex);
+        out->frames.clear();
+        out->queued_bytes = 0;
+        out->front_offset = 0;
+        out->flush_scheduled = false;
+    }
+    loop.dirty.clear();
+}
+
+void bench_broadcast() {
+#ifdef USE_EPOLL
+    for (bool mixed : {false, true}) {
+        for (size_t members : {10, 100, 1000}) {
+            std::string name = std::string("broadcast/") + (mixed ? "mixed" : "text") + "/" + std::to_string(members) + " (per broadcast)";
+            if (!bench_selected(name)) continue;
+            BenchRoom bench_room = make_bench_room("bench-" + std::to_string(members) + (mixed ? "-mixed" : ""), members, mixed);
+            FrameRef frame = encode_frame({"MSG 4711 Bobby [" + bench_room.room->name + "] did anyone see the deploy notes from last night"});
+            run_bench(name, 1, [&](Bench&) {
+                // The room's actor posts one mailbox item per loop; each loop then
+                // drains its mailbox into its members' queues on its own thread.
+                bench_sink = bench_sink + broadcast_frame(*bench_room.room, frame);
+                for (auto& loop : event_loops) {
+                    current_loop = loop.get();
+                    mailbox_drain(*loop);
+                    bench_sink_outbound(*loop);
+                }
+                current_loop = nullptr;
+            });
+        }
+    }
+#else
+    std::cout << "[BENCH] broadcast/* needs the epoll build; skipped." << std::endl;
+#endif
+}
+
+void bench_presence() {
+    // /whoall over 1000 users in 20 rooms, rebuilt as after every join or leave,
+    // and then served from the cached reply. This runs before any other room is
+    // created so the reply covers the same rooms whatever --filter selects.
+    std::vector<BenchRoom> rooms;
+    for (int i = 0; i < 20; ++i) rooms.push_back(make_bench_room("bench-whoall-" + std::to_string(i), 50, false));
+    EventLoop& loop = *event_loops[0];
+    auto out = std::make_shared<Outbound>();
+    out->socket = INVALID_SOCKET;
+    out->loop = &loop;
+    out->conn = nullptr;
+    Connection conn(INVALID_SOCKET, 0, out, config.max_line_length);
+    CommandContext ctx{conn, *out, *rooms[0].room};
+    for (bool rebuild : {true, false}) {
+        run_bench(rebuild ? "whoall/rebuild/1000 (per reply)" : "whoall/cached/1000 (per reply)", 1, [&](Bench&) {
+            if (rebuild) presence_version.fetch_add(1, std::memory_order_release);
+            current_loop = &loop;
+            Tokenizer args("");
+            cmd_whoall(ctx, args);
+            bench_sink_outbound(loop);
+            current_loop = nullptr;
+        });
+    }
+
+    BenchRoom who_room = make_bench_room("bench-who", 100, false);
+    run_bench("who/reply/100 (per reply)", 1, [&](Bench&) {
+        std::shared_ptr<const RoomPresence> presence = who_room.room->presence.load();
+        bench_sink = bench_sink + who_reply(*who_room.room, *presence).size();
+    });
+}
+
+std::map<std::string, BenchResult> load_baseline(const std::string& path) {
+    std::map<std::string, BenchResult> baseline;
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line); // header
+    while (std::getline(in, line)) {
+        // The name is quoted and may hold commas; the numbers follow it.
+        size_t name_end = line.rfind('"');
+        if (line.empty() || line[0] != '"' || name_end == 0 || name_end == std::string::npos) continue;
+        BenchResult result;
+        result.name = line.substr(1, name_end - 1);
+        unsigned long long ops = 0;
+        if (std::sscanf(line.c_str() + name_end + 1, ",%llu,%lf,%lf,%lf", &ops, &result.ns_per_op, &result.allocs_per_op, &result.bytes_per_op) == 4) {
+            result.ops = ops;
+            baseline[result.name] = result;
+        }
+    }
+    return baseline;
+}
+
+void print_results() {
+    if (bench_config.format == "csv") {
+        std::printf("name,ops,ns_per_op,allocs_per_op,bytes_per_op\n");
+        for (const BenchResult& r : bench_results) {
+            std::printf("\"%s\",%llu,%.2f,%.3f,%.1f\n", r.name.c_str(), (unsigned long long)r.ops, r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+        }
+    } else if (bench_config.format == "json") {
+        std::printf("[\n");
+        for (size_t i = 0; i < bench_results.size(); ++i) {
+            const BenchResult& r = bench_results[i];
+            std::printf("  {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}%s\n",
+                        r.name.c_str(), (unsigned long long)r.ops, r.ns_per_op, r.allocs_per_op, r.bytes_per_op,
+                        i + 1 < bench_results.size() ? "," : "");
+        }
+        std::printf("]\n");
+    }
+    if (bench_config.baseline.empty()) return;
+    // Against the baseline, on stderr so csv and json output stays parseable.
+    std::map<std::string, BenchResult> baseline = load_baseline(bench_config.baseline);
+    std::fprintf(stderr, "\n%-40s %12s %12s %8s %14s\n", "vs baseline", "ns/op", "was", "change", "allocs/op was");
+    for (const BenchResult& r : bench_results) {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end()) {
+            std::fprintf(stderr, "%-40s %12.1f %12s\n", r.name.c_str(), r.ns_per_op, "new");
+            continue;
+        }
+        const BenchResult& old = it->second;
+        double change = old.ns_per_op > 0 ? (r.ns_per_op / old.ns_per_op - 1) * 100 : 0;
+        std::fprintf(stderr, "%-40s %12.1f %12.1f %+7.1f%% %6.2f -> %.2f\n", r.name.c_str(), r.ns_per_op, old.ns_per_op, change,
+                     old.allocs_per_op, r.allocs_per_op);
+    }
+}
+
+void print_bench_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --filter <text>             run only benchmarks whose name contains this\n"
+              << "  --min-time <ms>             measuring time per benchmark (default " << BENCH_DEFAULT_MIN_TIME_MS << ")\n"
+              << "  --format <table|csv|json>   output format (default table)\n"
+              << "  --baseline <path>           compare with a --format csv file from an earlier run" << std::endl;
+}
+
+bool parse_bench_args(int argc, char* argv[], BenchConfig& cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { print_bench_usage(argv[0]); return false; }
+        std::string value = argv[++i];
+        if (arg == "--filter") cfg.filter = value;
+        else if (arg == "--min-time") cfg.min_time_ms = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--format" && (value == "table" || value == "csv" || value == "json")) cfg.format = value;
+        else if (arg == "--baseline") cfg.baseline = value;
+        else { print_bench_usage(argv[0]); return false; }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_bench_args(argc, argv, bench_config)) return 1;
+    // The server's state as main() would leave it, minus threads and sockets.
+    history_log.enabled = false;
+    for (unsigned i = 0; i < BENCH_ROOM_LOOPS; ++i) {
+        event_loops.push_back(std::make_unique<EventLoop>());
+        event_loops.back()->index = i;
+    }
+    lobby_room = intern_room("Lobby");
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("ctc-bench-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    std::filesystem::create_directories(dir);
+    if (bench_config.format == "table") {
+        std::printf("%-40s %12s %12s %10s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+    }
+    bench_user_store(dir);
+    bench_commands();
+    bench_frames();
+    bench_presence();
+    bench_broadcast();
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    print_results();
+    return 0;
+}
@@ -3,23 +3,39 @@
 #include <thread>
 #include <mutex>
 #include <vector>
+#define NOMINMAX
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <climits>
+
+#include "protocol.h"
+#include "line_framer.h"
 
 #pragma comment(lib, "ws2_32.lib")
 
-#define MAX_BUFFER_SIZE 4096
+#define RECEIVE_RING_BYTES (1024 * 1024) // longest server message shown; /whoall on a busy server is one line
 #define NUM_COLORS 6
+#define RECONNECT_ATTEMPTS 10
+#define RECONNECT_MAX_DELAY_S 30
 
 SOCKET client_socket;
+std::mutex socket_mutex; // held to send, and to swap in a new socket after a reconnect
 bool exit_flag = false;
 std::string username;
 std::string nickname;
-std::string current_room = "Lobby";
+std::string current_room = "Lobby"; // written by the receive thread under console_mutex, which the prompt is drawn under
+uint32_t current_room_id = 0; // receive thread only
 bool is_client_admin = false;
+bool request_binary = true;
+bool binary_mode = false; // negotiated at login; see protocol.h. Changed only under socket_mutex
+std::string session_token; // from the server's SESSION line, used to RESUME after a drop
+LineFramer receive_framer(RECEIVE_RING_BYTES); // bytes received but not yet processed
+std::string render_buffer; // everything decoded from one read, written to the terminal at once
 std::mutex console_mutex;
 
 std::string def_col = "\033[0m";
@@ -42,8 +58,12 @@ void clear_current_line() {
     std::cout << "\r\033[K" << std::flush;
 }
 
+std::string prompt_text() {
+    return get_color(1) + nickname + " [" + current_room + "] : " + def_col;
+}
+
 void display_prompt() {
-    std::cout << get_color(1) << nickname << " [" << current_room << "] : " << def_col << std::flush;
+    std::cout << prompt_text() << std::flush;
 }
 
 void print_help() {
@@ -53,6 +73,7 @@ void print_help() {
     std::cout << " /help                     -> Show this help menu" << std::endl;
     std::cout << " /who                      -> Show users in your current room" << std::endl;
     std::cout << " /list                     -> List all active chat rooms" << std::endl;
+    std::cout << " /history [count]          -> Show recent messages in your current room" << std::endl;
     std::cout << " /leave                    -> Leave the current room to the Lobby" << std::endl;
     std::cout << " /create <roomname>        -> Create a new chat room" << std::endl;
     std::cout << " /join <roomname>          -> Join an existing chat room" << std::endl;
@@ -63,54 +84,240 @@ void print_help() {
         std::cout << " /whoall                   -> List all online users" << std::endl;
         std::cout << " /kick <username>          -> Kick user to the Lobby" << std::endl;
         std::cout << " /deleteroom <roomname>    -> Delete a chat room" << std::endl;
+        std::cout << " /stats                    -> Show server counters and latencies" << std::endl;
+        std::cout << " /search <room> <words>    -> Search a room's history (from:<nick>, since:<12h>)" << std::endl;
     }
     std::cout << def_col;
     display_prompt();
 }
 
-void process_message(const std::string& received_str) {
-    std::lock_guard<std::mutex> lock(console_mutex);
-    clear_current_line();
-
-    std::stringstream ss(received_str);
-    std::string type;
-    ss >> type;
-    
-    std::string body;
-    std::getline(ss >> std::ws, body);
-
-    if (type == "MSG") {
-        std::stringstream msg_ss(body);
-        int color_code;
-        std::string sender_nick, room_tag, msg_body;
-        msg_ss >> color_code >> sender_nick >> room_tag;
-        std::getline(msg_ss, msg_body);
-        
-        if (sender_nick == nickname) {
-             std::cout << get_color(1) << sender_nick << " " << room_tag << ":" << def_col << msg_body << std::endl;
-        } else {
-             std::cout << get_color(color_code) << sender_nick << " " << room_tag << ":" << def_col << msg_body << std::endl;
+// Both wire formats end up here. For MSG, color_code is the sender's id. The
+// text is appended to `out`; nothing is written to the terminal yet.
+void show_message(uint8_t opcode, int color_code, std::string_view sender_nick, std::string_view room_tag, std::string_view body, std::string& out) {
+    if (opcode == OP_MSG) {
+        out += sender_nick == nickname ? get_color(1) : get_color(color_code);
+        out.append(sender_nick).append(" ").append(room_tag).append(":").append(def_col).append(" ").append(body) += '\n';
+    } else if (opcode == OP_SYS_MSG) {
+        out.append(get_color(5)).append(body).append(def_col) += '\n';
+    } else if (opcode == OP_P_MSG) {
+        out.append(get_color(3)).append(body).append(def_col) += '\n';
+    } else if (opcode == OP_CMD_RESP) {
+        size_t start = out.size();
+        out.append(get_color(2)).append(body) += '\n';
+        std::replace(out.begin() + start, out.end(), '|', '\n');
+    } else if (opcode == OP_JOIN_SUCCESS) {
+        {
+            std::lock_guard<std::mutex> lock(console_mutex);
+            current_room = std::string(body);
         }
+        out.append(get_color(2)).append("Successfully moved to [").append(current_room) += "].\n";
+    }
+}
+
+// Answers the server's heartbeat from the receive thread, so a client sitting at
+// the prompt is not taken for a dead one.
+void send_pong() {
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    if (binary_mode) {
+        FrameRef frame = encode_binary_frame(OP_PONG, {}, {""});
+        send(client_socket, frame.data(), (int)frame.size(), 0);
+    } else {
+        send(client_socket, "PONG\n", 5, 0);
+    }
+}
 
+// Splits off the next space-separated field, skipping leading spaces.
+std::string_view next_field(std::string_view& rest) {
+    while (!rest.empty() && rest.front() == ' ') rest.remove_prefix(1);
+    size_t space = std::min(rest.find(' '), rest.size());
+    std::string_view field = rest.substr(0, space);
+    rest.remove_prefix(space);
+    while (!rest.empty() && rest.front() == ' ') rest.remove_prefix(1);
+    return field;
+}
+
+void process_message(std::string_view received, std::string& out) {
+    std::string_view body = received;
+    std::string_view type = next_field(body);
+
+    if (type == "SESSION") {
+        session_token = std::string(body);
+    } else if (type == "PING") {
+        send_pong();
+    } else if (type == "MSG") {
+        int color_code = 0;
+        std::string_view id = next_field(body);
+        std::from_chars(id.data(), id.data() + id.size(), color_code);
+        std::string_view sender_nick = next_field(body);
+        std::string_view room_tag = next_field(body);
+        show_message(OP_MSG, color_code, sender_nick, room_tag, body, out);
     } else if (type == "SYS_MSG") {
-        std::cout << get_color(5) << body << def_col << std::endl;
+        show_message(OP_SYS_MSG, 0, "", "", body, out);
     } else if (type == "P_MSG") {
-        std::cout << get_color(3) << body << def_col << std::endl;
+        show_message(OP_P_MSG, 0, "", "", body, out);
     } else if (type == "CMD_RESP") {
-        std::replace(body.begin(), body.end(), '|', '\n');
-        std::cout << get_color(2) << body << std::endl;
+        show_message(OP_CMD_RESP, 0, "", "", body, out);
     } else if (type == "JOIN_SUCCESS") {
-        current_room = body;
-        std::cout << get_color(2) << "Successfully moved to [" << current_room << "]." << std::endl;
+        show_message(OP_JOIN_SUCCESS, 0, "", "", body, out);
     }
-    display_prompt();
 }
 
+void process_binary_message(const BinaryMessage& msg, std::string& out) {
+    if (msg.opcode == OP_SESSION) {
+        session_token = std::string(msg.strings[0]);
+    } else if (msg.opcode == OP_PING) {
+        send_pong();
+    } else if (msg.opcode == OP_MSG) {
+        // The server only sends chat from the room we are in; the tag is for display.
+        std::string room_tag = "[" + (msg.ids[1] == current_room_id ? current_room : "#" + std::to_string(msg.ids[1])) + "]";
+        show_message(OP_MSG, (int)msg.ids[0], msg.strings[0], room_tag, msg.strings[1], out);
+    } else {
+        if (msg.opcode == OP_JOIN_SUCCESS) current_room_id = msg.ids[0];
+        show_message(msg.opcode, 0, "", "", msg.strings[0], out);
+    }
+}
+
+// Handles every complete message in the receive ring. Everything they show is
+// written to the terminal in one go, with one prompt redraw, so a burst costs
+// one console write rather than one per line. Returns false if the server sent
+// something that is not valid in the negotiated protocol.
+bool process_received() {
+    static const char clear_line[] = "\r\033[K"; // the prompt, and whatever was typed after it
+    std::string& out = render_buffer;
+    out.assign(clear_line);
+    bool valid = true;
+    std::string_view message;
+    LineFramer::Result result;
+    while (valid && (result = receive_framer.next_line(message)) != LineFramer::Result::NeedMore) {
+        if (result == LineFramer::Result::Invalid) {
+            valid = false;
+        } else if (result == LineFramer::Result::TooLong) {
+            out.append(get_color(5)).append("[A message too long to show was skipped.]").append(def_col) += '\n';
+        } else if (binary_mode) {
+            BinaryMessage msg;
+            valid = decode_binary_message(message, msg);
+            if (valid) process_binary_message(msg, out);
+        } else if (!message.empty()) {
+            process_message(message, out);
+        }
+    }
+    if (out.size() > sizeof(clear_line) - 1) {
+        out += prompt_text();
+        std::lock_guard<std::mutex> lock(console_mutex);
+        std::cout.write(out.data(), (std::streamsize)out.size());
+        std::cout.flush();
+    }
+    return valid;
+}
+
+// Starts framing afresh on a new connection, beginning with whatever arrived
+// behind the AUTH_SUCCESS line.
+void reset_receive(const std::string& leftover) {
+    receive_framer = LineFramer(RECEIVE_RING_BYTES);
+    if (binary_mode) receive_framer.set_length_prefixed();
+    size_t copied = 0;
+    while (copied < leftover.size()) {
+        char* dest = receive_framer.write_ptr();
+        size_t n = std::min(receive_framer.write_space(), leftover.size() - copied);
+        std::memcpy(dest, leftover.data() + copied, n);
+        receive_framer.commit(n);
+        copied += n;
+    }
+}
+
+SOCKET connect_to_server() {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(10000);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Reads the AUTH_SUCCESS/AUTH_FAIL line. Anything after it already belongs to the
+// chat session and stays in buffer.
+bool read_auth_reply(SOCKET sock, std::string& buffer, std::string& response) {
+    size_t line_end;
+    char auth_buf[1024];
+    while ((line_end = buffer.find('\n')) == std::string::npos) {
+        int bytes_received = recv(sock, auth_buf, sizeof(auth_buf), 0);
+        if (bytes_received <= 0) return false;
+        buffer.append(auth_buf, bytes_received);
+    }
+    response = buffer.substr(0, line_end);
+    buffer.erase(0, line_end + 1);
+    return true;
+}
+
+void print_notice(const std::string& text) {
+    std::lock_guard<std::mutex> lock(console_mutex);
+    clear_current_line();
+    std::cout << get_color(5) << text << def_col << std::endl;
+}
+
+// Logs back in with the session token after the connection drops, waiting
+// longer after each failed attempt. Returns false once the server refuses the
+// token or every attempt has failed.
+bool reconnect() {
+    int delay_s = 1;
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS && !exit_flag; ++attempt) {
+        print_notice("Server connection lost, reconnecting in " + std::to_string(delay_s) + " s...");
+        std::this_thread::sleep_for(std::chrono::seconds(delay_s));
+        delay_s = std::min(delay_s * 2, RECONNECT_MAX_DELAY_S);
+        SOCKET sock = connect_to_server();
+        if (sock == INVALID_SOCKET) continue;
+        std::string request = "RESUME " + session_token + " " + current_room + (request_binary ? " " PROTOCOL_BINARY_TOKEN : "") + "\n";
+        std::string buffer, response;
+        if (send(sock, request.c_str(), (int)request.length(), 0) == SOCKET_ERROR || !read_auth_reply(sock, buffer, response)) {
+            closesocket(sock);
+            continue;
+        }
+        if (response.compare(0, 12, "AUTH_SUCCESS") != 0) {
+            closesocket(sock);
+            print_notice("Could not resume the session: " + response.substr(response.find(' ') + 1));
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(socket_mutex);
+            closesocket(client_socket);
+            client_socket = sock;
+            binary_mode = response.size() > 7 && response.compare(response.size() - 7, 7, " " PROTOCOL_BINARY_TOKEN) == 0;
+        }
+        reset_receive(buffer);
+        // The server sends JOIN_SUCCESS if it put us back in a room other than the Lobby.
+        {
+            std::lock_guard<std::mutex> lock(console_mutex);
+            current_room = "Lobby";
+        }
+        current_room_id = 0;
+        print_notice("Reconnected.");
+        return true;
+    }
+    return false;
+}
+
+// Receives straight into the framer's ring: no copy between the socket and the
+// decoded messages.
 void recv_message() {
-    char buffer[MAX_BUFFER_SIZE];
-    std::string receive_buffer;
     while (!exit_flag) {
-        int bytes_received = recv(client_socket, buffer, MAX_BUFFER_SIZE - 1, 0);
+        if (!process_received()) {
+            console_mutex.lock();
+            clear_current_line();
+            std::cout << "\nServer sent a malformed frame." << std::endl;
+            console_mutex.unlock();
+            exit_flag = true;
+            break;
+        }
+        char* dest = receive_framer.write_ptr();
+        int bytes_received = recv(client_socket, dest, (int)std::min<size_t>(receive_framer.write_space(), INT_MAX), 0);
+        if (bytes_received <= 0 && !exit_flag && !session_token.empty()) {
+            if (reconnect()) continue;
+        }
         if (bytes_received <= 0) {
             console_mutex.lock();
             clear_current_line();
@@ -119,17 +326,7 @@ void recv_message() {
             exit_flag = true;
             break;
         }
-        buffer[bytes_received] = '\0';
-        receive_buffer += buffer;
-
-        size_t pos;
-        while ((pos = receive_buffer.find('\n')) != std::string::npos) {
-            std::string message = receive_buffer.substr(0, pos);
-            receive_buffer.erase(0, pos + 1);
-            if (!message.empty()) {
-                process_message(message);
-            }
-        }
+        receive_framer.commit((size_t)bytes_received);
     }
 }
 
@@ -159,25 +356,28 @@ void send_message() {
             exit_flag = true;
         }
         
-        send(client_socket, line.c_str(), (int)line.length(), 0);
-        if (line == "/exit") break;
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        if (binary_mode) {
+            FrameRef frame = encode_binary_frame(OP_LINE, {}, {line});
+            send(client_socket, frame.data(), (int)frame.size(), 0);
+        } else {
+            line += '\n';
+            send(client_socket, line.c_str(), (int)line.length(), 0);
+        }
+        if (exit_flag) break;
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // The binary protocol is used whenever the server supports it; --text forces lines.
+    request_binary = !(argc > 1 && std::string(argv[1]) == "--text");
     enable_virtual_terminal_processing();
     WSADATA wsaData; if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return 1;
-    client_socket = socket(AF_INET, SOCK_STREAM, 0); if (client_socket == INVALID_SOCKET) { WSACleanup(); return 1; }
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(10000);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(client_socket, (sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        closesocket(client_socket); WSACleanup(); return 1;
-    }
+    client_socket = connect_to_server();
+    if (client_socket == INVALID_SOCKET) { WSACleanup(); return 1; }
 
     bool authenticated = false;
+    std::string auth_buffer; // what arrived after the AUTH_SUCCESS line belongs to the chat
     while (!authenticated && !exit_flag) {
         std::cout << "\033[1;36m" << "+------------------------------------------+" << std::endl;
         std::cout << "|        Welcome to the CTC Server!        |" << std::endl;
@@ -209,28 +409,27 @@ int main() {
                 }
             }
 
-            std::string request = (choice == "1" ? "LOGIN " : "SIGNUP ") + user + " " + pass + " " + nick;
+            std::string request = (choice == "1" ? "LOGIN " : "SIGNUP ") + user + " " + pass + " " + nick +
+                                  (request_binary ? " " PROTOCOL_BINARY_TOKEN : "") + "\n";
             send(client_socket, request.c_str(), (int)request.length(), 0);
 
-            char auth_buf[1024];
-            int bytes_received = recv(client_socket, auth_buf, 1023, 0);
-            if (bytes_received <= 0) {
+            std::string response;
+            if (!read_auth_reply(client_socket, auth_buffer, response)) {
                 std::cout << "Server disconnected." << std::endl;
                 exit_flag = true; break;
             }
-            auth_buf[bytes_received] = '\0';
-            std::string response(auth_buf);
-            response.erase(std::remove(response.begin(), response.end(), '\n'), response.end());
             
             std::stringstream resp_ss(response);
-            std::string status, admin_str;
+            std::string status, admin_str, protocol;
             resp_ss >> status >> admin_str;
 
             if (status == "AUTH_SUCCESS") {
                 authenticated = true;
                 username = user;
                 is_client_admin = (admin_str == "true");
-                std::getline(resp_ss >> std::ws, nickname);
+                resp_ss >> nickname >> protocol;
+                binary_mode = protocol == PROTOCOL_BINARY_TOKEN;
+                reset_receive(auth_buffer);
                 std::cout << "\033[2J\033[1;1H";
             } else {
                 std::string error_msg = response.substr(response.find(" ") + 1);
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "crypto.h"
+#include "frame.h"
+#include "metrics.h"
+#include "platform.h"
+#include "protocol.h"
+
+// Cluster mode: several server processes share one user namespace and split the
+// rooms between them. Every room has an owner node, picked by consistent hashing
+// of its name, which runs the room's ordering and keeps its presence for the
+// whole cluster. Nodes talk over the bus: one TCP connection from each node to
+// every other, each carrying messages in the binary frame format of protocol.h,
+//
+//     varint length | opcode | varint ids... | strings...
+//
+// with the layouts below. Each node sends only on the connections it opened and
+// only reads the ones it accepted, with one exception: the accepting node first
+// sends a random challenge, and the connecting node's HELLO carries an HMAC of
+// it under the cluster key. Nothing else is read from a connection until a
+// valid HELLO, so only holders of the key can speak for a node. The node list
+// is fixed at startup.
+#define CLUSTER_VNODES 64      // points per node on the hash ring
+#define CLUSTER_NODE_SHIFT 24  // client ids are (node << CLUSTER_NODE_SHIFT) | n
+#define CLUSTER_MAX_NODES 64
+#define BUS_RETRY_MS 1000      // between attempts to reach a node that is down
+#define BUS_POLL_MS 1          // bus wakeup interval where there is no eventfd
+#define BUS_READ_BYTES 65536
+#define BUS_MAX_BACKLOG (16 * 1024 * 1024) // unsent bytes per node before messages are dropped
+#define BUS_HANDSHAKE_MS 5000  // for the challenge to arrive on a new connection
+
+enum BusOpcode : uint8_t {
+    BUS_HELLO = 1,       // sender node | HMAC of the challenge (first on every connection)
+    BUS_ONLINE = 2,      // client id | username, nickname
+    BUS_OFFLINE = 3,     // client id |
+    BUS_ACCOUNT = 4,     // | username, nickname, password hash (never an admin)
+    BUS_ROOM_CREATE = 5, // | room
+    BUS_ROOM_DELETE = 6, // | room, nickname of the admin
+    BUS_MEMBER = 7,      // entered, client id | room, nickname, username (to the owner)
+    BUS_RELAY = 8,       // is chat | room, line (to the owner, which puts it in order)
+    BUS_DELIVER = 9,     // is chat | room, line (from the owner, once per node with members)
+    BUS_PMSG = 10,       // | target username, sender nickname, text
+    BUS_KICK = 11,       // reply to | target username
+    BUS_WHO = 12,        // reply to | room (to the owner)
+    BUS_REPLY = 13,      // client id | CMD_RESP line for that client
+    BUS_CHALLENGE = 14,  // | random challenge (the only message sent back on a connection)
+};
+
+#define BUS_MAX_IDS 2
+#define BUS_MAX_STRINGS 3
+
+inline BinaryLayout bus_layout(uint8_t opcode) {
+    switch (opcode) {
+        case BUS_HELLO: return {1, 1};
+        case BUS_ONLINE: return {1, 2};
+        case BUS_OFFLINE: return {1, 0};
+        case BUS_ACCOUNT: return {0, 3};
+        case BUS_ROOM_CREATE: return {0, 1};
+        case BUS_ROOM_DELETE: return {0, 2};
+        case BUS_MEMBER: return {2, 3};
+        case BUS_RELAY: return {1, 2};
+        case BUS_DELIVER: return {1, 2};
+        case BUS_PMSG: return {0, 3};
+        case BUS_KICK: return {1, 1};
+        case BUS_WHO: return {1, 1};
+        case BUS_REPLY: return {1, 1};
+        case BUS_CHALLENGE: return {0, 1};
+        default: return {0, 0};
+    }
+}
+
+// A decoded bus message. The views point into the payload it was decoded from.
+struct BusMessage {
+    uint8_t opcode = 0;
+    uint32_t ids[BUS_MAX_IDS] = {0, 0};
+    std::string_view strings[BUS_MAX_STRINGS];
+};
+
+inline bool decode_bus_message(std::string_view payload, BusMessage& msg) {
+    if (payload.empty()) return false;
+    const char* pos = payload.data();
+    const char* end = pos + payload.size();
+    msg.opcode = (uint8_t)*pos++;
+    BinaryLayout layout = bus_layout(msg.opcode);
+    if (layout.ids == 0 && layout.strings == 0) return false; // unknown opcode
+    for (int i = 0; i < layout.ids; ++i) {
+        if (!get_varint(pos, end, msg.ids[i])) return false;
+    }
+    for (int i = 0; i < layout.strings; ++i) {
+        uint32_t length = (uint32_t)(end - pos);
+        if (i + 1 < layout.strings && (!get_varint(pos, end, length) || length > (uint32_t)(end - pos))) return false;
+        msg.strings[i] = std::string_view(pos, length);
+        pos += length;
+    }
+    return true;
+}
+
+inline uint64_t fnv1a_64(std::string_view text) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Consistent hashing with CLUSTER_VNODES points per node, so rooms spread evenly
+// and adding a node to the list moves only about 1/n of them.
+class HashRing {
+public:
+    void build(size_t nodes) {
+        points_.clear();
+        for (size_t node = 0; node < nodes; ++node) {
+            for (int v = 0; v < CLUSTER_VNODES; ++v) {
+                points_.emplace_back(fnv1a_64("node-" + std::to_string(node) + "-" + std::to_string(v)), (int)node);
+            }
+        }
+        std::sort(points_.begin(), points_.end());
+    }
+
+    int owner(std::string_view key) const {
+        if (points_.empty()) return 0;
+        auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(fnv1a_64(key), -1));
+        return it == points_.end() ? points_.front().second : it->second;
+    }
+
+private:
+    std::vector<std::pair<uint64_t, int>> points_;
+};
+
+// The sending side of the link to one other node. Any thread may queue messages;
+// the bus thread writes everything queued since its last pass in one send, so
+// messages produced together cross the network together.
+struct BusPeer {
+    std::string host;
+    int port = 0;
+    sockaddr_storage address{}; // resolved at startup
+    socklen_t address_length = 0;
+
+    std::mutex mutex;
+    std::string outbox;
+    bool up = false;              // messages are only queued while the link is up
+    bool flush_scheduled = false; // the bus thread has been told about the outbox
+    // Signups the node may not have: queued while the link was down, or not yet
+    // written to the socket when it went down. Sent again when the link comes back.
+    std::vector<FrameRef> missed_accounts;
+    std::deque<std::pair<uint64_t, FrameRef>> unsent_accounts; // (where it ends in the link's stream, message)
+    uint64_t written_bytes = 0;   // written on the current link
+
+    // Bus thread only.
+    SOCKET socket = INVALID_SOCKET;
+    bool connecting = false;
+    bool awaiting_challenge = false; // connected, HELLO not sent yet
+    bool waiting_writable = false;   // the last send left part of the outbox behind
+    std::string inbox;               // the challenge, as it arrives
+    std::chrono::steady_clock::time_point next_attempt;
+    std::chrono::steady_clock::time_point handshake_deadline;
+};
+
+struct Cluster {
+    bool enabled = false;
+    int self = 0;
+    std::vector<std::unique_ptr<BusPeer>> peers; // indexed by node id; peers[self] is unused
+    HashRing ring;
+    std::string key; // authenticates HELLOs; every node derives the same one
+#ifdef __linux__
+    int wakeup_fd = -1; // eventfd, signalled when an outbox goes from idle to pending
+#endif
+};
+
+inline Cluster cluster;
+
+inline int cluster_node_of(int client_id) {
+    return client_id >> CLUSTER_NODE_SHIFT;
+}
+
+// Connection ids carry the node they were made on, so they are unique across the
+// cluster. The low bits wrap after 2^CLUSTER_NODE_SHIFT connections.
+inline int cluster_client_id(int sequence) {
+    if (!cluster.enabled) return sequence;
+    return (cluster.self << CLUSTER_NODE_SHIFT) | (sequence & ((1 << CLUSTER_NODE_SHIFT) - 1));
+}
+
+// What a HELLO from node `from` to node `to` must carry for this challenge.
+inline std::string bus_hello_mac(std::string_view challenge, int from, int to) {
+    return hmac_sha256_hex(cluster.key, std::string(challenge) + ":" + std::to_string(from) + ":" + std::to_string(to));
+}
+
+inline void bus_append(std::string& outbox, const FrameRef& message) {
+    outbox.append(message.data(), message.size());
+}
+
+inline FrameRef bus_message(uint8_t opcode, std::initializer_list<uint32_t> ids, std::initializer_list<std::string_view> strings) {
+    return encode_binary_frame(opcode, ids, strings);
+}
+
+inline void cluster_wake() {
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(cluster.wakeup_fd, &one, sizeof(one)) < 0) {} // EAGAIN: already signalled
+#endif
+}
+
+// Queues a message for one node. Messages for a node whose link is down are
+// dropped, and false returned; the node gets this node's full state again when
+// the link comes back. A retained message (a signup) is kept for that instead.
+inline bool cluster_send(int node, const FrameRef& message, bool retain = false) {
+    BusPeer& peer = *cluster.peers[node];
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(peer.mutex);
+        if (!peer.up || peer.outbox.size() > BUS_MAX_BACKLOG) {
+            if (retain) peer.missed_accounts.push_back(message);
+            metrics_count(COUNTER_BUS_DROPPED);
+            return false;
+        }
+        bus_append(peer.outbox, message);
+        if (retain) peer.unsent_accounts.emplace_back(peer.written_bytes + peer.outbox.size(), message);
+        wake = !peer.flush_scheduled;
+        peer.flush_scheduled = true;
+    }
+    metrics_count(COUNTER_BUS_MESSAGES_OUT);
+    if (wake) cluster_wake();
+    return true;
+}
+
+inline bool cluster_send(int node, uint8_t opcode, std::initializer_list<uint32_t> ids, std::initializer_list<std::string_view> strings) {
+    return cluster_send(node, bus_message(opcode, ids, strings));
+}
+
+// Encoded once, queued for every other node.
+inline void cluster_broadcast(uint8_t opcode, std::initializer_list<uint32_t> ids, std::initializer_list<std::string_view> strings) {
+    FrameRef message = bus_message(opcode, ids, strings);
+    for (size_t node = 0; node < cluster.peers.size(); ++node) {
+        if ((int)node != cluster.self) cluster_send((int)node, message);
+    }
+}
+
+// Signups must reach every node, so unlike other messages they survive a link
+// that is down or goes down.
+inline void cluster_broadcast_account(std::string_view username, std::string_view nickname, std::string_view password_hash) {
+    FrameRef message = bus_message(BUS_ACCOUNT, {}, {username, nickname, password_hash});
+    for (size_t node = 0; node < cluster.peers.size(); ++node) {
+        if ((int)node != cluster.self) cluster_send((int)node, message, true);
+    }
+}
+
+inline size_t cluster_links_up() {
+    size_t up = 0;
+    for (const auto& peer : cluster.peers) {
+        std::lock_guard<std::mutex> lock(peer->mutex);
+        if (peer->up) ++up;
+    }
+    return up;
+}
+
+// "host:port,host:port,..." in node id order. An IPv6 host may be written in
+// brackets, as in [::1]:7001.
+inline bool parse_cluster_nodes(const std::string& text, std::vector<std::pair<std::string, int>>& nodes) {
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = std::min(text.find(',', start), text.size());
+        std::string entry = text.substr(start, end - start);
+        size_t colon = entry.rfind(':');
+        if (colon == std::string::npos || colon == 0) return false;
+        int port = std::atoi(entry.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) return false;
+        std::string host = entry.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        nodes.emplace_back(host, port);
+        start = end + 1;
+    }
+    return !nodes.empty() && nodes.size() <= CLUSTER_MAX_NODES;
+}
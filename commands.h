@@ -0,0 +1,505 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "rooms.h"
+#include "auth_pool.h"
+#include "search_index.h"
+#include "tokenizer.h"
+#include "user_store.h"
+
+// The slash commands and the table process_lines dispatches them from.
+// The sender's view of the world for one command. room is the room the client
+// was in when the command arrived.
+struct CommandContext {
+    Connection& conn;
+    Outbound& out;
+    Room& room;
+};
+
+// Command handlers return false when the connection should be closed.
+typedef bool (*CommandHandler)(CommandContext& ctx, Tokenizer& args);
+
+inline bool cmd_exit(CommandContext&, Tokenizer&) {
+    return false;
+}
+
+// The three presence commands read snapshots: a pointer load and a send, with
+// the reply encoded once per version. They take no registry or room lock.
+inline std::string who_reply(const Room& room, const RoomPresence& presence) {
+    std::string user_list_msg = "CMD_RESP --- Users in [" + room.name + "] ---";
+    for (const PresenceEntry& entry : presence.members) {
+        user_list_msg += "| - " + entry.nickname;
+    }
+    return user_list_msg;
+}
+
+// A room owned by another cluster node is asked over the bus, which answers the
+// client with BUS_REPLY.
+inline bool cmd_who(CommandContext& ctx, Tokenizer&) {
+    if (!room_is_local(ctx.room)) {
+        if (!cluster_send(ctx.room.owner, BUS_WHO, {(uint32_t)ctx.conn.id}, {ctx.room.name})) {
+            send_to_client(ctx.out, "CMD_RESP [Error] The server that holds this room cannot be reached.");
+        }
+        return true;
+    }
+    std::shared_ptr<const RoomPresence> presence = ctx.room.presence.load();
+    send_cached_reply(ctx.out, presence->who, [&] { return who_reply(ctx.room, *presence); });
+    return true;
+}
+
+inline bool cmd_whoall(CommandContext& ctx, Tokenizer&) {
+    uint64_t version = presence_version.load(std::memory_order_acquire);
+    std::shared_ptr<const OnlineList> online = online_list.load();
+    if (online->version != version) {
+        // Some room changed since the cached reply was built. Racing readers may
+        // both rebuild; either result is at least as new as `version`.
+        auto next = std::make_shared<OnlineList>();
+        next->version = version;
+        online_list.store(next);
+        online = std::move(next);
+    }
+    send_cached_reply(ctx.out, online->whoall, [] {
+        std::vector<Room*> all_rooms;
+        {
+            std::shared_lock<std::shared_mutex> lock(room_index_mutex);
+            for (const auto& room : room_table) all_rooms.push_back(room.get());
+        }
+        std::string user_list_msg = "CMD_RESP --- All Online Users ---";
+        std::unordered_set<int> listed; // in cluster mode: clients already shown
+        for (Room* room : all_rooms) {
+            if (!room_is_local(*room)) continue;
+            std::shared_ptr<const RoomPresence> presence = room->presence.load();
+            for (const PresenceEntry& entry : presence->members) {
+                user_list_msg += "| - " + entry.nickname + " (" + entry.username + ") in [" + room->name + "]";
+                if (cluster.enabled) listed.insert(entry.id);
+            }
+        }
+        if (!cluster.enabled) return user_list_msg;
+        // Rooms owned elsewhere: this node's own clients there, then whoever else
+        // is online on the other nodes.
+        for (RegistryShard& shard : registry) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& entry : shard.by_id) {
+                const ClientInfo& client = *entry.second;
+                Room* room = client.room.load(std::memory_order_acquire);
+                if (!room || listed.count(client.id)) continue;
+                user_list_msg += "| - " + client.nickname + " (" + client.username + ") in [" + room->name + "]";
+            }
+        }
+        std::shared_lock<std::shared_mutex> lock(directory_mutex);
+        for (const auto& entry : remote_clients) {
+            if (listed.count(entry.first)) continue;
+            user_list_msg += "| - " + entry.second.nickname + " (" + entry.second.username + ") on node " +
+                             std::to_string(cluster_node_of(entry.first));
+        }
+        return user_list_msg;
+    });
+    return true;
+}
+
+inline bool cmd_list(CommandContext& ctx, Tokenizer&) {
+    std::shared_ptr<const RoomList> list = room_list.load();
+    send_cached_reply(ctx.out, list->list, [&] {
+        std::string room_list_msg = "CMD_RESP --- Active Rooms ---";
+        if (list->names.empty()) {
+            room_list_msg += "|[No rooms available yet]";
+        } else {
+            for (const auto& room : list->names) {
+                room_list_msg += "| - " + room;
+            }
+        }
+        return room_list_msg;
+    });
+    return true;
+}
+
+inline bool cmd_history(CommandContext& ctx, Tokenizer& args) {
+    long count = (long)std::max<size_t>(history_log.replay_count, 1);
+    std::string_view count_arg = args.next();
+    if (!count_arg.empty()) {
+        count = 0;
+        std::from_chars(count_arg.data(), count_arg.data() + count_arg.size(), count);
+    }
+    if (!ctx.room.history) {
+        send_to_client(ctx.out, "CMD_RESP [Error] History is disabled on this server.");
+    } else if (count <= 0) {
+        send_to_client(ctx.out, "CMD_RESP [Error] Usage: /history <count>");
+    } else {
+        std::vector<std::string> lines;
+        history_query(*ctx.room.history, std::min((size_t)count, (size_t)HISTORY_MAX_QUERY), lines);
+        send_to_client(ctx.out, "CMD_RESP --- Last " + std::to_string(lines.size()) + " message(s) in [" + ctx.room.name + "] ---");
+        for (const std::string& line : lines) send_to_client(ctx.out, line, ctx.room.id);
+    }
+    return true;
+}
+
+// Runs on an auth worker: the index lookup and the history reads touch the disk.
+inline std::vector<std::string> search_reply(const std::string& room_name, const std::string& terms, const SearchQuery& query, int64_t now) {
+    std::vector<std::string> reply;
+    RoomHistory* history = history_find(room_name);
+    if (!history) {
+        reply.push_back("CMD_RESP [Error] No history for room '" + room_name + "'.");
+        return reply;
+    }
+    std::vector<std::pair<int64_t, std::string>> results;
+    history_search(*history, query, SEARCH_MAX_RESULTS, results);
+    reply.push_back("CMD_RESP --- " + std::to_string(results.size()) + " match(es) for '" + terms + "' in [" + room_name + "], newest first ---");
+    if (!history->index->caught_up()) reply.push_back("CMD_RESP [Info] This room's index is still being built; older messages may be missing.");
+    for (const auto& result : results) {
+        // "MSG <id> <nickname> [room] text" is shown from the nickname on.
+        std::string_view line = result.second;
+        if (line.substr(0, 4) == "MSG ") {
+            line.remove_prefix(4);
+            line.remove_prefix(std::min(line.find(' ') + 1, line.size()));
+        }
+        int64_t age = std::max<int64_t>(now - result.first, 0);
+        std::string when = age < 60 ? std::to_string(age) + "s" : age < 3600 ? std::to_string(age / 60) + "m" :
+                           age < 86400 ? std::to_string(age / 3600) + "h" : std::to_string(age / 86400) + "d";
+        reply.push_back("CMD_RESP (" + when + " ago) " + std::string(line));
+    }
+    return reply;
+}
+
+// /search <room> <words...> [from:<nickname>] [since:<age>]. Every word must
+// appear; results come newest first, one frame each, from the room's index.
+// Rooms that were deleted or not used since the restart can still be searched.
+// The query runs on the auth pool and the reply comes back through the loop's
+// mailbox, like a login's.
+inline bool cmd_search(CommandContext& ctx, Tokenizer& args) {
+    std::string room_name(args.next());
+    std::string terms(args.remainder());
+    SearchQuery query;
+    int64_t now = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    bool valid = !room_name.empty();
+    for (std::string_view arg = args.next(); !arg.empty(); arg = args.next()) {
+        int64_t age = 0;
+        if (arg.substr(0, 5) == "from:" && arg.size() > 5) {
+            query.terms.push_back(search_sender_term(arg.substr(5)));
+        } else if (arg.substr(0, 6) == "since:") {
+            valid = valid && search_parse_age(arg.substr(6), age);
+            query.since = now - age;
+        } else {
+            search_words(arg, [&](const std::string& word) { query.terms.push_back(word); });
+        }
+    }
+    if (!history_log.enabled) {
+        send_to_client(ctx.out, "CMD_RESP [Error] History is disabled on this server.");
+        return true;
+    }
+    if (!valid || query.terms.empty()) {
+        send_to_client(ctx.out, "CMD_RESP [Error] Usage: /search <roomname> <words> [from:<nickname>] [since:<30m|12h|7d>]");
+        return true;
+    }
+    std::shared_ptr<Outbound> out = ctx.conn.out;
+    bool queued = auth_pool.try_submit([out, room_name, terms, query = std::move(query), now] {
+        {
+            std::lock_guard<std::mutex> lock(out->mutex);
+            if (out->closed) return;
+        }
+        mailbox_post(*out->loop, new MailboxItem([out, reply = search_reply(room_name, terms, query, now)] {
+            {
+                std::lock_guard<std::mutex> lock(out->mutex);
+                if (out->closed) return;
+            }
+            for (const std::string& line : reply) send_to_client(*out, line);
+        }));
+    });
+    if (!queued) send_to_client(ctx.out, "CMD_RESP [Error] Server busy, please try again.");
+    return true;
+}
+
+// Returns false if the room already exists.
+inline bool add_room_name(const std::string& room_name) {
+    std::unique_lock<std::mutex> lock = timed_lock(rooms_mutex, HIST_LOCK_ROOMS);
+    std::shared_ptr<const RoomList> current = room_list.load();
+    if (std::find(current->names.begin(), current->names.end(), room_name) != current->names.end()) return false;
+    auto next = std::make_shared<RoomList>();
+    next->version = current->version + 1;
+    next->names = current->names;
+    next->names.push_back(room_name);
+    room_list.store(std::move(next));
+    return true;
+}
+
+inline bool cmd_create(CommandContext& ctx, Tokenizer& args) {
+    std::string room_name(args.next());
+    if (!is_valid_room_name(room_name)) {
+        send_to_client(ctx.out, "CMD_RESP [Error] Invalid room name (at most " + std::to_string(ROOM_NAME_MAX_BYTES) + " bytes).");
+        return true;
+    }
+    if (!add_room_name(room_name)) {
+        send_to_client(ctx.out, "CMD_RESP [Error] Room '" + room_name + "' already exists.");
+    } else {
+        send_to_client(ctx.out, "CMD_RESP Room '" + room_name + "' created successfully.");
+        if (cluster.enabled) cluster_broadcast(BUS_ROOM_CREATE, {}, {room_name});
+    }
+    return true;
+}
+
+inline bool cmd_join(CommandContext& ctx, Tokenizer& args) {
+    std::string room_name(args.next());
+    std::shared_ptr<const RoomList> list = room_list.load();
+    bool room_exists = std::find(list->names.begin(), list->names.end(), room_name) != list->names.end();
+    if (!room_exists && room_name != "Lobby") {
+        send_to_client(ctx.out, "CMD_RESP [Error] Room '" + room_name + "' does not exist.");
+    } else if (ctx.room.name == room_name) {
+        send_to_client(ctx.out, "CMD_RESP [Error] You are already in that room.");
+    } else {
+        move_client(ctx.conn.client, *intern_room(room_name), MoveReason::Join);
+    }
+    return true;
+}
+
+inline bool cmd_leave(CommandContext& ctx, Tokenizer&) {
+    if (&ctx.room == lobby_room) {
+        send_to_client(ctx.out, "CMD_RESP [Error] You are already in the Lobby.");
+        return true;
+    }
+    move_client(ctx.conn.client, *lobby_room, MoveReason::Join);
+    return true;
+}
+
+inline bool cmd_msg(CommandContext& ctx, Tokenizer& args) {
+    std::string target_username(args.next());
+    std::string_view private_message = args.remainder();
+
+    if (target_username.empty() || private_message.empty()) {
+        send_to_client(ctx.out, "CMD_RESP [Error] Usage: /msg <username> <message>");
+        return true;
+    }
+    if (target_username == ctx.conn.username) {
+        send_to_client(ctx.out, "CMD_RESP [Error] You cannot send a private message to yourself.");
+        return true;
+    }
+    std::shared_ptr<ClientInfo> target = registry_find_username(target_username);
+    int remote_id;
+    std::string remote_nickname;
+    if (!target && cluster.enabled && directory_find(target_username, remote_id, remote_nickname) &&
+        cluster_send(cluster_node_of(remote_id), BUS_PMSG, {}, {target_username, ctx.conn.nickname, private_message})) {
+        send_to_client(ctx.out, "P_MSG (to " + remote_nickname + "): " + std::string(private_message));
+    } else if (!target) {
+        send_to_client(ctx.out, "CMD_RESP [Error] User '" + target_username + "' not found or is not online.");
+    } else {
+        std::string formatted_to_sender = "P_MSG (to " + target->nickname + "): " + std::string(private_message);
+        std::string formatted_to_receiver = "P_MSG (from " + ctx.conn.nickname + "): " + std::string(private_message);
+        send_to_client(*target->out, formatted_to_receiver);
+        send_to_client(ctx.out, formatted_to_sender);
+    }
+    return true;
+}
+
+// Kicks a client of this node and returns the reply for the admin.
+inline std::string kick_user(const std::string& target_username) {
+    std::shared_ptr<ClientInfo> target = registry_find_username(target_username);
+    Room* kicked_from = nullptr;
+    if (target && !target->isAdmin) kicked_from = move_client(target, *lobby_room, MoveReason::Kick);
+
+    if (!target || (!target->isAdmin && !kicked_from)) {
+        return "CMD_RESP [Error] User '" + target_username + "' not found.";
+    } else if (target->isAdmin) {
+        return "CMD_RESP [Error] You cannot kick another admin.";
+    } else if (kicked_from == lobby_room) {
+        return "CMD_RESP [Info] User '" + target_username + "' is already in the Lobby.";
+    }
+    return "CMD_RESP User '" + target->nickname + "' has been kicked to the Lobby.";
+}
+
+// A user logged in on another cluster node is kicked there, and that node replies.
+inline bool cmd_kick(CommandContext& ctx, Tokenizer& args) {
+    std::string target_username(args.next());
+    int remote_id;
+    std::string remote_nickname;
+    if (cluster.enabled && !registry_find_username(target_username) && directory_find(target_username, remote_id, remote_nickname) &&
+        cluster_send(cluster_node_of(remote_id), BUS_KICK, {(uint32_t)ctx.conn.id}, {target_username})) {
+        return true;
+    }
+    send_to_client(ctx.out, kick_user(target_username));
+    return true;
+}
+
+// Returns false if there was no such room.
+inline bool remove_room_name(const std::string& room_name) {
+    std::unique_lock<std::mutex> lock = timed_lock(rooms_mutex, HIST_LOCK_ROOMS);
+    std::shared_ptr<const RoomList> current = room_list.load();
+    auto room_it = std::find(current->names.begin(), current->names.end(), room_name);
+    if (room_it == current->names.end()) return false;
+    auto next = std::make_shared<RoomList>();
+    next->version = current->version + 1;
+    next->names = current->names;
+    next->names.erase(next->names.begin() + (room_it - current->names.begin()));
+    room_list.store(std::move(next));
+    return true;
+}
+
+// Moves this node's members of a deleted room to the Lobby and tells the Lobby.
+inline void evacuate_room(const std::string& room_to_delete, const std::string& admin_nickname) {
+    std::string admin_msg = "SYS_MSG [SYSTEM] Room '" + room_to_delete + "' was deleted by " + admin_nickname + ".";
+    std::string user_msg = "SYS_MSG [SYSTEM] Room '" + room_to_delete + "' has been deleted.";
+
+    // Send differentiated messages to the Lobby, once the moved members have arrived there.
+    auto announce = [admin_msg, user_msg] {
+        std::vector<std::shared_ptr<ClientInfo>> members;
+        room_members(*lobby_room, members);
+        FrameRef admin_frame = encode_frame({admin_msg});
+        FrameRef user_frame = encode_frame({user_msg});
+        for (const auto& client : members) {
+            post_frame(client->out, client->isAdmin ? admin_frame : user_frame);
+        }
+    };
+    Room* room = find_room(room_to_delete);
+    if (!room) {
+        actor_pool.post(lobby_room->actor, announce);
+        return;
+    }
+    // The room's own actor moves its members, so no join or leave for it runs in between.
+    actor_pool.post(room->actor, [room, announce] {
+        std::vector<std::shared_ptr<ClientInfo>> members;
+        room_members(*room, members);
+        for (const auto& client : members) {
+            move_client(client, *lobby_room, MoveReason::RoomDeleted, room);
+        }
+        actor_pool.post(lobby_room->actor, announce);
+    });
+}
+
+// Every cluster node evacuates the room for its own members.
+inline bool cmd_deleteroom(CommandContext& ctx, Tokenizer& args) {
+    std::string room_to_delete(args.next());
+    if (room_to_delete == "Lobby") {
+        send_to_client(ctx.out, "CMD_RESP [Error] You cannot delete the Lobby.");
+        return true;
+    }
+    if (!remove_room_name(room_to_delete)) {
+        send_to_client(ctx.out, "CMD_RESP [Error] Room '" + room_to_delete + "' does not exist.");
+        return true;
+    }
+    send_to_client(ctx.out, "CMD_RESP Room '" + room_to_delete + "' has been deleted.");
+    if (cluster.enabled) cluster_broadcast(BUS_ROOM_DELETE, {}, {room_to_delete, ctx.conn.nickname});
+    evacuate_room(room_to_delete, ctx.conn.nickname);
+    return true;
+}
+
+// Point-in-time values for /stats and the metrics file. Every lock here is taken
+// briefly and one at a time, so sampling never stalls the event loops for long.
+inline void sample_gauges(MetricsGauges& gauges) {
+    for (RegistryShard& shard : registry) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto& entry : shard.by_id) {
+            Outbound& out = *entry.second->out;
+            std::lock_guard<std::mutex> out_lock(out.mutex);
+            ++gauges.online_clients;
+            gauges.outbound_queued_bytes += out.queued_bytes;
+            gauges.outbound_max_queue = std::max(gauges.outbound_max_queue, out.queued_bytes);
+            if (out.congested) ++gauges.congested_clients;
+        }
+    }
+    gauges.rooms = room_list.load()->names.size() + 1; // and the Lobby
+    gauges.auth_queue_depth = auth_pool.queued();
+}
+
+inline bool cmd_stats(CommandContext& ctx, Tokenizer&) {
+    MetricsSnapshot snap;
+    metrics_snapshot(snap);
+    MetricsGauges gauges;
+    sample_gauges(gauges);
+    auto uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - metrics.started);
+    std::string stats_msg = "CMD_RESP --- Server Stats ---";
+    stats_msg += "| Uptime: " + std::to_string(uptime.count()) + " s";
+    stats_msg += "| Online: " + std::to_string(gauges.online_clients) + " client(s), " + std::to_string(gauges.rooms) + " room(s)";
+    stats_msg += "| Connections: " + std::to_string(snap.counters[COUNTER_CONNECTIONS_ACCEPTED]) + " accepted, " +
+                 std::to_string(snap.counters[COUNTER_CONNECTIONS_CLOSED]) + " closed (" +
+                 std::to_string(snap.counters[COUNTER_CONNECTIONS_TIMED_OUT]) + " timed out), " +
+                 std::to_string(snap.counters[COUNTER_AUTH_FAILURES]) + " failed logins, " +
+                 std::to_string(snap.counters[COUNTER_AUTH_REJECTED]) + " turned away busy, " +
+                 std::to_string(snap.counters[COUNTER_SESSIONS_RESUMED]) + " resumed";
+    stats_msg += "| Traffic: " + std::to_string(snap.counters[COUNTER_BYTES_IN]) + " bytes in, " +
+                 std::to_string(snap.counters[COUNTER_BYTES_OUT]) + " bytes out, " +
+                 std::to_string(snap.counters[COUNTER_LINES_IN]) + " lines in";
+    stats_msg += "| Chat: " + std::to_string(snap.counters[COUNTER_CHAT_MESSAGES]) + " messages, " +
+                 std::to_string(snap.counters[COUNTER_FANOUT_FRAMES]) + " deliveries queued, " +
+                 std::to_string(snap.counters[COUNTER_DROPPED_FRAMES]) + " dropped, " +
+                 std::to_string(snap.counters[COUNTER_RATE_LIMITED]) + " rate limited, " +
+                 std::to_string(snap.counters[COUNTER_MAILBOX_POSTS]) + " loop mailbox posts";
+    uint64_t frames_out = snap.counters[COUNTER_FRAMES_OUT];
+    char per_frame[32];
+    std::snprintf(per_frame, sizeof(per_frame), "%.3f", frames_out ? (double)snap.counters[COUNTER_WRITE_CALLS] / (double)frames_out : 0.0);
+    stats_msg += "| Writes: " + std::to_string(frames_out) + " frames in " + std::to_string(snap.counters[COUNTER_WRITE_CALLS]) +
+                 " syscalls (" + per_frame + " per frame)";
+    stats_msg += "| Outbound: " + std::to_string(gauges.outbound_queued_bytes) + " bytes queued, largest " +
+                 std::to_string(gauges.outbound_max_queue) + ", " + std::to_string(gauges.congested_clients) + " congested, " +
+                 std::to_string(snap.counters[COUNTER_SLOW_CONSUMER_DISCONNECTS]) + " disconnected";
+    if (cluster.enabled) {
+        stats_msg += "| Cluster: node " + std::to_string(cluster.self) + " of " + std::to_string(cluster.peers.size()) + ", " +
+                     std::to_string(cluster_links_up()) + " link(s) up, " + std::to_string(snap.counters[COUNTER_BUS_MESSAGES_OUT]) +
+                     " messages out in " + std::to_string(snap.counters[COUNTER_BUS_WRITES]) + " writes, " +
+                     std::to_string(snap.counters[COUNTER_BUS_MESSAGES_IN]) + " in, " +
+                     std::to_string(snap.counters[COUNTER_BUS_DROPPED]) + " dropped";
+    }
+    stats_msg += "| --- count / p50 / p99 / p999 / max (times in us) ---";
+    for (int h = 0; h < HIST_COUNT; ++h) {
+        if (snap.counts[h] == 0) continue;
+        const HistogramInfo& info = HISTOGRAM_INFO[h];
+        std::string name = info.value ? info.value : info.family;
+        if (info.label && std::strcmp(info.label, "lock") == 0) name += " lock wait";
+        uint64_t divisor = info.nanoseconds ? 1000 : 1;
+        char row[160];
+        std::snprintf(row, sizeof(row), "| %s: %llu / %llu / %llu / %llu / %llu", name.c_str(),
+                      (unsigned long long)snap.counts[h], (unsigned long long)(snap.quantile(h, 0.5) / divisor),
+                      (unsigned long long)(snap.quantile(h, 0.99) / divisor), (unsigned long long)(snap.quantile(h, 0.999) / divisor),
+                      (unsigned long long)(snap.maxes[h] / divisor));
+        stats_msg += row;
+    }
+    send_to_client(ctx.out, stats_msg);
+    return true;
+}
+
+// Which of the connection's budgets a command is charged to. Cheap replies from
+// snapshots are free; commands that broadcast, touch disk or walk every room are not.
+enum class Budget { None, Msg, Command };
+
+struct CommandEntry {
+    std::string_view name;
+    CommandHandler handler;
+    bool admin_only;
+    MetricHistogram latency;
+    Budget budget;
+};
+
+// Sorted by name for binary search; the static_assert below keeps it that way.
+constexpr CommandEntry COMMAND_TABLE[] = {
+    {"/create", cmd_create, false, HIST_CMD_CREATE, Budget::Command},
+    {"/deleteroom", cmd_deleteroom, true, HIST_CMD_DELETEROOM, Budget::Command},
+    {"/exit", cmd_exit, false, HIST_CMD_EXIT, Budget::None},
+    {"/history", cmd_history, false, HIST_CMD_HISTORY, Budget::Command},
+    {"/join", cmd_join, false, HIST_CMD_JOIN, Budget::Command},
+    {"/kick", cmd_kick, true, HIST_CMD_KICK, Budget::Command},
+    {"/leave", cmd_leave, false, HIST_CMD_LEAVE, Budget::Command},
+    {"/list", cmd_list, false, HIST_CMD_LIST, Budget::None},
+    {"/msg", cmd_msg, false, HIST_CMD_MSG, Budget::Msg},
+    {"/search", cmd_search, true, HIST_CMD_SEARCH, Budget::Command},
+    {"/stats", cmd_stats, true, HIST_CMD_STATS, Budget::Command},
+    {"/who", cmd_who, false, HIST_CMD_WHO, Budget::None},
+    {"/whoall", cmd_whoall, true, HIST_CMD_WHOALL, Budget::Command},
+};
+
+constexpr bool command_table_sorted() {
+    for (size_t i = 1; i < sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]); ++i) {
+        if (!(COMMAND_TABLE[i - 1].name < COMMAND_TABLE[i].name)) return false;
+    }
+    return true;
+}
+static_assert(command_table_sorted(), "COMMAND_TABLE must be sorted by name");
+
+inline const CommandEntry* find_command(std::string_view name) {
+    auto end = std::end(COMMAND_TABLE);
+    auto it = std::lower_bound(std::begin(COMMAND_TABLE), end, name,
+                               [](const CommandEntry& entry, std::string_view key) { return entry.name < key; });
+    return it != end && it->name == name ? it : nullptr;
+}
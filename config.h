@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "rate_limit.h"
+
+// The server's settings, filled in from the command line by parse_args.
+#define SERVER_PORT 10000
+
+enum class SlowConsumerPolicy { DropOldestChat, Disconnect };
+
+struct ServerConfig {
+    // A connection whose unsent output grows past the high watermark is congested
+    // until it drains below the low watermark. The hard limit applies to frames that
+    // are never dropped (everything except chat), so a dead reader cannot grow forever.
+    size_t outbound_high_watermark = 256 * 1024;
+    size_t outbound_low_watermark = 64 * 1024;
+    size_t outbound_hard_limit = 4 * 1024 * 1024;
+    SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::DropOldestChat;
+    // Longest command or chat line a client may send, excluding the '\n'.
+    size_t max_line_length = 4096;
+    // How often the signup journal is folded back into the users.csv snapshot.
+    unsigned compact_interval_seconds = 300;
+    // Per-room chat history: where the segment logs live and how many recent
+    // messages are replayed to a client when it enters a room.
+    bool history_enabled = true;
+    std::string history_dir = "history";
+    size_t history_replay = 20;
+    // Prometheus text file rewritten every metrics_interval seconds (0 disables it).
+    std::string metrics_file = "metrics.prom";
+    unsigned metrics_interval_seconds = 10;
+    // Event loops (reactors); 0 means one per core. Each owns its connections and,
+    // on Linux, its own SO_REUSEPORT listening socket.
+    unsigned reactors = 0;
+    bool pin_reactors = true;
+    // Threads running the room actors; 0 means one per core.
+    unsigned room_workers = 0;
+    // Output queued on a loop's own thread is written once per loop iteration, or
+    // after up to flush_window_us if that is set, with one gathered write per
+    // connection. TCP_CORK is only applied to flushes that need several writes.
+    unsigned flush_window_us = 0;
+    bool tcp_nodelay = true;
+    bool tcp_cork = false;
+    // Password hashing runs on auth_workers threads (0 means one per core). Once
+    // auth_queue attempts are waiting, new ones are refused straight away.
+    unsigned auth_workers = 0;
+    size_t auth_queue = 1024;
+    uint32_t kdf_iterations = 100000;
+    // How long a session token from AUTH_SUCCESS stays good for RESUME.
+    unsigned session_ttl_seconds = 24 * 3600;
+    // A connection must log in within auth_timeout_seconds. A logged-in client
+    // that has sent nothing for ping_interval_seconds gets a PING and is dropped
+    // if it stays silent for ping_timeout_seconds more. 0 turns either check off.
+    unsigned auth_timeout_seconds = 30;
+    unsigned ping_interval_seconds = 30;
+    unsigned ping_timeout_seconds = 15;
+    // Flood control. Every connection has its own budgets for chat, for /msg and
+    // for commands that cost the server more than a reply (see COMMAND_TABLE),
+    // and every room caps the chat it fans out, whoever sends it.
+    RateLimit chat_limit{5, 10};
+    RateLimit msg_limit{2, 5};
+    RateLimit command_limit{1, 5};
+    RateLimit room_chat_limit{200, 400};
+    // Binary trace of every inbound line for the replay tool; empty means off.
+    std::string capture_file;
+    // Port clients connect to.
+    int port = SERVER_PORT;
+    // Cluster mode: the bus address of every node, "host:port,..." in node id
+    // order, and which of them this process is. Empty means a standalone server.
+    std::string cluster_nodes;
+    int node_id = 0;
+    // Unix socket for hot restarts: a new server started with the same path
+    // takes over this one's listeners and connections. Empty means off.
+    std::string handoff_path;
+    // Working directory for users.csv, users.journal, session.key, history and
+    // metrics; each cluster node on one host needs its own. Empty means the
+    // current directory.
+    std::string data_dir;
+};
+
+inline ServerConfig config;
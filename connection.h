@@ -0,0 +1,450 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "platform.h"
+#include "config.h"
+#include "frame.h"
+#include "line_framer.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
+#include "protocol.h"
+#include "rate_limit.h"
+#include "timing_wheel.h"
+
+// Connections, their outbound queues and the event loops that own them: how a
+// frame gets from any thread to a client's socket, and how work reaches a loop
+// through its mailbox. The loops themselves run in server.cpp.
+#define FLUSH_IOVECS 64 // frames gathered into one write call
+
+typedef int RoomId;
+const RoomId LOBBY_ROOM_ID = 0;
+
+struct Connection;
+struct EventLoop;
+struct ClientInfo;
+
+// Unsent output for one connection. Any thread may queue frames; only the owning
+// event loop drains the queue once the socket becomes writable again. Socket I/O
+// on it happens under its own mutex, never under a registry or room lock.
+struct Outbound {
+    SOCKET socket;
+    EventLoop* loop;
+    Connection* conn;
+    std::mutex mutex;
+    std::deque<FrameRef> frames;
+    size_t front_offset = 0; // bytes of frames.front() already written
+    size_t queued_bytes = 0;
+    bool write_armed = false;
+    bool flush_scheduled = false; // on its loop's dirty list
+    bool congested = false;
+    bool read_paused = false; // while a password is being checked; only the owning loop changes it
+    bool closed = false;
+    size_t dropped_frames = 0;
+    bool binary = false; // set before the client joins a room, read-only afterwards
+};
+
+// A CMD_RESP reply for one snapshot version, encoded by the first reader that
+// needs it and shared by every later one until the next version replaces it.
+struct CachedReply {
+    std::once_flag once;
+    FrameRef text;
+    FrameRef binary;
+};
+
+enum class ConnState { Authenticating, Verifying, Chatting };
+
+// Per-connection state machine driven by the event loops: a connection starts
+// in Authenticating and moves to Chatting once LOGIN/SIGNUP/RESUME succeeds.
+// While an auth worker checks a password it sits in Verifying, with reads
+// paused and any lines after the LOGIN/SIGNUP left in the framer.
+struct Connection {
+    Connection(SOCKET socket, int id, std::shared_ptr<Outbound> out, size_t max_line_length)
+        : socket(socket), id(id), out(std::move(out)), framer(max_line_length) {}
+
+    SOCKET socket;
+    int id;
+    std::shared_ptr<Outbound> out;
+    LineFramer framer;
+    ConnState state = ConnState::Authenticating;
+    std::string username;
+    std::string nickname;
+    bool isAdmin = false;
+    std::shared_ptr<ClientInfo> client; // set once the client enters the chat
+    // The login deadline, then the next heartbeat check. Reads only stamp
+    // last_read_tick; the timer works out when it fires whether the client
+    // was quiet, so busy connections never touch the wheel.
+    TimerNode timer;
+    uint64_t last_read_tick = 0;
+    uint64_t ping_sent_tick = 0;
+    bool ping_outstanding = false;
+    TokenBucket chat_limit;
+    TokenBucket msg_limit;
+    TokenBucket command_limit;
+    bool throttle_warned = false; // the current flood has been told to slow down
+    size_t loop_slot = 0; // index in its epoll loop's connections
+};
+
+// Frames on their way to some of one event loop's connections. The recipients
+// are picked when the item is posted, so a client that enters a room right after
+// a line was sent never gets that line ahead of its JOIN_SUCCESS. An item with a
+// task runs it on the loop instead.
+struct MailboxItem {
+    MailboxItem(std::vector<std::shared_ptr<Outbound>> recipients, FrameRef frame, RoomId room_id)
+        : recipients(std::move(recipients)), frame(std::move(frame)), room_id(room_id) {}
+    explicit MailboxItem(std::function<void()> task) : task(std::move(task)) {}
+
+    std::vector<std::shared_ptr<Outbound>> recipients;
+    FrameRef frame;
+    RoomId room_id = 0; // the Lobby
+    std::function<void()> task;
+    MailboxItem* next = nullptr;
+};
+
+struct EventLoop {
+    size_t index = 0;
+#ifdef USE_EPOLL
+    int epoll_fd = -1;
+    int wakeup_fd = -1;               // eventfd, signalled when the mailbox goes from empty to non-empty
+    SOCKET listener = INVALID_SOCKET; // this loop's own SO_REUSEPORT socket
+    MpscQueue<MailboxItem> mailbox; // any thread posts, only this loop drains
+    std::vector<Connection*> connections; // every connection it owns, for a handoff
+#else
+    std::mutex pending_mutex;
+    std::vector<Connection*> pending;
+    std::vector<MailboxItem*> pending_tasks; // also under pending_mutex
+    std::vector<Connection*> connections;
+#endif
+    // Connections that got output on this loop's thread since the last flush.
+    // Only the loop's own thread touches these.
+    std::vector<Outbound*> dirty;
+    std::vector<Outbound*> flushing;
+    std::chrono::steady_clock::time_point dirty_since;
+    // Deadlines of this loop's connections, and the current tick (TIMER_TICK_MS
+    // since the steady clock's epoch) as of the last wakeup.
+    TimingWheel timers;
+    uint64_t tick = 0;
+};
+
+inline std::vector<std::unique_ptr<EventLoop>> event_loops;
+inline thread_local EventLoop* current_loop = nullptr; // the loop running on this thread, if any
+
+inline bool would_block() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+inline bool set_non_blocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+inline int poll_sockets(pollfd* fds, size_t count, int timeout_ms) {
+#ifdef _WIN32
+    return WSAPoll(fds, (ULONG)count, timeout_ms);
+#else
+    return poll(fds, (nfds_t)count, timeout_ms);
+#endif
+}
+
+// Called with the connection's Outbound mutex held, from whichever thread queued
+// output or from the owning loop when it pauses or resumes reading.
+inline void event_loop_watch(EventLoop& loop, Connection* conn, const Outbound& out) {
+#ifdef USE_EPOLL
+    epoll_event ev{};
+    ev.events = (out.read_paused ? 0u : EPOLLIN | EPOLLRDHUP) | (out.write_armed ? EPOLLOUT : 0u);
+    ev.data.ptr = conn;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, conn->socket, &ev);
+#else
+    // The poll loop reads write_armed and read_paused each time it rebuilds its descriptor set.
+    (void)loop; (void)conn; (void)out;
+#endif
+}
+
+inline void arm_writes_unlocked(Outbound& out, bool enabled) {
+    if (out.write_armed == enabled) return;
+    out.write_armed = enabled;
+    event_loop_watch(*out.loop, out.conn, out);
+}
+
+// Called by the owning loop. Bytes the client sends meanwhile wait in the kernel.
+inline void pause_reads(Connection& conn, bool paused) {
+    std::lock_guard<std::mutex> lock(conn.out->mutex);
+    conn.out->read_paused = paused;
+    event_loop_watch(*conn.out->loop, &conn, *conn.out);
+}
+
+// Shutting the socket down makes the owning loop see EOF and run the normal farewell path.
+inline void disconnect_unlocked(Outbound& out) {
+    out.closed = true;
+    out.frames.clear();
+    out.queued_bytes = 0;
+    out.front_offset = 0;
+    shutdown(out.socket, SHUT_RDWR);
+}
+
+// One gathered write of up to FLUSH_IOVECS queued frames, starting front_offset
+// bytes into the first. Returns the bytes written or SOCKET_ERROR.
+inline long send_frames_unlocked(Outbound& out) {
+    size_t count = std::min(out.frames.size(), (size_t)FLUSH_IOVECS);
+    metrics_count(COUNTER_WRITE_CALLS);
+#ifdef _WIN32
+    WSABUF bufs[FLUSH_IOVECS];
+    for (size_t i = 0; i < count; ++i) {
+        size_t skip = i == 0 ? out.front_offset : 0;
+        bufs[i].buf = const_cast<char*>(out.frames[i].data() + skip);
+        bufs[i].len = (ULONG)(out.frames[i].size() - skip);
+    }
+    DWORD sent = 0;
+    if (WSASend(out.socket, bufs, (DWORD)count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) return SOCKET_ERROR;
+    return (long)sent;
+#else
+    iovec iov[FLUSH_IOVECS];
+    for (size_t i = 0; i < count; ++i) {
+        size_t skip = i == 0 ? out.front_offset : 0;
+        iov[i].iov_base = const_cast<char*>(out.frames[i].data() + skip);
+        iov[i].iov_len = out.frames[i].size() - skip;
+    }
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return (long)sendmsg(out.socket, &msg, MSG_NOSIGNAL);
+#endif
+}
+
+// Drops the written bytes from the front of the queue.
+inline void consume_sent_unlocked(Outbound& out, size_t sent) {
+    metrics_count(COUNTER_BYTES_OUT, sent);
+    out.queued_bytes -= sent;
+    uint64_t frames_done = 0;
+    while (sent > 0) {
+        size_t rest = out.frames.front().size() - out.front_offset;
+        if (sent < rest) {
+            out.front_offset += sent;
+            break;
+        }
+        sent -= rest;
+        out.frames.pop_front();
+        out.front_offset = 0;
+        ++frames_done;
+    }
+    metrics_count(COUNTER_FRAMES_OUT, frames_done);
+    metrics_record(HIST_WRITE_BATCH, frames_done);
+}
+
+// Holds back partial segments while a flush takes several writes. Linux only.
+inline bool set_cork(SOCKET sock, bool on) {
+#ifdef TCP_CORK
+    int value = on ? 1 : 0;
+    metrics_count(COUNTER_WRITE_CALLS);
+    return setsockopt(sock, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0;
+#else
+    (void)sock; (void)on;
+    return false;
+#endif
+}
+
+inline void enforce_outbound_limits_unlocked(Outbound& out) {
+    if (out.queued_bytes > config.outbound_high_watermark) out.congested = true;
+    if (!out.congested) return;
+    if (config.slow_consumer_policy == SlowConsumerPolicy::DropOldestChat) {
+        auto it = out.frames.begin();
+        if (out.front_offset > 0) ++it; // never cut a frame that is half on the wire
+        while (out.queued_bytes > config.outbound_low_watermark && it != out.frames.end()) {
+            if (it->droppable()) {
+                out.queued_bytes -= it->size();
+                it = out.frames.erase(it);
+                ++out.dropped_frames;
+                metrics_count(COUNTER_DROPPED_FRAMES);
+            } else {
+                ++it;
+            }
+        }
+        if (out.queued_bytes <= config.outbound_hard_limit) return;
+    }
+    std::cout << "[INFO] Disconnecting slow consumer (" << out.queued_bytes << " bytes queued)." << std::endl;
+    metrics_count(COUNTER_SLOW_CONSUMER_DISCONNECTS);
+    disconnect_unlocked(out);
+}
+
+// Queues a frame for the client. On the owning loop's thread the connection goes
+// on the loop's dirty list, and everything it is sent during the loop iteration
+// leaves in one gathered write at the end. Other threads write straight away when
+// nothing is pending. Anything the socket does not accept waits for EPOLLOUT.
+inline void send_frame(Outbound& out, const FrameRef& frame) {
+    std::lock_guard<std::mutex> lock(out.mutex);
+    if (out.closed) return;
+    out.frames.push_back(frame);
+    out.queued_bytes += frame.size();
+    if (out.write_armed || out.flush_scheduled) {
+        // Already on its way out.
+    } else if (out.loop == current_loop) {
+        EventLoop& loop = *out.loop;
+        if (loop.dirty.empty() && config.flush_window_us) loop.dirty_since = std::chrono::steady_clock::now();
+        loop.dirty.push_back(&out);
+        out.flush_scheduled = true;
+    } else {
+        long sent = send_frames_unlocked(out);
+        if (sent > 0) consume_sent_unlocked(out, (size_t)sent);
+        if (out.frames.empty()) return;
+        if (sent == SOCKET_ERROR && !would_block()) return; // the owning loop will see the error on read
+        arm_writes_unlocked(out, true);
+    }
+    if (out.write_armed) metrics_record(HIST_OUTBOUND_DEPTH, out.queued_bytes);
+    enforce_outbound_limits_unlocked(out);
+}
+
+// Re-encodes a text protocol line for a binary client. The text forms of MSG and
+// JOIN_SUCCESS do not carry the room id, so the caller supplies it.
+inline FrameRef encode_binary_line(std::string_view line, RoomId room_id) {
+    size_t space = line.find(' ');
+    std::string_view type = line.substr(0, space);
+    std::string_view body = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+    if (type == "MSG") {
+        // MSG <sender id> <nickname> [<room>] <text>
+        size_t id_end = body.find(' ');
+        size_t nick_end = id_end == std::string_view::npos ? id_end : body.find(' ', id_end + 1);
+        size_t room_end = nick_end == std::string_view::npos ? nick_end : body.find(' ', nick_end + 1);
+        uint32_t sender_id = 0;
+        if (room_end != std::string_view::npos && std::from_chars(body.data(), body.data() + id_end, sender_id).ec == std::errc()) {
+            return encode_binary_frame(OP_MSG, {sender_id, (uint32_t)room_id},
+                                       {body.substr(id_end + 1, nick_end - id_end - 1), body.substr(room_end + 1)});
+        }
+    } else if (type == "JOIN_SUCCESS") {
+        return encode_binary_frame(OP_JOIN_SUCCESS, {(uint32_t)room_id}, {body});
+    } else if (type == "CMD_RESP") {
+        std::string lines(body);
+        std::replace(lines.begin(), lines.end(), '|', '\n');
+        return encode_binary_frame(OP_CMD_RESP, {}, {lines});
+    } else if (type == "P_MSG") {
+        return encode_binary_frame(OP_P_MSG, {}, {body});
+    } else if (type == "SYS_MSG") {
+        return encode_binary_frame(OP_SYS_MSG, {}, {body});
+    } else if (type == "SESSION") {
+        return encode_binary_frame(OP_SESSION, {}, {body});
+    } else if (type == "PING") {
+        return encode_binary_frame(OP_PING, {}, {body});
+    }
+    return encode_binary_frame(OP_SYS_MSG, {}, {line});
+}
+
+// One server line in both wire formats. The binary form is derived from the text
+// one the first time a binary client needs it, so text-only rooms never pay for it.
+struct WireFrame {
+    FrameRef text;
+    RoomId room_id;
+    FrameRef binary;
+
+    const FrameRef& for_client(const Outbound& out) {
+        if (!out.binary) return text;
+        if (!binary) binary = encode_binary_line(std::string_view(text.data(), text.size() - 1), room_id);
+        return binary;
+    }
+};
+
+inline void send_to_client(Outbound& out, const std::string& message, RoomId room_id = LOBBY_ROOM_ID) {
+    send_frame(out, out.binary ? encode_binary_line(message, room_id) : encode_frame({message}));
+}
+
+template <typename Build>
+inline void send_cached_reply(Outbound& out, CachedReply& reply, Build build) {
+    std::call_once(reply.once, [&] {
+        std::string message = build();
+        reply.text = encode_frame({message});
+        reply.binary = encode_binary_line(message, LOBBY_ROOM_ID);
+    });
+    send_frame(out, out.binary ? reply.binary : reply.text);
+}
+
+// Called by the owning event loop at the end of an iteration for each dirty
+// connection, and when the socket is writable again. Returns false on a socket
+// error, in which case the connection should be closed.
+inline bool flush_outbound(Outbound& out) {
+    std::lock_guard<std::mutex> lock(out.mutex);
+    out.flush_scheduled = false;
+    bool corked = config.tcp_cork && out.frames.size() > FLUSH_IOVECS && set_cork(out.socket, true);
+    bool ok = true;
+    while (!out.frames.empty()) {
+        long sent = send_frames_unlocked(out);
+        if (sent > 0) {
+            consume_sent_unlocked(out, (size_t)sent);
+        } else if (sent == SOCKET_ERROR && would_block()) {
+            break;
+        } else {
+            ok = false;
+            break;
+        }
+    }
+    if (corked) set_cork(out.socket, false);
+    if (!ok) return false;
+    if (out.queued_bytes <= config.outbound_low_watermark) out.congested = false;
+    if (!out.closed) arm_writes_unlocked(out, !out.frames.empty());
+    return true;
+}
+
+// Sends the item's frame to each of its recipients; binary recipients share one
+// re-encoded copy.
+inline void mailbox_deliver(MailboxItem& item) {
+    if (item.task) {
+        item.task();
+        return;
+    }
+    WireFrame wire{item.frame, item.room_id, {}};
+    for (const auto& out : item.recipients) {
+        send_frame(*out, wire.for_client(*out));
+    }
+}
+
+// Hands frames to a loop, which takes ownership of the item. Only the push that
+// finds the mailbox empty writes the eventfd; the loop drains everything queued
+// behind it in one go. A loop delivers its items in the order they were posted.
+inline void mailbox_post(EventLoop& loop, MailboxItem* item) {
+    metrics_count(COUNTER_MAILBOX_POSTS);
+#ifdef USE_EPOLL
+    if (loop.mailbox.push(item)) {
+        uint64_t one = 1;
+        if (write(loop.wakeup_fd, &one, sizeof(one)) < 0) {} // EAGAIN: the counter is already non-zero
+    }
+#else
+    // The poll loops have no cheap way to be woken, so the caller delivers frames
+    // for them. Tasks must run on the loop itself and wait for its next iteration.
+    if (item->task) {
+        std::lock_guard<std::mutex> lock(loop.pending_mutex);
+        loop.pending_tasks.push_back(item);
+        return;
+    }
+    mailbox_deliver(*item);
+    delete item;
+#endif
+}
+
+#ifdef USE_EPOLL
+inline void mailbox_drain(EventLoop& loop) {
+    uint64_t signals;
+    if (read(loop.wakeup_fd, &signals, sizeof(signals)) < 0) {} // EAGAIN: nothing was signalled
+    MailboxItem* oldest = loop.mailbox.take_all();
+    while (oldest) {
+        MailboxItem* next = oldest->next;
+        mailbox_deliver(*oldest);
+        delete oldest;
+        oldest = next;
+    }
+}
+#endif
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+
+// SHA-256, HMAC-SHA256 and PBKDF2-HMAC-SHA256 (FIPS 180-4, RFC 2104, RFC 8018),
+// enough for salted password hashes and signed session tokens without linking a
+// crypto library.
+
+#define SHA256_DIGEST_BYTES 32
+#define SHA256_BLOCK_BYTES 64
+
+struct Sha256 {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block[SHA256_BLOCK_BYTES];
+    size_t block_used = 0;
+    uint64_t total_bytes = 0;
+
+    void update(const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        total_bytes += size;
+        while (size > 0) {
+            size_t take = std::min(size, SHA256_BLOCK_BYTES - block_used);
+            std::memcpy(block + block_used, bytes, take);
+            block_used += take;
+            bytes += take;
+            size -= take;
+            if (block_used == SHA256_BLOCK_BYTES) {
+                compress(block);
+                block_used = 0;
+            }
+        }
+    }
+
+    void update(std::string_view text) { update(text.data(), text.size()); }
+
+    void finish(uint8_t digest[SHA256_DIGEST_BYTES]) {
+        uint64_t bits = total_bytes * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (block_used != 56) update(&pad, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; ++i) length[i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(length, 8);
+        for (int i = 0; i < 8; ++i) {
+            for (int j = 0; j < 4; ++j) digest[4 * i + j] = (uint8_t)(state[i] >> (24 - 8 * j));
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* chunk) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)chunk[4 * i] << 24 | (uint32_t)chunk[4 * i + 1] << 16 | (uint32_t)chunk[4 * i + 2] << 8 | chunk[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+};
+
+// HMAC with the key's inner and outer pads hashed once up front, so PBKDF2 can
+// restart from them on every iteration instead of rehashing the key.
+struct HmacSha256 {
+    Sha256 inner;
+    Sha256 outer;
+
+    explicit HmacSha256(std::string_view key) {
+        uint8_t block[SHA256_BLOCK_BYTES] = {};
+        if (key.size() > SHA256_BLOCK_BYTES) {
+            Sha256 hashed;
+            hashed.update(key);
+            hashed.finish(block);
+        } else {
+            std::memcpy(block, key.data(), key.size());
+        }
+        uint8_t pad[SHA256_BLOCK_BYTES];
+        for (int i = 0; i < SHA256_BLOCK_BYTES; ++i) pad[i] = block[i] ^ 0x36;
+        inner.update(pad, sizeof(pad));
+        for (int i = 0; i < SHA256_BLOCK_BYTES; ++i) pad[i] = block[i] ^ 0x5c;
+        outer.update(pad, sizeof(pad));
+    }
+
+    void mac(const void* data, size_t size, uint8_t digest[SHA256_DIGEST_BYTES]) const {
+        Sha256 in = inner;
+        in.update(data, size);
+        in.finish(digest);
+        Sha256 out = outer;
+        out.update(digest, SHA256_DIGEST_BYTES);
+        out.finish(digest);
+    }
+};
+
+inline std::string to_hex(const uint8_t* bytes, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(size * 2, '0');
+    for (size_t i = 0; i < size; ++i) {
+        hex[2 * i] = digits[bytes[i] >> 4];
+        hex[2 * i + 1] = digits[bytes[i] & 15];
+    }
+    return hex;
+}
+
+inline std::string hmac_sha256_hex(std::string_view key, std::string_view message) {
+    uint8_t digest[SHA256_DIGEST_BYTES];
+    HmacSha256(key).mac(message.data(), message.size(), digest);
+    return to_hex(digest, sizeof(digest));
+}
+
+// One 32-byte block of PBKDF2-HMAC-SHA256, which is all a password hash needs.
+inline std::string pbkdf2_sha256_hex(std::string_view password, std::string_view salt, uint32_t iterations) {
+    HmacSha256 prf(password);
+    std::string first(salt);
+    first += std::string("\0\0\0\1", 4); // block index 1, big-endian
+    uint8_t u[SHA256_DIGEST_BYTES];
+    uint8_t result[SHA256_DIGEST_BYTES];
+    prf.mac(first.data(), first.size(), u);
+    std::memcpy(result, u, sizeof(u));
+    for (uint32_t i = 1; i < iterations; ++i) {
+        prf.mac(u, sizeof(u), u);
+        for (int j = 0; j < SHA256_DIGEST_BYTES; ++j) result[j] ^= u[j];
+    }
+    return to_hex(result, sizeof(result));
+}
+
+// Compares in time that depends only on the lengths, so a mismatch does not leak
+// how many leading characters were right.
+inline bool constant_time_equals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= (unsigned char)(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+inline std::string random_hex(size_t bytes) {
+    std::random_device device;
+    std::string raw(bytes, '\0');
+    for (size_t i = 0; i < bytes; ++i) raw[i] = (char)(device() & 0xff);
+    return to_hex(reinterpret_cast<const uint8_t*>(raw.data()), raw.size());
+}
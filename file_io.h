@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Thin portability layer over the raw file calls used by the user store and the
+// chat history: descriptors rather than streams, so writes can be fsync'd.
+
+// Read-only view of a whole file. Snapshots and history segments are mapped rather
+// than streamed, so scanning them is one pass over memory with no per-line allocation.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+inline bool map_file(const std::string& path, MappedFile& mapped) {
+#ifdef _WIN32
+    mapped.file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (mapped.file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapped.file, &size) || size.QuadPart == 0) {
+        CloseHandle(mapped.file);
+        mapped.file = INVALID_HANDLE_VALUE;
+        return size.QuadPart == 0;
+    }
+    mapped.mapping = CreateFileMappingA(mapped.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapped.mapping) { CloseHandle(mapped.file); mapped.file = INVALID_HANDLE_VALUE; return false; }
+    mapped.data = static_cast<const char*>(MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0));
+    mapped.size = (size_t)size.QuadPart;
+    return mapped.data != nullptr;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1) { close(fd); return false; }
+    mapped.size = (size_t)st.st_size;
+    if (mapped.size > 0) {
+        void* addr = mmap(nullptr, mapped.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) { close(fd); mapped.size = 0; return false; }
+        madvise(addr, mapped.size, MADV_SEQUENTIAL);
+        mapped.data = static_cast<const char*>(addr);
+    }
+    close(fd);
+    return true;
+#endif
+}
+
+inline void unmap_file(MappedFile& mapped) {
+#ifdef _WIN32
+    if (mapped.data) UnmapViewOfFile(mapped.data);
+    if (mapped.mapping) CloseHandle(mapped.mapping);
+    if (mapped.file != INVALID_HANDLE_VALUE) CloseHandle(mapped.file);
+    mapped.file = INVALID_HANDLE_VALUE;
+    mapped.mapping = nullptr;
+#else
+    if (mapped.data) munmap(const_cast<char*>(mapped.data), mapped.size);
+#endif
+    mapped.data = nullptr;
+    mapped.size = 0;
+}
+
+inline int open_append(const std::string& path) {
+#ifdef _WIN32
+    return _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+#endif
+}
+
+inline int open_truncate(const std::string& path) {
+#ifdef _WIN32
+    return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+}
+
+// The same, with the given permission bits whatever the umask and whether or not
+// the file already existed. Windows has no equivalent; the mode is ignored there.
+inline int open_truncate(const std::string& path, int mode) {
+#ifdef _WIN32
+    (void)mode;
+    return open_truncate(path);
+#else
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd != -1 && fchmod(fd, (mode_t)mode) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+// False if anyone other than the owner may read or write the file.
+inline bool file_is_private(const std::string& path) {
+#ifdef _WIN32
+    (void)path;
+    return true;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && (st.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+#endif
+}
+
+inline void close_file(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+inline int64_t file_size(int fd) {
+#ifdef _WIN32
+    return _filelengthi64(fd);
+#else
+    struct stat st;
+    return fstat(fd, &st) == 0 ? (int64_t)st.st_size : 0;
+#endif
+}
+
+inline bool write_all(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+#ifdef _WIN32
+        int n = _write(fd, data.data() + written, (unsigned)(data.size() - written));
+#else
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+#endif
+        if (n <= 0) return false;
+        written += (size_t)n;
+    }
+    return true;
+}
+
+inline bool sync_file(int fd) {
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+inline bool truncate_file(int fd) {
+#ifdef _WIN32
+    return _chsize(fd, 0) == 0;
+#else
+    return ftruncate(fd, 0) == 0;
+#endif
+}
+
+inline bool replace_file(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// An encoded, newline-terminated protocol line shared by every recipient of a
+// broadcast. A frame is written once, never modified, and freed when its last
+// FrameRef goes away. The header and the bytes live in one block from the pool.
+struct Frame {
+    std::atomic<int> refs;
+    int size_class;    // index into FRAME_SIZE_CLASSES, or -1 if too large for the pool
+    size_t length;     // bytes of data, including the trailing '\n'
+    bool droppable;    // plain chat; control frames (SYS_MSG, JOIN_SUCCESS, ...) are never dropped
+
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+    const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+};
+
+#define FRAME_CLASS_COUNT 4
+#define FRAME_SLAB_BLOCKS 64
+#define FRAME_CACHE_LIMIT 128
+
+// Block sizes include the Frame header.
+inline constexpr size_t FRAME_SIZE_CLASSES[FRAME_CLASS_COUNT] = {128, 512, 2048, 8192};
+
+// Slab pool for frame blocks. Each size class keeps a shared free list that is
+// refilled a whole slab at a time; every thread keeps a small cache in front of
+// it so creating and releasing frames normally takes no lock and no malloc.
+// Blocks are recycled, never returned to the system.
+struct FrameSizeClass {
+    std::mutex mutex;
+    std::vector<void*> free_blocks;
+};
+
+inline FrameSizeClass frame_size_classes[FRAME_CLASS_COUNT];
+
+struct FrameCache {
+    std::vector<void*> blocks[FRAME_CLASS_COUNT];
+
+    FrameCache() {
+        for (auto& list : blocks) list.reserve(FRAME_CACHE_LIMIT + 1);
+    }
+
+    ~FrameCache() {
+        for (int cls = 0; cls < FRAME_CLASS_COUNT; ++cls) {
+            std::lock_guard<std::mutex> lock(frame_size_classes[cls].mutex);
+            auto& shared = frame_size_classes[cls].free_blocks;
+            shared.insert(shared.end(), blocks[cls].begin(), blocks[cls].end());
+        }
+    }
+};
+
+inline thread_local FrameCache frame_cache;
+
+inline void* allocate_frame_block(int cls) {
+    auto& local = frame_cache.blocks[cls];
+    if (local.empty()) {
+        FrameSizeClass& shared = frame_size_classes[cls];
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        if (shared.free_blocks.empty()) {
+            char* slab = static_cast<char*>(::operator new(FRAME_SIZE_CLASSES[cls] * FRAME_SLAB_BLOCKS));
+            for (size_t i = 0; i < FRAME_SLAB_BLOCKS; ++i) {
+                shared.free_blocks.push_back(slab + i * FRAME_SIZE_CLASSES[cls]);
+            }
+        }
+        size_t take = std::min(shared.free_blocks.size(), (size_t)FRAME_SLAB_BLOCKS);
+        local.insert(local.end(), shared.free_blocks.end() - take, shared.free_blocks.end());
+        shared.free_blocks.resize(shared.free_blocks.size() - take);
+    }
+    void* block = local.back();
+    local.pop_back();
+    return block;
+}
+
+inline void free_frame_block(void* block, int cls) {
+    auto& local = frame_cache.blocks[cls];
+    local.push_back(block);
+    if (local.size() > FRAME_CACHE_LIMIT) {
+        // Frames are often released on a different thread than the one that built
+        // them, so hand half the cache back for other threads to reuse.
+        size_t give = local.size() / 2;
+        std::lock_guard<std::mutex> lock(frame_size_classes[cls].mutex);
+        auto& shared = frame_size_classes[cls].free_blocks;
+        shared.insert(shared.end(), local.end() - give, local.end());
+        local.resize(local.size() - give);
+    }
+}
+
+inline Frame* allocate_frame(size_t length) {
+    size_t needed = sizeof(Frame) + length;
+    int cls = 0;
+    while (cls < FRAME_CLASS_COUNT && FRAME_SIZE_CLASSES[cls] < needed) ++cls;
+    void* block;
+    if (cls == FRAME_CLASS_COUNT) {
+        cls = -1;
+        block = ::operator new(needed);
+    } else {
+        block = allocate_frame_block(cls);
+    }
+    Frame* frame = new (block) Frame;
+    frame->refs.store(1, std::memory_order_relaxed);
+    frame->size_class = cls;
+    frame->length = length;
+    frame->droppable = false;
+    return frame;
+}
+
+inline void release_frame(Frame* frame) {
+    if (frame->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    int cls = frame->size_class;
+    frame->~Frame();
+    if (cls < 0) ::operator delete(frame);
+    else free_frame_block(frame, cls);
+}
+
+// Owning handle to a Frame. Copying shares the frame; it never copies the bytes.
+class FrameRef {
+public:
+    FrameRef() = default;
+    explicit FrameRef(Frame* frame) : frame_(frame) {}
+    FrameRef(const FrameRef& other) : frame_(other.frame_) {
+        if (frame_) frame_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    FrameRef(FrameRef&& other) noexcept : frame_(other.frame_) { other.frame_ = nullptr; }
+    FrameRef& operator=(FrameRef other) noexcept {
+        std::swap(frame_, other.frame_);
+        return *this;
+    }
+    ~FrameRef() {
+        if (frame_) release_frame(frame_);
+    }
+
+    const char* data() const { return frame_->data(); }
+    size_t size() const { return frame_->length; }
+    bool droppable() const { return frame_->droppable; }
+    explicit operator bool() const { return frame_ != nullptr; }
+
+private:
+    Frame* frame_ = nullptr;
+};
+
+// Serializes a protocol line from its pieces straight into a pooled block and
+// appends the '\n' terminator. Chat lines ("MSG ...") are marked droppable.
+inline FrameRef encode_frame(std::initializer_list<std::string_view> parts) {
+    size_t length = 1;
+    for (std::string_view part : parts) length += part.size();
+    Frame* frame = allocate_frame(length);
+    char* out = frame->data();
+    for (std::string_view part : parts) {
+        std::memcpy(out, part.data(), part.size());
+        out += part.size();
+    }
+    *out = '\n';
+    frame->droppable = length > 4 && std::memcmp(frame->data(), "MSG ", 4) == 0;
+    return FrameRef(frame);
+}
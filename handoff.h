@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "line_framer.h"
+#include "varint.h"
+
+// Hot restart. A server started with --handoff <path> listens on that Unix
+// socket for its successor. When a new binary starts with the same path and
+// connects, the old one stops accepting and reading, lets its auth workers and
+// room actors finish, and sends its state followed by its sockets:
+//
+//     varint length | "CTCHANDOFF" | version byte | state (see handoff_encode)
+//     descriptors: every listener, then every connection in state order,
+//     HANDOFF_FDS_PER_MESSAGE at a time, each batch with one byte of data
+//
+// The successor answers with one byte once it is ready to serve, and the old
+// process exits without touching the sockets again. If the answer never comes,
+// the old process carries on. Varints are varint.h's.
+//
+// Whoever holds the socket gets every client's connection, so it is created
+// owner-only and both ends refuse a peer running as another user.
+//
+// Linux only; included by server.cpp after its socket headers.
+#define HANDOFF_MAGIC "CTCHANDOFF"
+#define HANDOFF_MAGIC_BYTES 10
+#define HANDOFF_VERSION 1
+#define HANDOFF_FDS_PER_MESSAGE 64
+#define HANDOFF_TIMEOUT_SECONDS 30 // either side gives up on a silent peer after this
+#define HANDOFF_READY 'R'
+#define HANDOFF_MAX_STATE (1024ull * 1024 * 1024) // a longer state is refused rather than allocated
+
+// One connection as the old server left it.
+struct HandoffConnection {
+    uint64_t id = 0;
+    bool chatting = false; // logged in; otherwise still Authenticating
+    bool binary = false;
+    bool is_admin = false;
+    std::string username;
+    std::string nickname;
+    std::string room;
+    LineFramer::State framer; // input read but not yet handled
+    std::string pending;      // output queued but not yet written
+};
+
+struct HandoffState {
+    uint64_t next_client_id = 1;
+    uint64_t listeners = 0;
+    std::vector<std::string> room_ids; // every interned room, by id, so binary clients' room ids stay valid
+    std::vector<std::string> rooms;    // created with /create, oldest first
+    std::vector<HandoffConnection> connections;
+};
+
+inline void handoff_put_string(std::string& out, std::string_view text) {
+    put_varint64(out, text.size());
+    out.append(text.data(), text.size());
+}
+
+inline bool handoff_get_string(const char*& pos, const char* end, std::string& text) {
+    uint64_t length;
+    if (!get_varint64(pos, end, length) || length > (uint64_t)(end - pos)) return false;
+    text.assign(pos, (size_t)length);
+    pos += length;
+    return true;
+}
+
+enum HandoffFlags : uint8_t {
+    HANDOFF_CHATTING = 1,
+    HANDOFF_BINARY = 2,
+    HANDOFF_ADMIN = 4,
+    HANDOFF_DISCARDING = 8,
+    HANDOFF_LENGTH_PREFIXED = 16,
+    HANDOFF_HAVE_LENGTH = 32,
+};
+
+// "CTCHANDOFF" | version | varint next id | varint listeners | varint room ids, strings
+// | varint rooms, strings
+// | varint connections, each: varint id | flags | username, nickname, room
+// | varint frame length, varint skip | unread input, pending output
+// where every string is a varint length and its bytes.
+inline std::string handoff_encode(const HandoffState& state) {
+    std::string out(HANDOFF_MAGIC, HANDOFF_MAGIC_BYTES);
+    out += (char)HANDOFF_VERSION;
+    put_varint64(out, state.next_client_id);
+    put_varint64(out, state.listeners);
+    put_varint64(out, state.room_ids.size());
+    for (const std::string& room : state.room_ids) handoff_put_string(out, room);
+    put_varint64(out, state.rooms.size());
+    for (const std::string& room : state.rooms) handoff_put_string(out, room);
+    put_varint64(out, state.connections.size());
+    for (const HandoffConnection& conn : state.connections) {
+        put_varint64(out, conn.id);
+        out += (char)((conn.chatting ? HANDOFF_CHATTING : 0) | (conn.binary ? HANDOFF_BINARY : 0) | (conn.is_admin ? HANDOFF_ADMIN : 0) |
+                      (conn.framer.discarding ? HANDOFF_DISCARDING : 0) | (conn.framer.length_prefixed ? HANDOFF_LENGTH_PREFIXED : 0) |
+                      (conn.framer.have_length ? HANDOFF_HAVE_LENGTH : 0));
+        handoff_put_string(out, conn.username);
+        handoff_put_string(out, conn.nickname);
+        handoff_put_string(out, conn.room);
+        put_varint64(out, conn.framer.frame_length);
+        put_varint64(out, conn.framer.skip);
+        handoff_put_string(out, conn.framer.unread);
+        handoff_put_string(out, conn.pending);
+    }
+    return out;
+}
+
+inline bool handoff_get_strings(const char*& pos, const char* end, std::vector<std::string>& strings) {
+    uint64_t count;
+    if (!get_varint64(pos, end, count)) return false;
+    strings.resize(0);
+    for (uint64_t i = 0; i < count; ++i) {
+        strings.emplace_back();
+        if (!handoff_get_string(pos, end, strings.back())) return false;
+    }
+    return true;
+}
+
+inline bool handoff_decode(std::string_view data, HandoffState& state) {
+    if (data.size() < HANDOFF_MAGIC_BYTES + 1 || std::memcmp(data.data(), HANDOFF_MAGIC, HANDOFF_MAGIC_BYTES) != 0 ||
+        data[HANDOFF_MAGIC_BYTES] != HANDOFF_VERSION) return false;
+    const char* pos = data.data() + HANDOFF_MAGIC_BYTES + 1;
+    const char* end = data.data() + data.size();
+    uint64_t connections;
+    if (!get_varint64(pos, end, state.next_client_id) || !get_varint64(pos, end, state.listeners) ||
+        !handoff_get_strings(pos, end, state.room_ids) || !handoff_get_strings(pos, end, state.rooms) ||
+        !get_varint64(pos, end, connections)) return false;
+    state.connections.resize(0);
+    for (uint64_t i = 0; i < connections; ++i) {
+        state.connections.emplace_back();
+        HandoffConnection& conn = state.connections.back();
+        uint64_t frame_length, skip;
+        if (!get_varint64(pos, end, conn.id) || pos == end) return false;
+        uint8_t flags = (uint8_t)*pos++;
+        conn.chatting = flags & HANDOFF_CHATTING;
+        conn.binary = flags & HANDOFF_BINARY;
+        conn.is_admin = flags & HANDOFF_ADMIN;
+        conn.framer.discarding = flags & HANDOFF_DISCARDING;
+        conn.framer.length_prefixed = flags & HANDOFF_LENGTH_PREFIXED;
+        conn.framer.have_length = flags & HANDOFF_HAVE_LENGTH;
+        if (!handoff_get_string(pos, end, conn.username) || !handoff_get_string(pos, end, conn.nickname) ||
+            !handoff_get_string(pos, end, conn.room) || !get_varint64(pos, end, frame_length) || !get_varint64(pos, end, skip) ||
+            !handoff_get_string(pos, end, conn.framer.unread) || !handoff_get_string(pos, end, conn.pending)) return false;
+        conn.framer.frame_length = (size_t)frame_length;
+        conn.framer.skip = (size_t)skip;
+    }
+    return pos == end;
+}
+
+inline bool handoff_send_all(int sock, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+inline bool handoff_recv_all(int sock, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = recv(sock, data, size, 0);
+        if (n <= 0) return false;
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+inline bool handoff_send_state(int sock, const HandoffState& state) {
+    std::string body = handoff_encode(state);
+    std::string header;
+    put_varint64(header, body.size());
+    return handoff_send_all(sock, header.data(), header.size()) && handoff_send_all(sock, body.data(), body.size());
+}
+
+inline bool handoff_recv_state(int sock, HandoffState& state) {
+    uint64_t length = 0;
+    for (int shift = 0;; shift += 7) {
+        unsigned char byte;
+        if (shift >= 64 || !handoff_recv_all(sock, (char*)&byte, 1)) return false;
+        length |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    if (length > HANDOFF_MAX_STATE) return false;
+    std::string body((size_t)length, '\0');
+    return handoff_recv_all(sock, body.data(), body.size()) && handoff_decode(body, state);
+}
+
+// Passes the descriptors as SCM_RIGHTS, HANDOFF_FDS_PER_MESSAGE per sendmsg.
+inline bool handoff_send_fds(int sock, const std::vector<int>& fds) {
+    for (size_t start = 0; start < fds.size(); start += HANDOFF_FDS_PER_MESSAGE) {
+        size_t count = std::min(fds.size() - start, (size_t)HANDOFF_FDS_PER_MESSAGE);
+        char byte = 0;
+        iovec iov{&byte, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsghdr* header = CMSG_FIRSTHDR(&msg);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        std::memcpy(CMSG_DATA(header), fds.data() + start, sizeof(int) * count);
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) return false;
+    }
+    return true;
+}
+
+// Receives `count` descriptors sent by handoff_send_fds, close-on-exec.
+inline bool handoff_recv_fds(int sock, size_t count, std::vector<int>& fds) {
+    while (fds.size() < count) {
+        char byte;
+        iovec iov{&byte, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC)) return false;
+        for (cmsghdr* header = CMSG_FIRSTHDR(&msg); header; header = CMSG_NXTHDR(&msg, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+            size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const char* data = (const char*)CMSG_DATA(header);
+            for (size_t i = 0; i < received; ++i) {
+                int fd;
+                std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+                fds.push_back(fd);
+            }
+        }
+    }
+    return fds.size() == count;
+}
+
+inline bool handoff_address(const std::string& path, sockaddr_un& addr) {
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+inline void handoff_set_timeout(int sock) {
+    timeval timeout{HANDOFF_TIMEOUT_SECONDS, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// True when the process at the other end runs as the same user as this one.
+inline bool handoff_peer_is_self(int sock) {
+    ucred peer{};
+    socklen_t length = sizeof(peer);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && length == sizeof(peer) && peer.uid == getuid();
+}
+
+// Returns -1 when no server is listening on `path`.
+inline int handoff_connect(const std::string& path) {
+    sockaddr_un addr;
+    if (!handoff_address(path, addr)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) return -1;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    handoff_set_timeout(sock);
+    return sock;
+}
+
+// Takes over `path` for the next successor; a socket file left there by the
+// previous server is replaced. The file is made owner-only right after bind;
+// anyone who connects before that is still refused by handoff_peer_is_self.
+inline int handoff_listen(const std::string& path) {
+    sockaddr_un addr;
+    if (!handoff_address(path, addr)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) return -1;
+    unlink(path.c_str());
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == -1 || chmod(path.c_str(), 0600) == -1 || listen(sock, 1) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
@@ -0,0 +1,439 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "frame.h"
+#include "file_io.h"
+#include "mpsc_queue.h"
+#include "search_index.h"
+
+#define HISTORY_SEGMENT_BYTES (4 * 1024 * 1024)
+#define HISTORY_FLUSH_MS 100
+#define HISTORY_MAX_QUERY 500
+
+struct HistoryRecord {
+    HistoryRecord* next;
+    uint64_t seq;
+    FrameRef frame;
+};
+
+// Chat history for one room. Each room has its own directory of append-only
+// segment files holding the exact MSG lines that were broadcast. The newest
+// messages are also kept in memory, so replaying them on join never touches disk.
+// Only the writer thread touches the directory: it creates it, warms the tail
+// from it and appends to the segments.
+struct RoomHistory {
+    std::string room_name;
+    std::string dir;
+
+    std::mutex tail_mutex;
+    std::deque<std::pair<uint64_t, FrameRef>> tail; // (sequence number, frame), oldest first
+    uint64_t last_seq = 0;
+
+    // Held by the writer while it appends, so readers see segments and persisted_seq agree.
+    std::mutex io_mutex;
+    uint64_t persisted_seq = 0; // every message up to here is in the segment files
+    int segment_fd = -1;
+    uint64_t segment_index = 0;
+    size_t segment_bytes = 0;
+
+    std::unique_ptr<RoomIndex> index;
+
+    // Records on their way to the writer. While there are any, the room is also
+    // on the writer's ready list, linked through `next`.
+    MpscQueue<HistoryRecord> pending;
+    RoomHistory* next = nullptr;
+    std::atomic<bool> loaded{false}; // set once by the writer
+    std::vector<std::function<void()>> on_loaded; // run by the writer once loaded; guarded by rooms_mutex
+    bool disk_failed = false; // the directory could not be created; writer only
+};
+
+// Lines the writer has appended, on their way to the indexer thread. A batch
+// with no data asks for the room's index to be loaded and caught up instead.
+struct IndexBatch {
+    RoomHistory* room;
+    uint64_t log;    // history segment the data went to
+    uint64_t offset; // where in it
+    std::string data;
+    int64_t time;
+};
+
+struct HistoryLog {
+    bool enabled = true;
+    std::string dir = "history";
+    size_t replay_count = 20;
+
+    std::mutex rooms_mutex;
+    std::unordered_map<std::string, std::unique_ptr<RoomHistory>> rooms;
+    std::vector<RoomHistory*> unloaded; // opened rooms the writer has not loaded yet
+    std::condition_variable room_opened; // wakes the writer for a new room
+
+    // Rooms with pending records. A room is pushed when its queue goes from
+    // empty to non-empty, and the writer takes the list before it empties the
+    // queues, so no room is on it twice.
+    MpscQueue<RoomHistory> ready;
+
+    // Held for a whole flush, so batches reach the segments in order whoever flushes.
+    std::mutex flush_mutex;
+    std::vector<RoomHistory*> flush_rooms;
+
+    std::mutex index_mutex;
+    std::condition_variable index_ready;
+    std::vector<IndexBatch> index_queue;
+};
+
+inline HistoryLog history_log;
+
+// Room names come from users, so directory names are their hex encoding.
+inline std::string history_room_dir(const std::string& room_name) {
+    static const char digits[] = "0123456789abcdef";
+    std::string encoded;
+    for (unsigned char c : room_name) {
+        encoded += digits[c >> 4];
+        encoded += digits[c & 0xf];
+    }
+    return history_log.dir + "/" + encoded;
+}
+
+inline std::string history_segment_path(const RoomHistory& room, uint64_t index) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llu.log", (unsigned long long)index);
+    return room.dir + name;
+}
+
+// Segment indexes present on disk, oldest first.
+inline std::vector<uint64_t> history_segments(const RoomHistory& room) {
+    std::vector<uint64_t> indexes;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(room.dir, ec)) {
+        if (entry.path().extension() == ".log") {
+            indexes.push_back(std::strtoull(entry.path().stem().string().c_str(), nullptr, 10));
+        }
+    }
+    std::sort(indexes.begin(), indexes.end());
+    return indexes;
+}
+
+// Collects up to `count` of the newest lines on disk, oldest first, by mapping
+// segments from the newest backwards.
+inline void history_read_segments(const RoomHistory& room, size_t count, std::vector<std::string>& lines) {
+    std::vector<uint64_t> indexes = history_segments(room);
+    std::vector<std::string> newest_first;
+    for (auto it = indexes.rbegin(); it != indexes.rend() && newest_first.size() < count; ++it) {
+        MappedFile mapped;
+        if (!map_file(history_segment_path(room, *it), mapped)) continue;
+        const char* begin = mapped.data;
+        const char* end = mapped.data + mapped.size;
+        // Anything after the last '\n' is a torn write and is skipped.
+        while (end > begin && end[-1] != '\n') --end;
+        while (end > begin && newest_first.size() < count) {
+            const char* line_end = end - 1;
+            const char* line_begin = line_end;
+            while (line_begin > begin && line_begin[-1] != '\n') --line_begin;
+            if (line_end > line_begin) newest_first.emplace_back(line_begin, line_end - line_begin);
+            end = line_begin;
+        }
+        unmap_file(mapped);
+    }
+    lines.insert(lines.end(), newest_first.rbegin(), newest_first.rend());
+}
+
+// Returns the history of a room. Nothing here touches disk: the writer thread
+// creates the room's directory and loads what is already there within one
+// flush interval.
+inline RoomHistory* history_open(const std::string& room_name) {
+    if (!history_log.enabled) return nullptr;
+    std::lock_guard<std::mutex> lock(history_log.rooms_mutex);
+    auto& slot = history_log.rooms[room_name];
+    if (slot) return slot.get();
+    slot = std::make_unique<RoomHistory>();
+    RoomHistory& room = *slot;
+    room.room_name = room_name;
+    room.dir = history_room_dir(room_name);
+    room.index = std::make_unique<RoomIndex>(room.dir);
+    history_log.unloaded.push_back(&room);
+    history_log.room_opened.notify_one();
+    return &room;
+}
+
+// On the writer thread, before anything is appended for the room: creates its
+// directory, finds the segment to append to and puts the newest lines on disk
+// in front of whatever was broadcast since the room was opened.
+inline void history_load(RoomHistory& room) {
+    if (room.loaded.load(std::memory_order_relaxed)) return;
+    std::error_code ec;
+    std::filesystem::create_directories(room.dir, ec);
+    if (ec) {
+        std::cout << "[ERROR] Cannot create " << room.dir << " (" << ec.message() << "); history for [" << room.room_name
+                  << "] is kept in memory only." << std::endl;
+        room.disk_failed = true;
+    }
+    std::vector<std::string> lines;
+    if (!room.disk_failed) {
+        std::lock_guard<std::mutex> lock(room.io_mutex);
+        std::vector<uint64_t> indexes = history_segments(room);
+        room.segment_index = indexes.empty() ? 1 : indexes.back();
+        history_read_segments(room, history_log.replay_count, lines);
+    }
+    {
+        std::lock_guard<std::mutex> lock(room.tail_mutex);
+        for (auto it = lines.rbegin(); it != lines.rend() && room.tail.size() < history_log.replay_count; ++it) {
+            room.tail.emplace_front(0, encode_frame({*it}));
+        }
+    }
+    std::vector<std::function<void()>> waiting;
+    {
+        std::lock_guard<std::mutex> lock(history_log.rooms_mutex);
+        room.loaded.store(true, std::memory_order_release);
+        waiting.swap(room.on_loaded);
+    }
+    for (auto& ready : waiting) ready();
+    if (room.disk_failed) return;
+    std::lock_guard<std::mutex> index_lock(history_log.index_mutex);
+    history_log.index_queue.push_back({&room, 0, 0, {}, 0});
+    history_log.index_ready.notify_one();
+}
+
+// The history of a room that may no longer exist, for /search. Returns null
+// rather than creating a directory for a room that never had any.
+inline RoomHistory* history_find(const std::string& room_name) {
+    if (!history_log.enabled) return nullptr;
+    {
+        std::lock_guard<std::mutex> lock(history_log.rooms_mutex);
+        auto it = history_log.rooms.find(room_name);
+        if (it != history_log.rooms.end()) return it->second.get();
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_directory(history_room_dir(room_name), ec)) return nullptr;
+    return history_open(room_name);
+}
+
+// Called on the broadcast path: keeps the frame in the room's tail and hands it
+// to the writer thread. Nothing here waits on disk or on other rooms.
+inline void history_record(RoomHistory& room, const FrameRef& frame) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(room.tail_mutex);
+        uint64_t seq = ++room.last_seq;
+        room.tail.emplace_back(seq, frame);
+        if (room.tail.size() > history_log.replay_count) room.tail.pop_front();
+        was_empty = room.pending.push(new HistoryRecord{nullptr, seq, frame});
+    }
+    if (was_empty) history_log.ready.push(&room);
+}
+
+// Calls `ready` once the writer has put what is on disk in the room's tail: at
+// once if it already has, otherwise from the writer thread, so nobody waits on it.
+inline void history_when_loaded(RoomHistory& room, std::function<void()> ready) {
+    {
+        std::lock_guard<std::mutex> lock(history_log.rooms_mutex);
+        if (!room.loaded.load(std::memory_order_relaxed)) {
+            room.on_loaded.push_back(std::move(ready));
+            return;
+        }
+    }
+    ready();
+}
+
+inline uint64_t history_last_seq(RoomHistory& room) {
+    std::lock_guard<std::mutex> lock(room.tail_mutex);
+    return room.last_seq;
+}
+
+// The newest messages up to sequence number `upto`, straight from memory. Lines
+// loaded from disk count as older than anything broadcast.
+inline void history_tail(RoomHistory& room, uint64_t upto, std::vector<FrameRef>& frames) {
+    std::lock_guard<std::mutex> lock(room.tail_mutex);
+    for (const auto& entry : room.tail) {
+        if (entry.first <= upto) frames.push_back(entry.second);
+    }
+}
+
+// Up to `count` of the newest messages: whatever is already persisted is read
+// from the mapped segments, and the rest comes from the in-memory tail. A burst
+// of more than replay_count messages inside one flush interval can leave a gap
+// until the writer catches up.
+inline void history_query(RoomHistory& room, size_t count, std::vector<std::string>& lines) {
+    std::lock_guard<std::mutex> io_lock(room.io_mutex);
+    std::vector<std::string> unpersisted;
+    {
+        std::lock_guard<std::mutex> lock(room.tail_mutex);
+        for (const auto& entry : room.tail) {
+            if (entry.first > room.persisted_seq) unpersisted.emplace_back(entry.second.data(), entry.second.size() - 1);
+        }
+    }
+    if (unpersisted.size() < count) history_read_segments(room, count - unpersisted.size(), lines);
+    size_t skip = unpersisted.size() > count ? unpersisted.size() - count : 0;
+    lines.insert(lines.end(), unpersisted.begin() + skip, unpersisted.end());
+}
+
+inline bool history_append(RoomHistory& room, const std::string& data) {
+    if (room.segment_fd == -1 || room.segment_bytes >= HISTORY_SEGMENT_BYTES) {
+        if (room.segment_fd != -1) {
+            close_file(room.segment_fd);
+            ++room.segment_index;
+        }
+        room.segment_fd = open_append(history_segment_path(room, room.segment_index));
+        if (room.segment_fd == -1) return false;
+        room.segment_bytes = (size_t)file_size(room.segment_fd);
+    }
+    if (!write_all(room.segment_fd, data)) return false;
+    room.segment_bytes += data.size();
+    return true;
+}
+
+// Loads newly opened rooms, then appends everything recorded so far, one write
+// per room. History is not fsync'd; a crash can lose the last batch.
+inline void history_flush() {
+    std::lock_guard<std::mutex> flush_lock(history_log.flush_mutex);
+    std::vector<RoomHistory*>& rooms = history_log.flush_rooms;
+    {
+        std::lock_guard<std::mutex> lock(history_log.rooms_mutex);
+        rooms.swap(history_log.unloaded);
+    }
+    for (RoomHistory* room : rooms) history_load(*room);
+    rooms.clear();
+    // Read every `next` before emptying any queue; after that the room may be pushed again.
+    for (RoomHistory* room = history_log.ready.take_all(); room; room = room->next) rooms.push_back(room);
+    if (rooms.empty()) return;
+    int64_t now = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::vector<IndexBatch> written;
+    for (RoomHistory* room_ptr : rooms) {
+        RoomHistory& room = *room_ptr;
+        history_load(room);
+        std::string data;
+        uint64_t last_seq = 0;
+        for (HistoryRecord* record = room.pending.take_all(); record;) {
+            data.append(record->frame.data(), record->frame.size());
+            last_seq = record->seq;
+            HistoryRecord* next = record->next;
+            delete record;
+            record = next;
+        }
+        if (data.empty() || room.disk_failed) continue;
+        std::lock_guard<std::mutex> lock(room.io_mutex);
+        if (history_append(room, data)) {
+            size_t offset = room.segment_bytes - data.size();
+            written.push_back({&room, room.segment_index, offset, std::move(data), now});
+        } else {
+            std::cout << "[ERROR] Could not write history for [" << room.room_name << "]." << std::endl;
+        }
+        room.persisted_seq = last_seq;
+    }
+    rooms.clear();
+    if (written.empty()) return;
+    std::lock_guard<std::mutex> lock(history_log.index_mutex);
+    for (IndexBatch& entry : written) history_log.index_queue.push_back(std::move(entry));
+    history_log.index_ready.notify_one();
+}
+
+inline int64_t history_file_time(const std::string& path) {
+    std::error_code ec;
+    auto written = std::filesystem::last_write_time(path, ec);
+    auto now = std::chrono::system_clock::now();
+    if (!ec) now += std::chrono::duration_cast<std::chrono::system_clock::duration>(written - std::filesystem::file_time_type::clock::now());
+    return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+}
+
+// Loads a room's index and indexes whatever history it is missing: everything
+// written since its newest segment file, or all of it the first time. Those
+// messages are dated by the modification time of their history segment.
+inline void history_index_catch_up(RoomHistory& room) {
+    room.index->load();
+    for (uint64_t log : history_segments(room)) {
+        if (log < room.index->end_log()) continue;
+        std::string path = history_segment_path(room, log);
+        MappedFile mapped;
+        if (!map_file(path, mapped)) continue;
+        size_t start = log == room.index->end_log() ? (size_t)room.index->end_offset() : 0;
+        if (start < mapped.size) room.index->add(log, start, std::string_view(mapped.data + start, mapped.size - start), history_file_time(path));
+        unmap_file(mapped);
+    }
+    room.index->set_caught_up();
+}
+
+// Indexes what the writer hands over, and once a second seals and merges
+// index segments. Runs on its own thread so /search costs the writer one move.
+inline void run_history_indexer() {
+    std::vector<IndexBatch> batches;
+    std::vector<RoomHistory*> rooms;
+    auto next_maintenance = std::chrono::steady_clock::now();
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(history_log.index_mutex);
+            history_log.index_ready.wait_until(lock, next_maintenance, [] { return !history_log.index_queue.empty(); });
+            batches.swap(history_log.index_queue);
+        }
+        for (IndexBatch& batch : batches) {
+            if (batch.data.empty()) history_index_catch_up(*batch.room);
+            else batch.room->index->add(batch.log, batch.offset, batch.data, batch.time);
+        }
+        batches.clear();
+        if (std::chrono::steady_clock::now() < next_maintenance) continue;
+        next_maintenance = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        {
+            std::lock_guard<std::mutex> lock(history_log.rooms_mutex);
+            for (const auto& entry : history_log.rooms) rooms.push_back(entry.second.get());
+        }
+        int64_t now = (int64_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        for (RoomHistory* room : rooms) room->index->maintain(now);
+        rooms.clear();
+    }
+}
+
+// Up to `limit` messages matching `query`, newest first, with their times. Only
+// messages the indexer has seen are found, which trails the broadcast by about
+// HISTORY_FLUSH_MS.
+inline void history_search(RoomHistory& room, const SearchQuery& query, size_t limit, std::vector<std::pair<int64_t, std::string>>& results) {
+    std::vector<IndexDoc> docs;
+    room.index->search(query, limit, docs);
+    MappedFile mapped;
+    uint64_t mapped_log = 0;
+    bool have = false;
+    for (const IndexDoc& doc : docs) {
+        if (!have || mapped_log != doc.log) {
+            unmap_file(mapped);
+            mapped_log = doc.log;
+            have = map_file(history_segment_path(room, doc.log), mapped);
+        }
+        if (!have || doc.length == 0 || doc.offset + doc.length > mapped.size) continue;
+        results.emplace_back(doc.time, std::string(mapped.data + doc.offset, doc.length - 1));
+    }
+    unmap_file(mapped);
+}
+
+// Flushes the record queues every HISTORY_FLUSH_MS, and straight away when a
+// room is opened so that it gets loaded.
+inline void run_history_writer() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(history_log.rooms_mutex);
+            history_log.room_opened.wait_for(lock, std::chrono::milliseconds(HISTORY_FLUSH_MS), [] { return !history_log.unloaded.empty(); });
+        }
+        history_flush();
+    }
+}
+
+inline void history_start() {
+    if (!history_log.enabled) return;
+    std::error_code ec;
+    std::filesystem::create_directories(history_log.dir, ec);
+    std::thread(run_history_writer).detach();
+    std::thread(run_history_indexer).detach();
+}
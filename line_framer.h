@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Incremental '\n' framer over a fixed-size ring buffer. Bytes are received
+// straight into the ring (write_ptr/commit) and complete lines come back as
+// string_views into it, so framing never allocates after the first read. A line
+// that wraps around the end of the ring is stitched together in a scratch
+// buffer of the same size. Lines longer than the ring are reported once as
+// TooLong and then skipped up to their terminating '\n'.
+//
+// After set_length_prefixed() the same ring splits varint length-prefixed
+// frames instead (see protocol.h); bytes already buffered are reframed in the
+// new mode. Frames may be one byte longer than a line, to leave room for the
+// opcode. A malformed length prefix is reported as Invalid.
+class LineFramer {
+public:
+    enum class Result { Line, NeedMore, TooLong, Invalid };
+
+    explicit LineFramer(size_t max_line_length) : capacity_(max_line_length + 1) {}
+
+    void set_length_prefixed() { length_prefixed_ = true; }
+    bool length_prefixed() const { return length_prefixed_; }
+
+    // Contiguous free space to receive into. Call commit() with the bytes written.
+    char* write_ptr() {
+        if (!buffer_) buffer_.reset(new char[capacity_]);
+        if (size_ == 0) head_ = 0; // keep the free space in one piece when the ring is empty
+        return buffer_.get() + (head_ + size_) % capacity_;
+    }
+
+    size_t write_space() const {
+        if (size_ == capacity_) return 0;
+        size_t tail = (head_ + size_) % capacity_;
+        return tail >= head_ ? capacity_ - tail : head_ - tail;
+    }
+
+    void commit(size_t bytes) { size_ += bytes; }
+
+    // Everything the framer holds between reads: the unread bytes and how far
+    // framing has got. Lets a new server process carry on where the old one
+    // stopped (see handoff.h).
+    struct State {
+        std::string unread;
+        bool discarding = false;
+        bool length_prefixed = false;
+        bool have_length = false;
+        size_t frame_length = 0;
+        size_t skip = 0;
+    };
+
+    State save() const {
+        State state;
+        size_t first = std::min(size_, capacity_ - head_);
+        if (size_) {
+            state.unread.assign(buffer_.get() + head_, first);
+            state.unread.append(buffer_.get(), size_ - first);
+        }
+        state.discarding = discarding_;
+        state.length_prefixed = length_prefixed_;
+        state.have_length = have_length_;
+        state.frame_length = frame_length_;
+        state.skip = skip_;
+        return state;
+    }
+
+    // Returns false if the unread bytes, or a pending frame, do not fit this framer's ring.
+    bool restore(const State& state) {
+        if (state.unread.size() > capacity_ || state.frame_length > capacity_) return false;
+        if (!state.unread.empty()) {
+            if (!buffer_) buffer_.reset(new char[capacity_]);
+            std::memcpy(buffer_.get(), state.unread.data(), state.unread.size());
+        }
+        head_ = 0;
+        size_ = state.unread.size();
+        scanned_ = 0;
+        discarding_ = state.discarding;
+        length_prefixed_ = state.length_prefixed;
+        have_length_ = state.have_length;
+        frame_length_ = state.frame_length;
+        skip_ = state.skip;
+        return true;
+    }
+
+    // Yields the next complete line without its "\n" (or "\r\n"). The view stays
+    // valid until the next call to write_ptr().
+    // In length-prefixed mode it yields the next frame's payload instead.
+    Result next_line(std::string_view& line) {
+        if (length_prefixed_) return next_frame(line);
+        while (scanned_ < size_) {
+            size_t pos = (head_ + scanned_) % capacity_;
+            size_t chunk = std::min(size_ - scanned_, capacity_ - pos);
+            const char* found = static_cast<const char*>(std::memchr(buffer_.get() + pos, '\n', chunk));
+            if (!found) {
+                scanned_ += chunk;
+                continue;
+            }
+            size_t length = scanned_ + (found - (buffer_.get() + pos));
+            if (discarding_) {
+                consume(length + 1);
+                discarding_ = false;
+                continue;
+            }
+            line = view(length);
+            consume(length + 1);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            return Result::Line;
+        }
+        if (size_ == capacity_) {
+            // No terminator anywhere in a full ring: drop what we have and skip to the next '\n'.
+            bool first = !discarding_;
+            consume(size_);
+            discarding_ = true;
+            if (first) return Result::TooLong;
+        }
+        return Result::NeedMore;
+    }
+
+private:
+    Result next_frame(std::string_view& frame) {
+        while (true) {
+            if (skip_ > 0) {
+                size_t skipped = std::min(skip_, size_);
+                consume(skipped);
+                skip_ -= skipped;
+                if (skip_ > 0) return Result::NeedMore;
+            }
+            if (!have_length_) {
+                // The prefix is consumed as soon as it is complete, so a maximum-size
+                // payload still fits in the ring on its own.
+                uint32_t length = 0;
+                size_t header = 0;
+                while (true) {
+                    if (header == size_) return Result::NeedMore;
+                    if (header == 5) return Result::Invalid;
+                    unsigned char byte = (unsigned char)buffer_[(head_ + header) % capacity_];
+                    length |= (uint32_t)(byte & 0x7f) << (7 * header);
+                    ++header;
+                    if (!(byte & 0x80)) break;
+                }
+                consume(header);
+                if (length == 0) return Result::Invalid;
+                if (length > capacity_) {
+                    skip_ = length;
+                    return Result::TooLong;
+                }
+                frame_length_ = length;
+                have_length_ = true;
+            }
+            if (size_ < frame_length_) return Result::NeedMore;
+            frame = view(frame_length_);
+            consume(frame_length_);
+            have_length_ = false;
+            return Result::Line;
+        }
+    }
+
+    std::string_view view(size_t length) {
+        if (head_ + length <= capacity_) return std::string_view(buffer_.get() + head_, length);
+        if (!scratch_) scratch_.reset(new char[capacity_]);
+        size_t first = capacity_ - head_;
+        std::memcpy(scratch_.get(), buffer_.get() + head_, first);
+        std::memcpy(scratch_.get() + first, buffer_.get(), length - first);
+        return std::string_view(scratch_.get(), length);
+    }
+
+    void consume(size_t bytes) {
+        head_ = (head_ + bytes) % capacity_;
+        size_ -= bytes;
+        scanned_ = 0;
+    }
+
+    std::unique_ptr<char[]> buffer_;  // allocated on first read so idle sockets cost nothing
+    std::unique_ptr<char[]> scratch_; // only needed once a line wraps
+    size_t capacity_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+    size_t scanned_ = 0; // bytes after head_ already known to hold no '\n'
+    bool discarding_ = false;
+    bool length_prefixed_ = false;
+    bool have_length_ = false; // frame_length_ holds a decoded prefix
+    size_t frame_length_ = 0;
+    size_t skip_ = 0;          // bytes left of a frame that was too long
+};
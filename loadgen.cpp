@@ -0,0 +1,537 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define MSG_NOSIGNAL 0
+#else
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define WSACleanup() ((void)0)
+#endif
+
+#include "protocol.h"
+
+#define PHASE_TIMEOUT_SECONDS 30
+#define RECV_BUFFER_SIZE 65536
+
+// Headless load generator. It opens many simulated users against a running
+// server, signs them up (or logs them in), spreads them over rooms and sends
+// timestamped chat lines at a fixed rate. Each delivered line is matched back
+// to its send time to measure fanout latency. It speaks the same wire
+// protocols as client.cpp, through protocol.h.
+struct LoadConfig {
+    std::string host = "127.0.0.1";
+    int port = 10000;
+    size_t users = 1000;
+    size_t rooms = 10;            // 0 keeps everyone in the Lobby
+    double rate = 1.0;            // chat lines per second, per user
+    unsigned duration_seconds = 10;
+    unsigned drain_ms = 1000;     // how long to keep reading after the last send
+    unsigned threads = 4;
+    size_t message_size = 64;
+    bool binary = true;
+    std::string prefix = "lg";
+};
+
+LoadConfig config;
+
+struct SimUser {
+    size_t index = 0;
+    SOCKET socket = INVALID_SOCKET;
+    std::string username;
+    std::string room;             // empty when the user stays in the Lobby
+    size_t room_size = 0;         // users sharing the room, sender included
+    bool binary = false;
+    bool authed = false;
+    bool created = false;
+    bool joined = false;
+    bool failed = false;
+    std::string inbox;            // received bytes not yet parsed
+    std::string outbox;           // queued bytes the socket has not taken yet
+    std::chrono::steady_clock::time_point next_send;
+};
+
+struct WorkerStats {
+    std::vector<uint32_t> latencies_us;
+    uint64_t sent = 0;
+    uint64_t expected = 0;        // deliveries the sent lines should produce
+    uint64_t delivered = 0;
+};
+
+// std::barrier is C++20; this is the part of it the phases need.
+class Barrier {
+public:
+    explicit Barrier(size_t parties) : parties_(parties) {}
+
+    void arrive_and_wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t generation = generation_;
+        if (++arrived_ == parties_) {
+            arrived_ = 0;
+            ++generation_;
+            cv_.notify_all();
+        } else {
+            cv_.wait(lock, [&] { return generation != generation_; });
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t parties_;
+    size_t arrived_ = 0;
+    size_t generation_ = 0;
+};
+
+uint64_t now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool would_block() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool set_non_blocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+int poll_sockets(pollfd* fds, size_t count, int timeout_ms) {
+#ifdef _WIN32
+    return WSAPoll(fds, (ULONG)count, timeout_ms);
+#else
+    return poll(fds, (nfds_t)count, timeout_ms);
+#endif
+}
+
+bool connect_user(SimUser& user, const sockaddr_in& addr) {
+    user.socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (user.socket == INVALID_SOCKET) return false;
+    if (connect(user.socket, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || !set_non_blocking(user.socket)) {
+        closesocket(user.socket);
+        user.socket = INVALID_SOCKET;
+        return false;
+    }
+    int one = 1;
+    setsockopt(user.socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    return true;
+}
+
+void flush_user(SimUser& user) {
+    while (!user.outbox.empty()) {
+        int sent = send(user.socket, user.outbox.data(), (int)user.outbox.size(), MSG_NOSIGNAL);
+        if (sent > 0) {
+            user.outbox.erase(0, sent);
+        } else {
+            if (sent == SOCKET_ERROR && would_block()) return;
+            user.failed = true;
+            return;
+        }
+    }
+}
+
+// Queues one command or chat line in whichever protocol the user negotiated.
+void send_line(SimUser& user, std::string_view line) {
+    if (user.binary) {
+        FrameRef frame = encode_binary_frame(OP_LINE, {}, {line});
+        user.outbox.append(frame.data(), frame.size());
+    } else {
+        user.outbox.append(line.data(), line.size());
+        user.outbox += '\n';
+    }
+    flush_user(user);
+}
+
+void send_auth(SimUser& user, const char* command) {
+    std::string line = std::string(command) + " " + user.username + " pw " + user.username;
+    if (config.binary) line += " " PROTOCOL_BINARY_TOKEN;
+    send_line(user, line);
+}
+
+void on_message(SimUser& user, WorkerStats& stats, uint8_t opcode, std::string_view text) {
+    if (opcode == OP_PING) {
+        if (user.binary) {
+            FrameRef frame = encode_binary_frame(OP_PONG, {}, {""});
+            user.outbox.append(frame.data(), frame.size());
+            flush_user(user);
+        } else {
+            send_line(user, "PONG");
+        }
+    } else if (opcode == OP_MSG) {
+        // Our own lines are "lg <send time in ns> <padding>".
+        if (text.size() < 3 || text.compare(0, 3, "lg ") != 0) return;
+        uint64_t sent_ns = std::strtoull(std::string(text.substr(3, 20)).c_str(), nullptr, 10);
+        uint64_t latency_ns = now_ns() - sent_ns;
+        stats.latencies_us.push_back((uint32_t)std::min<uint64_t>(latency_ns / 1000, UINT32_MAX));
+        ++stats.delivered;
+    } else if (opcode == OP_JOIN_SUCCESS) {
+        if (text == user.room) user.joined = true;
+    } else if (opcode == OP_CMD_RESP) {
+        if (text.find("created successfully") != std::string_view::npos || text.find("already exists") != std::string_view::npos) {
+            user.created = true;
+        } else if (text.find("does not exist") != std::string_view::npos) {
+            user.failed = true;
+        }
+    }
+}
+
+// Text protocol lines. Authentication replies are always text.
+void on_line(SimUser& user, WorkerStats& stats, std::string_view line) {
+    size_t space = line.find(' ');
+    std::string_view type = line.substr(0, space);
+    std::string_view body = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+    if (type == "AUTH_SUCCESS") {
+        user.authed = true;
+        user.binary = body.size() > 7 && body.substr(body.size() - 7) == " " PROTOCOL_BINARY_TOKEN;
+    } else if (type == "AUTH_FAIL") {
+        if (body == "User already exists") send_auth(user, "LOGIN");
+        else user.failed = true;
+    } else if (type == "MSG") {
+        size_t text_start = body.find("] ");
+        if (text_start != std::string_view::npos) on_message(user, stats, OP_MSG, body.substr(text_start + 2));
+    } else if (type == "JOIN_SUCCESS") {
+        on_message(user, stats, OP_JOIN_SUCCESS, body);
+    } else if (type == "CMD_RESP") {
+        on_message(user, stats, OP_CMD_RESP, body);
+    } else if (type == "PING") {
+        on_message(user, stats, OP_PING, body);
+    }
+}
+
+void read_user(SimUser& user, WorkerStats& stats) {
+    char buffer[RECV_BUFFER_SIZE];
+    while (true) {
+        int received = recv(user.socket, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            user.inbox.append(buffer, received);
+            continue;
+        }
+        if (received == 0 || !would_block()) user.failed = true;
+        break;
+    }
+    // The mode can flip from text to binary in the middle of the buffer, right
+    // after AUTH_SUCCESS, so it is checked again for every message.
+    size_t offset = 0;
+    while (offset < user.inbox.size()) {
+        if (!user.binary) {
+            size_t end = user.inbox.find('\n', offset);
+            if (end == std::string::npos) break;
+            on_line(user, stats, std::string_view(user.inbox).substr(offset, end - offset));
+            offset = end + 1;
+            continue;
+        }
+        std::string_view payload;
+        size_t consumed;
+        FrameStatus status = next_binary_frame(user.inbox.data() + offset, user.inbox.size() - offset, payload, consumed);
+        if (status == FrameStatus::NeedMore) break;
+        BinaryMessage msg;
+        if (status == FrameStatus::Invalid || !decode_binary_message(payload, msg)) {
+            user.failed = true;
+            break;
+        }
+        std::string_view text = msg.opcode == OP_MSG ? msg.strings[1] : msg.strings[0];
+        on_message(user, stats, msg.opcode, text);
+        offset += consumed;
+    }
+    user.inbox.erase(0, offset);
+}
+
+// Services every socket until done() holds or the deadline passes.
+template <typename Done>
+bool pump(std::vector<SimUser>& users, WorkerStats& stats, std::chrono::steady_clock::time_point deadline, Done done) {
+    std::vector<pollfd> fds;
+    std::vector<SimUser*> owners;
+    while (!done()) {
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        fds.clear();
+        owners.clear();
+        for (SimUser& user : users) {
+            if (user.failed) continue;
+            pollfd pfd{};
+            pfd.fd = user.socket;
+            pfd.events = POLLIN | (user.outbox.empty() ? 0 : POLLOUT);
+            fds.push_back(pfd);
+            owners.push_back(&user);
+        }
+        if (fds.empty()) return done();
+        int ready = poll_sockets(fds.data(), fds.size(), 1);
+        for (size_t i = 0; ready > 0 && i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            if (fds[i].revents & POLLOUT) flush_user(*owners[i]);
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) read_user(*owners[i], stats);
+        }
+    }
+    return true;
+}
+
+std::chrono::steady_clock::time_point phase_deadline() {
+    return std::chrono::steady_clock::now() + std::chrono::seconds(PHASE_TIMEOUT_SECONDS);
+}
+
+template <typename Pred>
+bool all_settled(const std::vector<SimUser>& users, Pred pred) {
+    for (const SimUser& user : users) {
+        if (!user.failed && !pred(user)) return false;
+    }
+    return true;
+}
+
+void chat(std::vector<SimUser>& users, WorkerStats& stats) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    auto end = start + seconds(config.duration_seconds);
+    auto interval = duration_cast<steady_clock::duration>(duration<double>(1.0 / config.rate));
+    // Spread first sends over one interval so the users do not fire in lockstep.
+    for (SimUser& user : users) {
+        user.next_send = start + duration_cast<steady_clock::duration>(interval * ((double)user.index / (double)config.users));
+    }
+    std::string line;
+    while (true) {
+        auto now = steady_clock::now();
+        if (now >= end) break;
+        for (SimUser& user : users) {
+            if (user.failed) continue;
+            while (user.next_send <= now) {
+                char stamp[32];
+                std::snprintf(stamp, sizeof(stamp), "lg %llu ", (unsigned long long)now_ns());
+                line = stamp;
+                if (line.size() < config.message_size) line.append(config.message_size - line.size(), 'x');
+                send_line(user, line);
+                ++stats.sent;
+                stats.expected += user.room_size;
+                user.next_send += interval;
+            }
+        }
+        pump(users, stats, now + milliseconds(1), [] { return false; });
+    }
+}
+
+void run_worker(std::vector<SimUser>& users, WorkerStats& stats, Barrier& phases, const sockaddr_in& addr) {
+    // Connect
+    for (SimUser& user : users) {
+        if (!connect_user(user, addr)) user.failed = true;
+    }
+    phases.arrive_and_wait();
+
+    // Authenticate
+    for (SimUser& user : users) {
+        if (!user.failed) send_auth(user, "SIGNUP");
+    }
+    pump(users, stats, phase_deadline(), [&] { return all_settled(users, [](const SimUser& u) { return u.authed; }); });
+    for (SimUser& user : users) {
+        if (!user.authed) user.failed = true;
+    }
+    phases.arrive_and_wait();
+
+    // Create rooms: the first user of each room creates it.
+    for (SimUser& user : users) {
+        if (user.failed || user.room.empty() || user.index >= config.rooms) user.created = true;
+        else send_line(user, "/create " + user.room);
+    }
+    pump(users, stats, phase_deadline(), [&] { return all_settled(users, [](const SimUser& u) { return u.created; }); });
+    phases.arrive_and_wait();
+
+    // Join
+    for (SimUser& user : users) {
+        if (user.failed || user.room.empty()) user.joined = true;
+        else send_line(user, "/join " + user.room);
+    }
+    pump(users, stats, phase_deadline(), [&] { return all_settled(users, [](const SimUser& u) { return u.joined; }); });
+    for (SimUser& user : users) {
+        if (!user.joined) user.failed = true;
+    }
+    phases.arrive_and_wait();
+
+    chat(users, stats);
+    phases.arrive_and_wait();
+
+    pump(users, stats, std::chrono::steady_clock::now() + std::chrono::milliseconds(config.drain_ms), [] { return false; });
+    phases.arrive_and_wait();
+
+    for (SimUser& user : users) {
+        if (user.socket != INVALID_SOCKET) closesocket(user.socket);
+    }
+}
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --host <address>       server address (default 127.0.0.1)\n"
+              << "  --port <port>          server port (default 10000)\n"
+              << "  --users <count>        simulated users (default 1000)\n"
+              << "  --rooms <count>        rooms to spread users over, 0 for the Lobby only (default 10)\n"
+              << "  --rate <lines/s>       chat lines per second per user (default 1)\n"
+              << "  --duration <seconds>   length of the chat phase (default 10)\n"
+              << "  --drain <ms>           time to keep reading after the last send (default 1000)\n"
+              << "  --threads <count>      worker threads (default 4)\n"
+              << "  --size <bytes>         chat line length (default 64)\n"
+              << "  --protocol <binary|text>  wire protocol to request (default binary)\n"
+              << "  --prefix <name>        username and room prefix (default lg)" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], LoadConfig& cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { print_usage(argv[0]); return false; }
+        std::string value = argv[++i];
+        if (arg == "--host") cfg.host = value;
+        else if (arg == "--port") cfg.port = std::atoi(value.c_str());
+        else if (arg == "--users") cfg.users = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--rooms") cfg.rooms = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--rate") cfg.rate = std::atof(value.c_str());
+        else if (arg == "--duration") cfg.duration_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--drain") cfg.drain_ms = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--threads") cfg.threads = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--size") cfg.message_size = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--protocol" && (value == "binary" || value == "text")) cfg.binary = value == "binary";
+        else if (arg == "--prefix") cfg.prefix = value;
+        else { print_usage(argv[0]); return false; }
+    }
+    if (cfg.users == 0 || cfg.threads == 0 || cfg.rate <= 0) {
+        std::cout << "[ERROR] --users, --threads and --rate must be positive." << std::endl;
+        return false;
+    }
+    cfg.threads = (unsigned)std::min<size_t>(cfg.threads, cfg.users);
+    return true;
+}
+
+double seconds_between(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration<double>(b - a).count();
+}
+
+uint32_t percentile(const std::vector<uint32_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t rank = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[rank];
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv, config)) return 1;
+#ifdef _WIN32
+    WSADATA wsaData; if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return 1;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)config.port);
+    addr.sin_addr.s_addr = inet_addr(config.host.c_str());
+
+    std::vector<std::vector<SimUser>> shards(config.threads);
+    for (size_t i = 0; i < config.users; ++i) {
+        SimUser user;
+        user.index = i;
+        user.username = config.prefix + std::to_string(i);
+        if (config.rooms > 0) {
+            size_t room = i % config.rooms;
+            user.room = config.prefix + "room" + std::to_string(room);
+            user.room_size = config.users / config.rooms + (room < config.users % config.rooms ? 1 : 0);
+        } else {
+            user.room_size = config.users;
+        }
+        shards[i % config.threads].push_back(std::move(user));
+    }
+
+    std::cout << "[LOADGEN] " << config.users << " user(s) in " << (config.rooms ? std::to_string(config.rooms) + " room(s)" : std::string("the Lobby"))
+              << ", " << config.threads << " thread(s), " << (config.binary ? "binary" : "text") << " protocol, "
+              << config.rate << " line(s)/s per user for " << config.duration_seconds << " s." << std::endl;
+
+    Barrier phases(config.threads + 1);
+    std::vector<WorkerStats> stats(config.threads);
+    std::vector<std::thread> workers;
+    auto t0 = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < config.threads; ++t) {
+        workers.emplace_back(run_worker, std::ref(shards[t]), std::ref(stats[t]), std::ref(phases), std::cref(addr));
+    }
+    phases.arrive_and_wait();
+    auto t_connected = std::chrono::steady_clock::now();
+    phases.arrive_and_wait();
+    auto t_authed = std::chrono::steady_clock::now();
+    phases.arrive_and_wait();
+    phases.arrive_and_wait();
+    auto t_joined = std::chrono::steady_clock::now();
+    phases.arrive_and_wait();
+    auto t_chat_end = std::chrono::steady_clock::now();
+    phases.arrive_and_wait();
+    for (auto& worker : workers) worker.join();
+
+    size_t failed = 0;
+    for (const auto& shard : shards) {
+        for (const SimUser& user : shard) failed += user.failed ? 1 : 0;
+    }
+    WorkerStats total;
+    for (WorkerStats& s : stats) {
+        total.sent += s.sent;
+        total.expected += s.expected;
+        total.delivered += s.delivered;
+        total.latencies_us.insert(total.latencies_us.end(), s.latencies_us.begin(), s.latencies_us.end());
+    }
+    std::sort(total.latencies_us.begin(), total.latencies_us.end());
+    double connect_s = seconds_between(t0, t_connected);
+    double auth_s = seconds_between(t_connected, t_authed);
+    double join_s = seconds_between(t_authed, t_joined);
+    double chat_s = seconds_between(t_joined, t_chat_end);
+
+    char report[1024];
+    std::snprintf(report, sizeof(report),
+                  "[LOADGEN] connect: %zu in %.3f s (%.0f/s)\n"
+                  "[LOADGEN] auth:    %zu in %.3f s (%.0f/s)\n"
+                  "[LOADGEN] rooms:   create + join in %.3f s\n"
+                  "[LOADGEN] chat:    sent %llu line(s) (%.0f/s), delivered %llu of %llu expected (%.0f/s)\n"
+                  "[LOADGEN] latency: p50 %u us, p99 %u us, p999 %u us, max %u us\n"
+                  "[LOADGEN] failed users: %zu",
+                  config.users, connect_s, config.users / connect_s,
+                  config.users, auth_s, config.users / auth_s,
+                  join_s,
+                  (unsigned long long)total.sent, total.sent / chat_s,
+                  (unsigned long long)total.delivered, (unsigned long long)total.expected, total.delivered / chat_s,
+                  percentile(total.latencies_us, 0.50), percentile(total.latencies_us, 0.99),
+                  percentile(total.latencies_us, 0.999), total.latencies_us.empty() ? 0 : total.latencies_us.back(),
+                  failed);
+    std::cout << report << std::endl;
+    WSACleanup();
+    return failed == 0 ? 0 : 1;
+}
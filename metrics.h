@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_io.h"
+
+// Server telemetry. Every thread records into its own block of counters and
+// histograms, so the hot paths never share a cache line or take a lock: each
+// slot has a single writer, which updates it with a relaxed load and store.
+// Readers (/stats and the Prometheus file) add the blocks up; a value can be
+// one update behind, which is fine for monitoring.
+
+enum MetricCounter {
+    COUNTER_CONNECTIONS_ACCEPTED,
+    COUNTER_CONNECTIONS_CLOSED,
+    COUNTER_CONNECTIONS_TIMED_OUT,
+    COUNTER_AUTH_FAILURES,
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+    COUNTER_LINES_IN,
+    COUNTER_CHAT_MESSAGES,
+    COUNTER_FANOUT_FRAMES,
+    COUNTER_DROPPED_FRAMES,
+    COUNTER_RATE_LIMITED,
+    COUNTER_SLOW_CONSUMER_DISCONNECTS,
+    COUNTER_MAILBOX_POSTS,
+    COUNTER_WRITE_CALLS,
+    COUNTER_FRAMES_OUT,
+    COUNTER_AUTH_REJECTED,
+    COUNTER_SESSIONS_RESUMED,
+    COUNTER_BUS_MESSAGES_OUT,
+    COUNTER_BUS_MESSAGES_IN,
+    COUNTER_BUS_WRITES,
+    COUNTER_BUS_DROPPED,
+    COUNTER_COUNT
+};
+
+enum MetricHistogram {
+    HIST_CHAT,
+    HIST_LOGIN,
+    HIST_SIGNUP,
+    HIST_RESUME,
+    HIST_CMD_CREATE,
+    HIST_CMD_DELETEROOM,
+    HIST_CMD_EXIT,
+    HIST_CMD_HISTORY,
+    HIST_CMD_JOIN,
+    HIST_CMD_KICK,
+    HIST_CMD_LEAVE,
+    HIST_CMD_LIST,
+    HIST_CMD_MSG,
+    HIST_CMD_SEARCH,
+    HIST_CMD_STATS,
+    HIST_CMD_WHO,
+    HIST_CMD_WHOALL,
+    HIST_FANOUT,         // recipients per chat line
+    HIST_OUTBOUND_DEPTH, // bytes queued for a client whenever a frame has to wait
+    HIST_WRITE_BATCH,    // frames completed by one write call
+    HIST_LOCK_REGISTRY,  // waits for a contended registry shard lock
+    HIST_LOCK_MEMBERS,   // waits for a contended room member lock
+    HIST_LOCK_ROOMS,     // waits for a contended rooms_mutex
+    HIST_COUNT
+};
+
+struct CounterInfo {
+    const char* name;
+    const char* help;
+};
+
+inline const CounterInfo COUNTER_INFO[COUNTER_COUNT] = {
+    {"chat_connections_accepted_total", "Connections accepted"},
+    {"chat_connections_closed_total", "Connections closed"},
+    {"chat_connections_timed_out_total", "Connections dropped for not logging in or not answering PING"},
+    {"chat_auth_failures_total", "LOGIN and SIGNUP attempts that failed"},
+    {"chat_bytes_in_total", "Bytes read from clients"},
+    {"chat_bytes_out_total", "Bytes written to clients"},
+    {"chat_lines_in_total", "Command and chat lines received"},
+    {"chat_messages_total", "Chat lines broadcast"},
+    {"chat_fanout_frames_total", "Chat frames queued for recipients"},
+    {"chat_dropped_frames_total", "Chat frames dropped for slow consumers"},
+    {"chat_rate_limited_total", "Lines and commands refused by flood control"},
+    {"chat_slow_consumer_disconnects_total", "Clients disconnected for not reading"},
+    {"chat_mailbox_posts_total", "Tasks posted to another event loop's mailbox"},
+    {"chat_write_syscalls_total", "sendmsg/WSASend and TCP_CORK calls made to write to clients"},
+    {"chat_frames_out_total", "Frames fully written to clients"},
+    {"chat_auth_rejected_total", "LOGIN and SIGNUP attempts turned away because the auth queue was full"},
+    {"chat_sessions_resumed_total", "Clients that came back with RESUME"},
+    {"chat_bus_messages_out_total", "Messages queued for other cluster nodes"},
+    {"chat_bus_messages_in_total", "Messages received from other cluster nodes"},
+    {"chat_bus_write_syscalls_total", "send calls made to write to other cluster nodes"},
+    {"chat_bus_dropped_total", "Messages for other cluster nodes dropped while the link was down or backed up"},
+};
+
+// Histograms sharing a family are exported as one Prometheus summary with a label.
+struct HistogramInfo {
+    const char* family;
+    const char* label;
+    const char* value;
+    bool nanoseconds; // exported in seconds, shown in microseconds by /stats
+};
+
+inline const HistogramInfo HISTOGRAM_INFO[HIST_COUNT] = {
+    {"chat_request_duration_seconds", "request", "chat", true},
+    {"chat_request_duration_seconds", "request", "LOGIN", true},
+    {"chat_request_duration_seconds", "request", "SIGNUP", true},
+    {"chat_request_duration_seconds", "request", "RESUME", true},
+    {"chat_request_duration_seconds", "request", "/create", true},
+    {"chat_request_duration_seconds", "request", "/deleteroom", true},
+    {"chat_request_duration_seconds", "request", "/exit", true},
+    {"chat_request_duration_seconds", "request", "/history", true},
+    {"chat_request_duration_seconds", "request", "/join", true},
+    {"chat_request_duration_seconds", "request", "/kick", true},
+    {"chat_request_duration_seconds", "request", "/leave", true},
+    {"chat_request_duration_seconds", "request", "/list", true},
+    {"chat_request_duration_seconds", "request", "/msg", true},
+    {"chat_request_duration_seconds", "request", "/search", true},
+    {"chat_request_duration_seconds", "request", "/stats", true},
+    {"chat_request_duration_seconds", "request", "/who", true},
+    {"chat_request_duration_seconds", "request", "/whoall", true},
+    {"chat_fanout_recipients", nullptr, nullptr, false},
+    {"chat_outbound_queue_bytes", nullptr, nullptr, false},
+    {"chat_write_batch_frames", nullptr, nullptr, false},
+    {"chat_lock_wait_seconds", "lock", "registry", true},
+    {"chat_lock_wait_seconds", "lock", "room_members", true},
+    {"chat_lock_wait_seconds", "lock", "rooms", true},
+};
+
+// HDR-style log-linear buckets: values below 16 get a bucket each, and every
+// power of two above that is split into 8 buckets, so any recorded value is
+// within 12.5% of its bucket's bounds across the whole 64-bit range.
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_HALF_SUB_BUCKETS (1 << (METRICS_SUB_BUCKET_BITS - 1))
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_HALF_SUB_BUCKETS + METRICS_HALF_SUB_BUCKETS)
+
+inline int metrics_bucket(uint64_t value) {
+    if (value < (1u << METRICS_SUB_BUCKET_BITS)) return (int)value;
+    int msb = 63;
+    while (!(value >> msb)) --msb;
+    int shift = msb - METRICS_SUB_BUCKET_BITS + 1;
+    return shift * METRICS_HALF_SUB_BUCKETS + (int)(value >> shift);
+}
+
+// Largest value that falls in the bucket.
+inline uint64_t metrics_bucket_limit(int bucket) {
+    if (bucket < (1 << METRICS_SUB_BUCKET_BITS)) return (uint64_t)bucket;
+    int shift = bucket / METRICS_HALF_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(bucket - shift * METRICS_HALF_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+struct MetricsShard {
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    std::atomic<uint64_t> sums[HIST_COUNT] = {};
+    std::atomic<uint64_t> maxes[HIST_COUNT] = {};
+    std::atomic<uint64_t> buckets[HIST_COUNT][METRICS_BUCKETS] = {};
+};
+
+struct Metrics {
+    std::string file_path = "metrics.prom";
+    unsigned interval_seconds = 10; // 0 disables the file
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    // Shards outlive their threads so their counts keep adding up.
+    std::mutex shards_mutex;
+    std::vector<std::unique_ptr<MetricsShard>> shards;
+};
+
+inline Metrics metrics;
+
+// The registry lock is taken once per thread, on its first recording.
+inline MetricsShard& metrics_shard() {
+    thread_local MetricsShard* shard = [] {
+        std::lock_guard<std::mutex> lock(metrics.shards_mutex);
+        metrics.shards.push_back(std::make_unique<MetricsShard>());
+        return metrics.shards.back().get();
+    }();
+    return *shard;
+}
+
+inline void metrics_bump(std::atomic<uint64_t>& slot, uint64_t amount) {
+    slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+inline void metrics_count(MetricCounter counter, uint64_t amount = 1) {
+    metrics_bump(metrics_shard().counters[counter], amount);
+}
+
+inline void metrics_record(MetricHistogram histogram, uint64_t value) {
+    MetricsShard& shard = metrics_shard();
+    metrics_bump(shard.buckets[histogram][metrics_bucket(value)], 1);
+    metrics_bump(shard.sums[histogram], value);
+    if (value > shard.maxes[histogram].load(std::memory_order_relaxed)) {
+        shard.maxes[histogram].store(value, std::memory_order_relaxed);
+    }
+}
+
+inline uint64_t metrics_now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records the time from construction to destruction.
+class MetricsTimer {
+public:
+    explicit MetricsTimer(MetricHistogram histogram) : histogram_(histogram), start_(metrics_now()) {}
+    ~MetricsTimer() { metrics_record(histogram_, metrics_now() - start_); }
+
+private:
+    MetricHistogram histogram_;
+    uint64_t start_;
+};
+
+// Lock helpers that only read the clock when the lock is contended, so an
+// uncontended acquisition costs one try_lock and records nothing.
+template <typename Mutex>
+std::unique_lock<Mutex> timed_lock(Mutex& mutex, MetricHistogram histogram) {
+    std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        uint64_t start = metrics_now();
+        lock.lock();
+        metrics_record(histogram, metrics_now() - start);
+    }
+    return lock;
+}
+
+template <typename Mutex>
+std::shared_lock<Mutex> timed_shared_lock(Mutex& mutex, MetricHistogram histogram) {
+    std::shared_lock<Mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        uint64_t start = metrics_now();
+        lock.lock();
+        metrics_record(histogram, metrics_now() - start);
+    }
+    return lock;
+}
+
+// Every thread's blocks added together.
+struct MetricsSnapshot {
+    uint64_t counters[COUNTER_COUNT] = {};
+    uint64_t counts[HIST_COUNT] = {};
+    uint64_t sums[HIST_COUNT] = {};
+    uint64_t maxes[HIST_COUNT] = {};
+    std::vector<uint64_t> buckets = std::vector<uint64_t>((size_t)HIST_COUNT * METRICS_BUCKETS);
+
+    // Upper bound of the bucket holding the q-th quantile, capped at the exact maximum.
+    uint64_t quantile(int histogram, double q) const {
+        if (counts[histogram] == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (double)counts[histogram]);
+        if (rank >= counts[histogram]) rank = counts[histogram] - 1;
+        const uint64_t* row = &buckets[(size_t)histogram * METRICS_BUCKETS];
+        uint64_t seen = 0;
+        for (int b = 0; b < METRICS_BUCKETS; ++b) {
+            seen += row[b];
+            if (seen > rank) return std::min(metrics_bucket_limit(b), maxes[histogram]);
+        }
+        return maxes[histogram];
+    }
+};
+
+inline void metrics_snapshot(MetricsSnapshot& snap) {
+    std::lock_guard<std::mutex> lock(metrics.shards_mutex);
+    for (const auto& shard : metrics.shards) {
+        for (int c = 0; c < COUNTER_COUNT; ++c) snap.counters[c] += shard->counters[c].load(std::memory_order_relaxed);
+        for (int h = 0; h < HIST_COUNT; ++h) {
+            snap.sums[h] += shard->sums[h].load(std::memory_order_relaxed);
+            snap.maxes[h] = std::max(snap.maxes[h], shard->maxes[h].load(std::memory_order_relaxed));
+            uint64_t* row = &snap.buckets[(size_t)h * METRICS_BUCKETS];
+            for (int b = 0; b < METRICS_BUCKETS; ++b) {
+                uint64_t n = shard->buckets[h][b].load(std::memory_order_relaxed);
+                row[b] += n;
+                snap.counts[h] += n;
+            }
+        }
+    }
+}
+
+// Values sampled by the server at export time rather than counted as they change.
+struct MetricsGauges {
+    size_t online_clients = 0;
+    size_t rooms = 0;
+    size_t outbound_queued_bytes = 0;
+    size_t outbound_max_queue = 0;
+    size_t congested_clients = 0;
+    size_t auth_queue_depth = 0;
+};
+
+inline void metrics_append_value(std::string& out, const char* name, const HistogramInfo* info, const char* quantile, double value) {
+    char line[256];
+    std::string labels;
+    if (info && info->label) labels = std::string(info->label) + "=\"" + info->value + "\"";
+    if (quantile) labels += std::string(labels.empty() ? "" : ",") + "quantile=\"" + quantile + "\"";
+    std::snprintf(line, sizeof(line), "%s%s%s%s %.9g\n", name, labels.empty() ? "" : "{", labels.c_str(), labels.empty() ? "" : "}", value);
+    out += line;
+}
+
+// Renders the snapshot in the Prometheus text exposition format.
+inline std::string metrics_prometheus(const MetricsSnapshot& snap, const MetricsGauges& gauges) {
+    std::string out;
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        out += std::string("# HELP ") + COUNTER_INFO[c].name + " " + COUNTER_INFO[c].help + "\n";
+        out += std::string("# TYPE ") + COUNTER_INFO[c].name + " counter\n";
+        metrics_append_value(out, COUNTER_INFO[c].name, nullptr, nullptr, (double)snap.counters[c]);
+    }
+    const std::pair<const char*, size_t> gauge_values[] = {
+        {"chat_online_clients", gauges.online_clients},
+        {"chat_rooms", gauges.rooms},
+        {"chat_outbound_queued_bytes", gauges.outbound_queued_bytes},
+        {"chat_outbound_max_queue_bytes", gauges.outbound_max_queue},
+        {"chat_congested_clients", gauges.congested_clients},
+        {"chat_auth_queue_depth", gauges.auth_queue_depth},
+    };
+    for (const auto& gauge : gauge_values) {
+        out += std::string("# TYPE ") + gauge.first + " gauge\n";
+        metrics_append_value(out, gauge.first, nullptr, nullptr, (double)gauge.second);
+    }
+    const char* previous_family = "";
+    for (int h = 0; h < HIST_COUNT; ++h) {
+        const HistogramInfo& info = HISTOGRAM_INFO[h];
+        if (std::string(info.family) != previous_family) {
+            out += std::string("# TYPE ") + info.family + " summary\n";
+            previous_family = info.family;
+        }
+        double scale = info.nanoseconds ? 1e-9 : 1.0;
+        static const std::pair<const char*, double> quantiles[] = {{"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999}, {"1", 1.0}};
+        for (const auto& q : quantiles) {
+            metrics_append_value(out, info.family, &info, q.first, (double)snap.quantile(h, q.second) * scale);
+        }
+        metrics_append_value(out, (std::string(info.family) + "_sum").c_str(), &info, nullptr, (double)snap.sums[h] * scale);
+        metrics_append_value(out, (std::string(info.family) + "_count").c_str(), &info, nullptr, (double)snap.counts[h]);
+    }
+    return out;
+}
+
+// Written to a temporary file and renamed, so a scraper never reads half a file.
+inline bool metrics_write_file(const std::string& contents) {
+    std::string tmp_path = metrics.file_path + ".tmp";
+    int fd = open_truncate(tmp_path);
+    if (fd == -1) return false;
+    bool ok = write_all(fd, contents);
+    close_file(fd);
+    return ok && replace_file(tmp_path, metrics.file_path);
+}
+
+// sample_gauges runs on the exporter thread and may take locks.
+template <typename SampleGauges>
+void metrics_start(SampleGauges sample_gauges) {
+    if (metrics.interval_seconds == 0) return;
+    std::thread([sample_gauges] {
+        bool reported_error = false;
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(metrics.interval_seconds));
+            MetricsSnapshot snap;
+            metrics_snapshot(snap);
+            MetricsGauges gauges;
+            sample_gauges(gauges);
+            if (!metrics_write_file(metrics_prometheus(snap, gauges)) && !reported_error) {
+                std::cout << "[ERROR] Could not write " << metrics.file_path << "." << std::endl;
+                reported_error = true;
+            }
+        }
+    }).detach();
+}
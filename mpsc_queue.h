@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free multi-producer, single-consumer queue of intrusive nodes (anything
+// with a `Node* next` field). Producers push one node at a time onto a Treiber
+// stack; the consumer takes the whole stack in one exchange and reverses it, so
+// nodes come out in the order they were pushed. Since the consumer never pops a
+// single node, there is no ABA problem.
+template <typename Node>
+class MpscQueue {
+public:
+    // Returns true if the queue was empty, i.e. the consumer may need waking.
+    // The node belongs to the consumer as soon as it is published.
+    bool push(Node* node) {
+        Node* head = head_.load(std::memory_order_acquire);
+        do {
+            node->next = head;
+        } while (!head_.compare_exchange_weak(head, node, std::memory_order_acq_rel, std::memory_order_acquire));
+        return head == nullptr;
+    }
+
+    // Everything pushed so far, oldest first, linked through `next`. The take
+    // also releases: a producer that then finds the queue empty sees whatever
+    // the consumer did before it, which matters when queues are used to hand
+    // an owner (like a room with pending history) back and forth.
+    Node* take_all() {
+        Node* newest = head_.exchange(nullptr, std::memory_order_acq_rel);
+        Node* oldest = nullptr;
+        while (newest) {
+            Node* next = newest->next;
+            newest->next = oldest;
+            oldest = newest;
+            newest = next;
+        }
+        return oldest;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+    std::atomic<Node*> head_{nullptr};
+};
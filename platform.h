@@ -0,0 +1,42 @@
+#pragma once
+
+// Socket headers and the names the server uses for them on every platform:
+// SOCKET, INVALID_SOCKET, closesocket and friends are the Winsock ones, mapped
+// onto POSIX elsewhere. The epoll event loops are used on Linux (USE_EPOLL);
+// other platforms get the poll() loops.
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define MSG_NOSIGNAL 0
+#define SHUT_RDWR SD_BOTH
+#else
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define WSACleanup() ((void)0)
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#define USE_EPOLL 1
+#endif
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string_view>
+
+#include "frame.h"
+
+// Optional binary framing, shared by the server and the client. A client asks for
+// it by appending BINARY to its LOGIN/SIGNUP line; the server echoes BINARY at the
+// end of its AUTH_SUCCESS line (still text) and every frame after that, in both
+// directions, is
+//
+//     varint length | opcode | varint ids... | strings...
+//
+// The length covers everything after itself. Every string except the last is
+// prefixed with its varint length; the last one runs to the end of the frame.
+// Varints are little-endian base-128, at most 5 bytes (32 bits).
+//
+// RESUME <token> <room> [BINARY] logs back in with the token from the SESSION
+// line that follows every AUTH_SUCCESS, and negotiates the framing the same way.
+//
+// A client that has been quiet for a while gets a PING and must send something,
+// normally PONG, before the server's heartbeat timeout or it is disconnected.
+enum Opcode : uint8_t {
+    OP_MSG = 1,          // sender id, room id | nickname, text
+    OP_SYS_MSG = 2,      // text
+    OP_P_MSG = 3,        // text
+    OP_CMD_RESP = 4,     // text, with '\n' between lines instead of '|'
+    OP_JOIN_SUCCESS = 5, // room id | room name
+    OP_SESSION = 6,      // session token for RESUME
+    OP_PING = 7,         // heartbeat; empty
+    OP_LINE = 16,        // client to server: one command or chat line
+    OP_PONG = 17,        // client to server: answer to OP_PING; empty
+};
+
+#define PROTOCOL_BINARY_TOKEN "BINARY"
+#define VARINT_MAX_BYTES 5
+
+struct BinaryLayout {
+    int ids;
+    int strings;
+};
+
+// Opcodes this side does not know decode as a single string, so they can be skipped.
+inline BinaryLayout binary_layout(uint8_t opcode) {
+    switch (opcode) {
+        case OP_MSG: return {2, 2};
+        case OP_JOIN_SUCCESS: return {1, 1};
+        default: return {0, 1};
+    }
+}
+
+inline size_t varint_size(uint32_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+inline char* put_varint(char* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+inline bool get_varint(const char*& pos, const char* end, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX_BYTES && pos < end; shift += 7) {
+        unsigned char byte = (unsigned char)*pos++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Builds a complete binary frame, length prefix included, in one pooled block.
+// Chat (OP_MSG) frames are droppable, like "MSG " lines in the text protocol.
+inline FrameRef encode_binary_frame(uint8_t opcode, std::initializer_list<uint32_t> ids, std::initializer_list<std::string_view> strings) {
+    size_t payload = 1;
+    for (uint32_t id : ids) payload += varint_size(id);
+    size_t remaining = strings.size();
+    for (std::string_view s : strings) {
+        payload += s.size();
+        if (--remaining > 0) payload += varint_size((uint32_t)s.size());
+    }
+    Frame* frame = allocate_frame(varint_size((uint32_t)payload) + payload);
+    char* out = put_varint(frame->data(), (uint32_t)payload);
+    *out++ = (char)opcode;
+    for (uint32_t id : ids) out = put_varint(out, id);
+    remaining = strings.size();
+    for (std::string_view s : strings) {
+        if (--remaining > 0) out = put_varint(out, (uint32_t)s.size());
+        std::memcpy(out, s.data(), s.size());
+        out += s.size();
+    }
+    frame->droppable = opcode == OP_MSG;
+    return FrameRef(frame);
+}
+
+enum class FrameStatus { Complete, NeedMore, Invalid };
+
+// Splits the next frame off the front of a receive buffer. On Complete, payload
+// is the opcode and body, and consumed is the number of bytes to drop.
+inline FrameStatus next_binary_frame(const char* data, size_t size, std::string_view& payload, size_t& consumed) {
+    const char* pos = data;
+    const char* end = data + size;
+    uint32_t length;
+    if (!get_varint(pos, end, length)) {
+        return size >= VARINT_MAX_BYTES ? FrameStatus::Invalid : FrameStatus::NeedMore;
+    }
+    if (length == 0) return FrameStatus::Invalid;
+    if ((size_t)(end - pos) < length) return FrameStatus::NeedMore;
+    payload = std::string_view(pos, length);
+    consumed = (pos - data) + length;
+    return FrameStatus::Complete;
+}
+
+// A decoded frame. The views point into the payload it was decoded from.
+struct BinaryMessage {
+    uint8_t opcode = 0;
+    uint32_t ids[2] = {0, 0};
+    std::string_view strings[2];
+};
+
+inline bool decode_binary_message(std::string_view payload, BinaryMessage& msg) {
+    if (payload.empty()) return false;
+    const char* pos = payload.data();
+    const char* end = pos + payload.size();
+    msg.opcode = (uint8_t)*pos++;
+    BinaryLayout layout = binary_layout(msg.opcode);
+    for (int i = 0; i < layout.ids; ++i) {
+        if (!get_varint(pos, end, msg.ids[i])) return false;
+    }
+    for (int i = 0; i < layout.strings; ++i) {
+        uint32_t length = (uint32_t)(end - pos);
+        if (i + 1 < layout.strings && (!get_varint(pos, end, length) || length > (uint32_t)(end - pos))) return false;
+        msg.strings[i] = std::string_view(pos, length);
+        pos += length;
+    }
+    return true;
+}
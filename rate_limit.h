@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+// A budget of `per_second` actions, of which up to `burst` may come back to back.
+// A rate of 0 means no limit.
+struct RateLimit {
+    double per_second = 0;
+    unsigned burst = 1;
+};
+
+// Parses "<per second>:<burst>", or a bare rate with a burst of 1.
+inline bool parse_rate_limit(const std::string& text, RateLimit& limit) {
+    char* end = nullptr;
+    double rate = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || rate < 0) return false;
+    unsigned long burst = 1;
+    if (*end == ':') {
+        const char* burst_text = end + 1;
+        burst = std::strtoul(burst_text, &end, 10);
+        if (end == burst_text || burst == 0) return false;
+    }
+    if (*end != '\0') return false;
+    limit.per_second = rate;
+    limit.burst = (unsigned)burst;
+    return true;
+}
+
+// Token bucket kept as a single "theoretical arrival time" (GCRA): each action
+// pushes it one interval further, and an action is allowed while it is less than
+// burst - 1 intervals ahead of now. That makes the whole state one atomic word,
+// so taking a token is a load and a compare-and-swap, with no lock, whether one
+// thread uses the bucket or many do.
+class TokenBucket {
+public:
+    void configure(const RateLimit& limit) {
+        if (limit.per_second <= 0) {
+            interval_ns_ = 0;
+            return;
+        }
+        interval_ns_ = (uint64_t)(1e9 / limit.per_second);
+        tolerance_ns_ = interval_ns_ * (std::max(1u, limit.burst) - 1);
+    }
+
+    // now_ns is any monotonic nanosecond clock, the same one on every call.
+    bool try_take(uint64_t now_ns) {
+        if (interval_ns_ == 0) return true;
+        uint64_t due = due_ns_.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t start = std::max(due, now_ns);
+            if (start - now_ns > tolerance_ns_) return false;
+            if (due_ns_.compare_exchange_weak(due, start + interval_ns_, std::memory_order_relaxed)) return true;
+        }
+    }
+
+private:
+    std::atomic<uint64_t> due_ns_{0};
+    uint64_t interval_ns_ = 0;
+    uint64_t tolerance_ns_ = 0;
+};
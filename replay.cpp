@@ -0,0 +1,510 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define MSG_NOSIGNAL 0
+#else
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define WSACleanup() ((void)0)
+#define SD_SEND SHUT_WR
+#endif
+
+#include "protocol.h"
+#include "trace.h"
+
+#define RECV_BUFFER_SIZE 65536
+
+// Replays a trace recorded with the server's --capture option against a running
+// server. Every traced connection gets its own socket and its lines are sent in
+// trace order, either at the recorded pace (scaled by --speed) or as fast as the
+// server answers. Passwords are not in the trace, so every login becomes a SIGNUP
+// with --password that falls back to LOGIN when the account already exists.
+//
+// A line that belongs to a connection still waiting for its AUTH_SUCCESS holds
+// back the rest of the trace, so every run sends the same lines in the same order.
+// At the end each connection's chat is checked: whatever a client received from a
+// sender must be in the order that sender sent it, the guarantee the rooms give.
+struct ReplayConfig {
+    std::string host = "127.0.0.1";
+    int port = 10000;
+    std::string trace_file;
+    double speed = 1.0;           // 0 replays as fast as possible
+    std::string password = "replay";
+    unsigned drain_ms = 1000;     // how long to keep reading after the last record
+};
+
+ReplayConfig config;
+
+struct ReceivedChat {
+    uint32_t sender_id;
+    std::string text;
+};
+
+struct ReplayConn {
+    uint64_t trace_id = 0;
+    SOCKET socket = INVALID_SOCKET;
+    bool binary = false;          // negotiated; frames after AUTH_SUCCESS are binary
+    bool awaiting_auth = false;
+    bool authed = false;
+    bool closed = false;
+    bool close_requested = false; // the trace closed it; half-closed once the outbox is empty
+    bool write_closed = false;
+    bool closed_by_server = false;
+    std::string auth_username;
+    std::string auth_nickname;
+    std::string auth_binary;      // " BINARY" when the traced client asked for it
+    std::string resume_room;      // room to rejoin after a traced RESUME
+    std::string nickname;
+    std::vector<std::string> sent;
+    std::vector<ReceivedChat> received;
+    std::string inbox;
+    std::string outbox;
+};
+
+struct ReplayStats {
+    uint64_t lines_sent = 0;
+    uint64_t frames_received = 0;
+    uint64_t chat_received = 0;
+    uint64_t connect_failures = 0;
+    uint64_t auth_failures = 0;
+    uint64_t lines_skipped = 0;   // traced lines for a connection that was closed or not logged in
+};
+
+ReplayStats stats;
+std::unordered_map<uint32_t, std::string> sender_nicknames; // server connection id -> nickname
+
+bool would_block() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool set_non_blocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+int poll_sockets(pollfd* fds, size_t count, int timeout_ms) {
+#ifdef _WIN32
+    return WSAPoll(fds, (ULONG)count, timeout_ms);
+#else
+    return poll(fds, (nfds_t)count, timeout_ms);
+#endif
+}
+
+bool connect_conn(ReplayConn& conn, const sockaddr_in& addr) {
+    conn.socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn.socket == INVALID_SOCKET) return false;
+    if (connect(conn.socket, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || !set_non_blocking(conn.socket)) {
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
+        return false;
+    }
+    int one = 1;
+    setsockopt(conn.socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    return true;
+}
+
+void close_conn(ReplayConn& conn) {
+    if (conn.closed) return;
+    conn.closed = true;
+    if (conn.socket != INVALID_SOCKET) closesocket(conn.socket);
+    conn.socket = INVALID_SOCKET;
+}
+
+void flush_conn(ReplayConn& conn) {
+    while (!conn.outbox.empty()) {
+        int sent = send(conn.socket, conn.outbox.data(), (int)conn.outbox.size(), MSG_NOSIGNAL);
+        if (sent > 0) {
+            conn.outbox.erase(0, sent);
+        } else {
+            if (sent == SOCKET_ERROR && would_block()) return;
+            close_conn(conn);
+            return;
+        }
+    }
+    // Only our side closes, so whatever the server still sends is read, as the
+    // original client would have until the server noticed it was gone.
+    if (conn.close_requested && !conn.write_closed) {
+        shutdown(conn.socket, SD_SEND);
+        conn.write_closed = true;
+    }
+}
+
+void send_line(ReplayConn& conn, std::string_view line) {
+    if (conn.binary) {
+        FrameRef frame = encode_binary_frame(OP_LINE, {}, {line});
+        conn.outbox.append(frame.data(), frame.size());
+    } else {
+        conn.outbox.append(line.data(), line.size());
+        conn.outbox += '\n';
+    }
+    flush_conn(conn);
+}
+
+// Turns a traced LOGIN/SIGNUP/RESUME, with its secret blanked out, into a SIGNUP
+// with our own password. Anything else is sent as it was.
+void send_auth(ReplayConn& conn, std::string_view line) {
+    std::string_view rest = line;
+    auto next = [&rest] {
+        while (!rest.empty() && rest.front() == ' ') rest.remove_prefix(1);
+        size_t end = std::min(rest.find(' '), rest.size());
+        std::string_view token = rest.substr(0, end);
+        rest.remove_prefix(end);
+        return token;
+    };
+    std::string_view command = next();
+    if (command != "LOGIN" && command != "SIGNUP" && command != "RESUME") {
+        send_line(conn, line);
+        conn.awaiting_auth = true;
+        return;
+    }
+    conn.auth_username = std::string(next());
+    conn.resume_room.clear();
+    if (command == "RESUME") {
+        conn.resume_room = std::string(next());
+        conn.auth_nickname = conn.auth_username;
+    } else {
+        next(); // the blanked-out password
+        std::string_view nickname = next();
+        conn.auth_nickname = nickname.empty() || nickname == "N/A" ? conn.auth_username : std::string(nickname);
+    }
+    conn.auth_binary = next() == PROTOCOL_BINARY_TOKEN ? " " PROTOCOL_BINARY_TOKEN : "";
+    send_line(conn, "SIGNUP " + conn.auth_username + " " + config.password + " " + conn.auth_nickname + conn.auth_binary);
+    conn.awaiting_auth = true;
+}
+
+void on_chat(ReplayConn& conn, uint32_t sender_id, std::string_view nickname, std::string_view text) {
+    ++stats.chat_received;
+    sender_nicknames.emplace(sender_id, std::string(nickname));
+    conn.received.push_back({sender_id, std::string(text)});
+}
+
+void on_ping(ReplayConn& conn) {
+    if (conn.binary) {
+        FrameRef frame = encode_binary_frame(OP_PONG, {}, {""});
+        conn.outbox.append(frame.data(), frame.size());
+        flush_conn(conn);
+    } else {
+        send_line(conn, "PONG");
+    }
+}
+
+// Text protocol lines. Authentication replies are always text.
+void on_line(ReplayConn& conn, std::string_view line) {
+    size_t space = line.find(' ');
+    std::string_view type = line.substr(0, space);
+    std::string_view body = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+    if (type == "AUTH_SUCCESS") {
+        conn.awaiting_auth = false;
+        conn.authed = true;
+        // AUTH_SUCCESS <is admin> <nickname> [BINARY]
+        conn.binary = body.size() > 7 && body.substr(body.size() - 7) == " " PROTOCOL_BINARY_TOKEN;
+        std::string_view nickname = body.substr(std::min(body.find(' ') + 1, body.size()));
+        if (conn.binary) nickname.remove_suffix(7);
+        conn.nickname = std::string(nickname);
+        if (!conn.resume_room.empty() && conn.resume_room != "Lobby") send_line(conn, "/join " + conn.resume_room);
+    } else if (type == "AUTH_FAIL") {
+        if (body == "User already exists" && !conn.auth_username.empty()) {
+            send_line(conn, "LOGIN " + conn.auth_username + " " + config.password + " N/A" + conn.auth_binary);
+            conn.auth_username.clear(); // only one fallback
+            return;
+        }
+        conn.awaiting_auth = false;
+        ++stats.auth_failures;
+    } else if (type == "MSG") {
+        // MSG <sender id> <nickname> [<room>] <text>
+        size_t id_end = body.find(' ');
+        size_t nick_end = id_end == std::string_view::npos ? id_end : body.find(' ', id_end + 1);
+        size_t text_start = nick_end == std::string_view::npos ? nick_end : body.find("] ", nick_end);
+        if (text_start == std::string_view::npos) return;
+        uint32_t sender_id = (uint32_t)std::strtoul(std::string(body.substr(0, id_end)).c_str(), nullptr, 10);
+        on_chat(conn, sender_id, body.substr(id_end + 1, nick_end - id_end - 1), body.substr(text_start + 2));
+    } else if (type == "PING") {
+        on_ping(conn);
+    }
+}
+
+void read_conn(ReplayConn& conn) {
+    char buffer[RECV_BUFFER_SIZE];
+    while (true) {
+        int received = recv(conn.socket, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            conn.inbox.append(buffer, received);
+            continue;
+        }
+        if (received == 0 || !would_block()) conn.closed_by_server = true;
+        break;
+    }
+    // The mode flips from text to binary right after AUTH_SUCCESS, possibly in
+    // the middle of the buffer, so it is checked again for every message.
+    size_t offset = 0;
+    while (offset < conn.inbox.size()) {
+        if (!conn.binary) {
+            size_t end = conn.inbox.find('\n', offset);
+            if (end == std::string::npos) break;
+            ++stats.frames_received;
+            on_line(conn, std::string_view(conn.inbox).substr(offset, end - offset));
+            offset = end + 1;
+            continue;
+        }
+        std::string_view payload;
+        size_t consumed;
+        FrameStatus status = next_binary_frame(conn.inbox.data() + offset, conn.inbox.size() - offset, payload, consumed);
+        if (status == FrameStatus::NeedMore) break;
+        BinaryMessage msg;
+        if (status == FrameStatus::Invalid || !decode_binary_message(payload, msg)) {
+            conn.closed_by_server = true;
+            break;
+        }
+        ++stats.frames_received;
+        if (msg.opcode == OP_MSG) on_chat(conn, msg.ids[0], msg.strings[0], msg.strings[1]);
+        else if (msg.opcode == OP_PING) on_ping(conn);
+        offset += consumed;
+    }
+    conn.inbox.erase(0, offset);
+    if (conn.closed_by_server) close_conn(conn);
+}
+
+// Services every open socket for up to timeout_ms.
+void pump(std::vector<ReplayConn>& conns, int timeout_ms) {
+    std::vector<pollfd> fds;
+    std::vector<ReplayConn*> owners;
+    for (ReplayConn& conn : conns) {
+        if (conn.closed) continue;
+        pollfd pfd{};
+        pfd.fd = conn.socket;
+        pfd.events = POLLIN | (conn.outbox.empty() ? 0 : POLLOUT);
+        fds.push_back(pfd);
+        owners.push_back(&conn);
+    }
+    if (fds.empty()) return;
+    int ready = poll_sockets(fds.data(), fds.size(), timeout_ms);
+    for (size_t i = 0; ready > 0 && i < fds.size(); ++i) {
+        if (fds[i].revents == 0) continue;
+        if (fds[i].revents & POLLOUT) flush_conn(*owners[i]);
+        if (!owners[i]->closed && (fds[i].revents & (POLLIN | POLLERR | POLLHUP))) read_conn(*owners[i]);
+    }
+}
+
+// Applies one record, or returns false if it has to wait for an auth reply.
+bool apply(const TraceRecord& record, std::vector<ReplayConn>& conns, std::unordered_map<uint64_t, size_t>& by_id, const sockaddr_in& addr) {
+    if (record.kind == TRACE_OPEN) {
+        by_id[record.conn_id] = conns.size();
+        conns.emplace_back();
+        conns.back().trace_id = record.conn_id;
+        if (!connect_conn(conns.back(), addr)) {
+            ++stats.connect_failures;
+            conns.back().closed = true;
+        }
+        return true;
+    }
+    auto it = by_id.find(record.conn_id);
+    if (it == by_id.end()) return true; // opened before the capture started
+    ReplayConn& conn = conns[it->second];
+    if (conn.awaiting_auth && !conn.closed) return false;
+    if (record.kind == TRACE_CLOSE) {
+        conn.close_requested = true;
+        if (!conn.closed) flush_conn(conn);
+        return true;
+    }
+    if (conn.closed) {
+        ++stats.lines_skipped; // the server closed it first, e.g. after a timeout
+        return true;
+    }
+    if (record.kind == TRACE_AUTH) {
+        // A traced login that failed before the one that worked; ours already worked.
+        if (!conn.authed) send_auth(conn, record.line);
+        return true;
+    }
+    if (!conn.authed) {
+        ++stats.lines_skipped; // our login failed where the traced one worked
+        return true;
+    }
+    conn.sent.emplace_back(record.line);
+    send_line(conn, record.line);
+    ++stats.lines_sent;
+    return true;
+}
+
+// Whether `received` appears, in order, in `sent`. Taking the earliest match each
+// time is enough to decide it.
+bool in_send_order(const std::vector<const std::string*>& received, const std::vector<std::string>& sent) {
+    size_t next = 0;
+    for (const std::string* text : received) {
+        while (next < sent.size() && sent[next] != *text) ++next;
+        if (next == sent.size()) return false;
+        ++next;
+    }
+    return true;
+}
+
+// Checks every (receiver, sender) pair. A sender is matched to the replayed
+// connection by nickname; nicknames can repeat, so any connection with that
+// nickname whose lines explain what was received will do. Senders that are not
+// part of the replay are skipped.
+size_t check_order(const std::vector<ReplayConn>& conns, size_t& pairs_checked) {
+    std::unordered_map<std::string, std::vector<const ReplayConn*>> by_nickname;
+    for (const ReplayConn& conn : conns) {
+        if (!conn.nickname.empty()) by_nickname[conn.nickname].push_back(&conn);
+    }
+    size_t violations = 0;
+    pairs_checked = 0;
+    for (const ReplayConn& receiver : conns) {
+        std::unordered_map<uint32_t, std::vector<const std::string*>> per_sender;
+        for (const ReceivedChat& chat : receiver.received) per_sender[chat.sender_id].push_back(&chat.text);
+        for (const auto& entry : per_sender) {
+            auto candidates = by_nickname.find(sender_nicknames[entry.first]);
+            if (candidates == by_nickname.end()) continue;
+            ++pairs_checked;
+            bool ok = false;
+            for (const ReplayConn* sender : candidates->second) {
+                if (in_send_order(entry.second, sender->sent)) {
+                    ok = true;
+                    break;
+                }
+            }
+            if (!ok) ++violations;
+        }
+    }
+    return violations;
+}
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " --trace <file> [options]\n"
+              << "  --trace <file>         trace written by the server's --capture option\n"
+              << "  --host <address>       server address (default 127.0.0.1)\n"
+              << "  --port <port>          server port (default 10000)\n"
+              << "  --speed <factor>       multiple of the recorded pace, 0 for as fast as possible (default 1)\n"
+              << "  --password <text>      password for every replayed account (default replay)\n"
+              << "  --drain <ms>           time to keep reading after the last record (default 1000)" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], ReplayConfig& cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { print_usage(argv[0]); return false; }
+        std::string value = argv[++i];
+        if (arg == "--trace") cfg.trace_file = value;
+        else if (arg == "--host") cfg.host = value;
+        else if (arg == "--port") cfg.port = std::atoi(value.c_str());
+        else if (arg == "--speed") cfg.speed = std::atof(value.c_str());
+        else if (arg == "--password") cfg.password = value;
+        else if (arg == "--drain") cfg.drain_ms = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else { print_usage(argv[0]); return false; }
+    }
+    if (cfg.trace_file.empty() || cfg.speed < 0) {
+        print_usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv, config)) return 1;
+#ifdef _WIN32
+    WSADATA wsaData; if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return 1;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+    MappedFile mapped;
+    TraceReader reader;
+    if (!map_file(config.trace_file, mapped) || !reader.open(std::string_view(mapped.data, mapped.size))) {
+        std::cout << "[ERROR] " << config.trace_file << " is not a readable trace." << std::endl;
+        return 1;
+    }
+    std::vector<TraceRecord> records;
+    TraceRecord record;
+    while (reader.next(record)) records.push_back(record);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)config.port);
+    addr.sin_addr.s_addr = inet_addr(config.host.c_str());
+
+    std::cout << "[REPLAY] " << records.size() << " record(s) spanning " << (records.empty() ? 0.0 : records.back().time_ns / 1e9) << " s, ";
+    if (config.speed > 0) std::cout << "at " << config.speed << "x the recorded pace." << std::endl;
+    else std::cout << "as fast as possible." << std::endl;
+
+    std::vector<ReplayConn> conns;
+    std::unordered_map<uint64_t, size_t> by_id; // trace connection id -> index in conns
+    conns.reserve(records.size());
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    size_t next = 0;
+    while (next < records.size()) {
+        auto now = steady_clock::now();
+        size_t applied = next;
+        while (next < records.size()) {
+            if (config.speed > 0 && start + nanoseconds((uint64_t)(records[next].time_ns / config.speed)) > now) break;
+            if (!apply(records[next], conns, by_id, addr)) break;
+            ++next;
+        }
+        // Flat out, only wait when the trace is held up by a login.
+        pump(conns, config.speed == 0 && next != applied ? 0 : 1);
+    }
+    auto finished = steady_clock::now();
+    auto drain_end = finished + milliseconds(config.drain_ms);
+    while (steady_clock::now() < drain_end) pump(conns, 1);
+    for (ReplayConn& conn : conns) close_conn(conn);
+
+    size_t pairs_checked = 0;
+    size_t violations = check_order(conns, pairs_checked);
+    double elapsed = duration<double>(finished - start).count();
+    char report[1024];
+    std::snprintf(report, sizeof(report),
+                  "[REPLAY] sent:     %zu connection(s), %llu line(s) in %.3f s (%.0f lines/s)\n"
+                  "[REPLAY] received: %llu frame(s), %llu chat line(s)\n"
+                  "[REPLAY] failures: %llu connect, %llu auth, %llu line(s) skipped\n"
+                  "[REPLAY] ordering: %zu violation(s) in %zu sender/receiver pair(s)",
+                  conns.size(), (unsigned long long)stats.lines_sent, elapsed, elapsed > 0 ? stats.lines_sent / elapsed : 0.0,
+                  (unsigned long long)stats.frames_received, (unsigned long long)stats.chat_received,
+                  (unsigned long long)stats.connect_failures, (unsigned long long)stats.auth_failures,
+                  (unsigned long long)stats.lines_skipped,
+                  violations, pairs_checked);
+    std::cout << report << std::endl;
+    unmap_file(mapped);
+    WSACleanup();
+    return violations == 0 && stats.connect_failures == 0 ? 0 : 1;
+}
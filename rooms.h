@@ -0,0 +1,545 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "connection.h"
+#include "actor_pool.h"
+#include "cluster.h"
+#include "history.h"
+#include "snapshot.h"
+
+// Logged-in clients and rooms: the client registry, the directory of clients on
+// other cluster nodes, room membership and presence, broadcasts and room moves.
+
+// Room directories under history/ are hex-encoded names, so this keeps them
+// well inside the usual 255-byte limit on a file name.
+#define ROOM_NAME_MAX_BYTES 100
+
+// What /create and BUS_ROOM_CREATE accept.
+inline bool is_valid_room_name(std::string_view name) {
+    return !name.empty() && name.size() <= ROOM_NAME_MAX_BYTES && name != "Lobby";
+}
+struct Room;
+
+// A logged-in client. Everything except the membership fields is fixed at login.
+struct ClientInfo {
+    std::shared_ptr<Outbound> out;
+    std::string username;
+    std::string nickname;
+    int id = 0;
+    bool isAdmin = false;
+    // Serializes room moves of this client, so its leave and enter tasks reach
+    // every room's actor in the order the moves were made.
+    std::mutex move_mutex;
+    std::atomic<Room*> room{nullptr}; // where the client is headed; null once it has left the chat
+    // Likely index in its RoomMembers list. Two rooms' actors may both write it
+    // while the client is briefly listed in both, so it is checked before use.
+    std::atomic<size_t> room_slot{0};
+    size_t loop_index = 0;            // event loop that owns the connection
+};
+
+struct PresenceEntry {
+    int id;
+    std::string nickname;
+    std::string username;
+};
+
+// Who is in one room, in the order they arrived. Published by the room's actor
+// whenever a member enters or leaves; /who and /whoall only read it.
+struct RoomPresence {
+    uint64_t version = 0;
+    std::vector<PresenceEntry> members;
+    mutable CachedReply who;
+};
+
+// The names of the rooms created with /create, oldest first.
+struct RoomList {
+    uint64_t version = 0;
+    std::vector<std::string> names;
+    mutable CachedReply list;
+};
+
+// The reply to /whoall for one value of presence_version.
+struct OnlineList {
+    uint64_t version = 0;
+    mutable CachedReply whoall;
+};
+
+// The members of one room that live on one event loop.
+struct RoomMembers {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ClientInfo>> members;
+    std::atomic<size_t> count{0}; // members.size(), readable without the lock
+};
+
+// Membership index for one room. Rooms are interned on first use and live for the
+// rest of the process, so a deleted-then-recreated room keeps its id and a cached
+// Room* never dangles. Members are split by the event loop that owns them, so a
+// broadcast becomes one mailbox item per loop. Joins, leaves, chat and /who for
+// the room run as tasks on its actor, one at a time; only those tasks change the
+// member lists.
+struct Room {
+    RoomId id = 0;
+    std::string name;
+    RoomHistory* history = nullptr; // null when history is disabled
+    std::unique_ptr<RoomMembers[]> by_loop; // one entry per event loop
+    Actor actor;
+    Snapshot<RoomPresence> presence;
+    TokenBucket chat_limit; // shared by every sender in the room
+    // In cluster mode only the owner's presence lists everyone, and only the owner
+    // puts the room's chat in order. It counts the members each other node has
+    // here, so a line crosses to a node only when someone there will see it.
+    int owner = 0;
+    std::vector<uint32_t> remote_members; // by node; only the room's actor uses it
+};
+
+#define REGISTRY_SHARDS 16
+
+// Online clients, indexed by connection id and by username. Each index is split
+// into shards by key hash, so lookups from different event loops rarely meet on
+// the same lock, and none of them scans the whole client list.
+struct alignas(64) RegistryShard {
+    std::shared_mutex mutex;
+    std::unordered_map<int, std::shared_ptr<ClientInfo>> by_id;
+    std::unordered_multimap<std::string, std::shared_ptr<ClientInfo>> by_username;
+};
+
+inline RegistryShard registry[REGISTRY_SHARDS];
+
+// Interned rooms. room_table owns them; both are guarded by room_index_mutex.
+inline std::shared_mutex room_index_mutex;
+inline std::unordered_map<std::string, Room*> room_ids;
+inline std::vector<std::unique_ptr<Room>> room_table;
+inline Room* lobby_room = nullptr; // interned at startup
+inline Snapshot<RoomList> room_list;
+inline std::mutex rooms_mutex; // serializes the writers of room_list
+// Bumped whenever any room's presence changes; /whoall rebuilds its reply when it moves.
+inline std::atomic<uint64_t> presence_version{0};
+inline Snapshot<OnlineList> online_list;
+inline std::atomic<int> next_client_id{1};
+
+inline RegistryShard& id_shard(int id) {
+    return registry[(unsigned)id % REGISTRY_SHARDS];
+}
+
+inline RegistryShard& username_shard(const std::string& username) {
+    return registry[std::hash<std::string>{}(username) % REGISTRY_SHARDS];
+}
+
+inline void registry_add(const std::shared_ptr<ClientInfo>& client) {
+    {
+        RegistryShard& shard = id_shard(client->id);
+        std::unique_lock<std::shared_mutex> lock = timed_lock(shard.mutex, HIST_LOCK_REGISTRY);
+        shard.by_id.emplace(client->id, client);
+    }
+    {
+        RegistryShard& shard = username_shard(client->username);
+        std::unique_lock<std::shared_mutex> lock = timed_lock(shard.mutex, HIST_LOCK_REGISTRY);
+        shard.by_username.emplace(client->username, client);
+    }
+    if (cluster.enabled) cluster_broadcast(BUS_ONLINE, {(uint32_t)client->id}, {client->username, client->nickname});
+}
+
+inline void registry_remove(const ClientInfo& client) {
+    {
+        RegistryShard& shard = id_shard(client.id);
+        std::unique_lock<std::shared_mutex> lock = timed_lock(shard.mutex, HIST_LOCK_REGISTRY);
+        shard.by_id.erase(client.id);
+    }
+    {
+        RegistryShard& shard = username_shard(client.username);
+        std::unique_lock<std::shared_mutex> lock = timed_lock(shard.mutex, HIST_LOCK_REGISTRY);
+        auto range = shard.by_username.equal_range(client.username);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.get() == &client) {
+                shard.by_username.erase(it);
+                break;
+            }
+        }
+    }
+    if (cluster.enabled) cluster_broadcast(BUS_OFFLINE, {(uint32_t)client.id}, {});
+}
+
+inline std::shared_ptr<ClientInfo> registry_find_id(int id) {
+    RegistryShard& shard = id_shard(id);
+    std::shared_lock<std::shared_mutex> lock = timed_shared_lock(shard.mutex, HIST_LOCK_REGISTRY);
+    auto it = shard.by_id.find(id);
+    return it == shard.by_id.end() ? nullptr : it->second;
+}
+
+// The same account may be logged in more than once; any one session is returned.
+inline std::shared_ptr<ClientInfo> registry_find_username(const std::string& username) {
+    RegistryShard& shard = username_shard(username);
+    std::shared_lock<std::shared_mutex> lock = timed_shared_lock(shard.mutex, HIST_LOCK_REGISTRY);
+    auto it = shard.by_username.find(username);
+    return it == shard.by_username.end() ? nullptr : it->second;
+}
+
+// Clients logged in on other cluster nodes, as those nodes announced them with
+// BUS_ONLINE and BUS_OFFLINE. Only the bus thread writes it.
+struct RemoteClient {
+    std::string username;
+    std::string nickname;
+};
+
+inline std::shared_mutex directory_mutex;
+inline std::unordered_map<int, RemoteClient> remote_clients; // by connection id
+inline std::unordered_multimap<std::string, int> remote_ids; // connection ids by username
+
+inline void directory_add(int id, std::string username, std::string nickname) {
+    {
+        std::unique_lock<std::shared_mutex> lock(directory_mutex);
+        if (!remote_clients.emplace(id, RemoteClient{username, std::move(nickname)}).second) return;
+        remote_ids.emplace(std::move(username), id);
+    }
+    presence_version.fetch_add(1, std::memory_order_release);
+}
+
+// Expects directory_mutex to be held exclusively. Returns the next entry.
+inline std::unordered_map<int, RemoteClient>::iterator directory_erase_locked(std::unordered_map<int, RemoteClient>::iterator it) {
+    auto range = remote_ids.equal_range(it->second.username);
+    for (auto name = range.first; name != range.second; ++name) {
+        if (name->second == it->first) {
+            remote_ids.erase(name);
+            break;
+        }
+    }
+    return remote_clients.erase(it);
+}
+
+inline void directory_remove(int id) {
+    {
+        std::unique_lock<std::shared_mutex> lock(directory_mutex);
+        auto it = remote_clients.find(id);
+        if (it == remote_clients.end()) return;
+        directory_erase_locked(it);
+    }
+    presence_version.fetch_add(1, std::memory_order_release);
+}
+
+// Every client of a node that went away or started over.
+inline void directory_remove_node(int node) {
+    {
+        std::unique_lock<std::shared_mutex> lock(directory_mutex);
+        for (auto it = remote_clients.begin(); it != remote_clients.end();) {
+            it = cluster_node_of(it->first) == node ? directory_erase_locked(it) : std::next(it);
+        }
+    }
+    presence_version.fetch_add(1, std::memory_order_release);
+}
+
+// Any one remote session of the account; false if it is not online elsewhere.
+inline bool directory_find(const std::string& username, int& id, std::string& nickname) {
+    std::shared_lock<std::shared_mutex> lock(directory_mutex);
+    auto it = remote_ids.find(username);
+    if (it == remote_ids.end()) return false;
+    id = it->second;
+    nickname = remote_clients.at(id).nickname;
+    return true;
+}
+
+inline Room* find_room(const std::string& room_name) {
+    std::shared_lock<std::shared_mutex> lock(room_index_mutex);
+    auto it = room_ids.find(room_name);
+    return it == room_ids.end() ? nullptr : it->second;
+}
+
+inline Room* intern_room(const std::string& room_name) {
+    if (Room* room = find_room(room_name)) return room;
+    RoomHistory* history = history_open(room_name);
+    std::unique_lock<std::shared_mutex> lock(room_index_mutex);
+    auto it = room_ids.find(room_name);
+    if (it != room_ids.end()) return it->second;
+    auto room = std::make_unique<Room>();
+    room->id = (RoomId)room_table.size();
+    room->name = room_name;
+    room->history = history;
+    room->by_loop = std::make_unique<RoomMembers[]>(event_loops.size());
+    room->chat_limit.configure(config.room_chat_limit);
+    room->owner = cluster.enabled ? cluster.ring.owner(room_name) : cluster.self;
+    room->remote_members.assign(cluster.peers.size(), 0);
+    room_ids.emplace(room_name, room.get());
+    room_table.push_back(std::move(room));
+    return room_table.back().get();
+}
+
+inline RoomMembers& members_on_loop(Room& room, const ClientInfo& client) {
+    return room.by_loop[client.loop_index];
+}
+
+// The *_locked helpers expect list.mutex to be held.
+inline void add_member_locked(const std::shared_ptr<ClientInfo>& client, RoomMembers& list) {
+    client->room_slot.store(list.members.size(), std::memory_order_relaxed);
+    list.members.push_back(client);
+    list.count.store(list.members.size(), std::memory_order_relaxed);
+}
+
+inline bool remove_member_locked(ClientInfo& client, RoomMembers& list) {
+    size_t slot = client.room_slot.load(std::memory_order_relaxed);
+    if (slot >= list.members.size() || list.members[slot].get() != &client) {
+        auto it = std::find_if(list.members.begin(), list.members.end(), [&](const auto& member) { return member.get() == &client; });
+        if (it == list.members.end()) return false;
+        slot = (size_t)(it - list.members.begin());
+    }
+    list.members[slot] = std::move(list.members.back());
+    list.members[slot]->room_slot.store(slot, std::memory_order_relaxed);
+    list.members.pop_back();
+    list.count.store(list.members.size(), std::memory_order_relaxed);
+    return true;
+}
+
+// Every member of the room, across all event loops. The lists are locked one at
+// a time, so this is not an atomic snapshot of the whole room.
+inline void room_members(Room& room, std::vector<std::shared_ptr<ClientInfo>>& members) {
+    for (size_t i = 0; i < event_loops.size(); ++i) {
+        RoomMembers& list = room.by_loop[i];
+        std::unique_lock<std::mutex> lock = timed_lock(list.mutex, HIST_LOCK_MEMBERS);
+        members.insert(members.end(), list.members.begin(), list.members.end());
+    }
+}
+
+// Called by room actors. The frame is encoded once and shared by every
+// recipient's queue. Each loop with members in the room gets a single mailbox
+// item, however many members it has there, and writes to them itself. Returns
+// the number of recipients.
+inline size_t broadcast_frame(Room& room, const FrameRef& frame) {
+    size_t fanout = 0;
+    for (size_t i = 0; i < event_loops.size(); ++i) {
+        RoomMembers& list = room.by_loop[i];
+        if (list.count.load(std::memory_order_relaxed) == 0) continue;
+        MailboxItem* item = new MailboxItem({}, frame, room.id);
+        {
+            std::unique_lock<std::mutex> lock = timed_lock(list.mutex, HIST_LOCK_MEMBERS);
+            item->recipients.reserve(list.members.size());
+            for (const auto& client : list.members) {
+                item->recipients.push_back(client->out);
+            }
+        }
+        fanout += item->recipients.size();
+        mailbox_post(*event_loops[i], item);
+    }
+    return fanout;
+}
+
+inline bool room_is_local(const Room& room) {
+    return room.owner == cluster.self;
+}
+
+// Hands a line to this node's members of the room. Chat is also counted and kept
+// in the room's history.
+inline void deliver_to_room(Room& room, const FrameRef& frame, bool chat) {
+    size_t fanout = broadcast_frame(room, frame);
+    if (!chat) return;
+    metrics_count(COUNTER_CHAT_MESSAGES);
+    metrics_count(COUNTER_FANOUT_FRAMES, fanout);
+    metrics_record(HIST_FANOUT, fanout);
+    if (room.history) history_record(*room.history, frame);
+}
+
+// Called by room actors for everything said in a room. In cluster mode a node
+// that does not own the room hands the line to the owner, which puts it in order
+// with the rest of the room's traffic and passes it on once to each node with
+// members there, however many members that node has.
+inline void room_broadcast(Room& room, const FrameRef& frame, bool chat) {
+    std::string_view line(frame.data(), frame.size() - 1); // without the '\n'
+    if (!room_is_local(room)) {
+        cluster_send(room.owner, BUS_RELAY, {chat}, {room.name, line});
+        return;
+    }
+    deliver_to_room(room, frame, chat);
+    FrameRef message;
+    for (size_t node = 0; node < room.remote_members.size(); ++node) {
+        if (room.remote_members[node] == 0) continue;
+        if (!message) message = bus_message(BUS_DELIVER, {chat}, {room.name, line});
+        cluster_send((int)node, message);
+    }
+}
+
+inline void broadcast_to_room(Room& room, const std::string& message) {
+    room_broadcast(room, encode_frame({message}), false);
+}
+
+// Used by room actors instead of send_to_client, so the line reaches the client
+// in order with the room's broadcasts.
+inline void post_frame(const std::shared_ptr<Outbound>& out, const FrameRef& frame, RoomId room_id = LOBBY_ROOM_ID) {
+    mailbox_post(*out->loop, new MailboxItem({out}, frame, room_id));
+}
+
+inline void post_to_client(const std::shared_ptr<Outbound>& out, const std::string& message, RoomId room_id = LOBBY_ROOM_ID) {
+    post_frame(out, encode_frame({message}), room_id);
+}
+
+// Moves the client's view to the room and replays its recent chat from memory.
+// Runs on the room's actor. If the writer has not loaded the room from disk yet,
+// the replay is posted back to the actor once it has, and lines broadcast in the
+// meantime reach the client first.
+inline void post_join_success(const std::shared_ptr<ClientInfo>& client, Room& room) {
+    post_to_client(client->out, "JOIN_SUCCESS " + room.name, room.id);
+    if (!room.history) return;
+    uint64_t upto = history_last_seq(*room.history);
+    auto replay = [&room, client, upto] {
+        if (client->room.load(std::memory_order_acquire) != &room) return;
+        std::vector<FrameRef> recent;
+        history_tail(*room.history, upto, recent);
+        for (const FrameRef& frame : recent) {
+            post_frame(client->out, frame, room.id);
+        }
+    };
+    if (room.history->loaded.load(std::memory_order_acquire)) {
+        replay();
+        return;
+    }
+    history_when_loaded(*room.history, [&room, replay] { actor_pool.post(room.actor, replay); });
+}
+
+// Room changes run on the rooms' actors. The thread that asks for a move switches
+// the client's room pointer at once, so its next chat line already goes to the
+// new room, and posts a leave task to the old room and an enter task to the new
+// one; the actors bring the member lists up to date in order.
+enum class MoveReason { Join, Kick, RoomDeleted };
+
+// Copies the room's presence with one member more or less and swaps it in. Only
+// the room's actor calls this, so there is a single writer per room. Returns
+// false, changing nothing, if the member was already there or already gone:
+// other nodes may repeat themselves after their link comes back.
+inline bool publish_presence(Room& room, const PresenceEntry& member, bool entered) {
+    std::shared_ptr<const RoomPresence> current = room.presence.load();
+    auto same = [&](const PresenceEntry& entry) { return entry.id == member.id; };
+    bool present = std::any_of(current->members.begin(), current->members.end(), same);
+    if (present == entered) return false;
+    auto next = std::make_shared<RoomPresence>();
+    next->version = current->version + 1;
+    next->members = current->members;
+    if (entered) {
+        next->members.push_back(member);
+    } else {
+        next->members.erase(std::remove_if(next->members.begin(), next->members.end(), same), next->members.end());
+    }
+    room.presence.store(std::move(next));
+    presence_version.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+// Drops every member another node had in the room. Runs on the room's actor.
+inline void forget_node_members(Room& room, int node) {
+    if (room.remote_members[node] == 0) return;
+    room.remote_members[node] = 0;
+    std::shared_ptr<const RoomPresence> current = room.presence.load();
+    auto next = std::make_shared<RoomPresence>();
+    next->version = current->version + 1;
+    for (const PresenceEntry& entry : current->members) {
+        if (cluster_node_of(entry.id) != node) next->members.push_back(entry);
+    }
+    room.presence.store(std::move(next));
+    presence_version.fetch_add(1, std::memory_order_release);
+}
+
+// Presence lives with the room's owner; any other node tells the owner instead.
+inline void presence_changed(Room& room, const ClientInfo& client, bool entered) {
+    if (room_is_local(room)) {
+        publish_presence(room, PresenceEntry{client.id, client.nickname, client.username}, entered);
+        return;
+    }
+    cluster_send(room.owner, BUS_MEMBER, {entered, (uint32_t)client.id}, {room.name, client.nickname, client.username});
+    presence_version.fetch_add(1, std::memory_order_release); // /whoall lists local clients by their room
+}
+
+inline void room_add(Room& room, const std::shared_ptr<ClientInfo>& client) {
+    {
+        RoomMembers& list = members_on_loop(room, *client);
+        std::lock_guard<std::mutex> lock(list.mutex);
+        add_member_locked(client, list);
+    }
+    presence_changed(room, *client, true);
+}
+
+inline void room_remove(Room& room, ClientInfo& client) {
+    bool removed;
+    {
+        RoomMembers& list = members_on_loop(room, client);
+        std::lock_guard<std::mutex> lock(list.mutex);
+        removed = remove_member_locked(client, list);
+    }
+    if (removed) presence_changed(room, client, false);
+}
+
+// Adds the client to the room unless it has moved on again, then shows it the
+// room. The notice goes to the client alone, before JOIN_SUCCESS.
+inline void post_enter(Room& to, const std::shared_ptr<ClientInfo>& client, std::string notice, std::string announcement) {
+    actor_pool.post(to.actor, [&to, client, notice = std::move(notice), announcement = std::move(announcement)] {
+        if (client->room.load(std::memory_order_acquire) != &to) return;
+        room_add(to, client);
+        if (!notice.empty()) post_to_client(client->out, notice);
+        post_join_success(client, to);
+        if (!announcement.empty()) broadcast_to_room(to, announcement);
+    });
+}
+
+inline void post_leave(Room& from, const std::shared_ptr<ClientInfo>& client, std::string announcement) {
+    actor_pool.post(from.actor, [&from, client, announcement = std::move(announcement)] {
+        room_remove(from, *client);
+        if (!announcement.empty()) broadcast_to_room(from, announcement);
+    });
+}
+
+// Moves the client to `to` and returns the room it was in: `to` itself if it was
+// already there, or null if the client has left the chat. With only_from set, the
+// client moves only if it is still in that room.
+inline Room* move_client(const std::shared_ptr<ClientInfo>& client, Room& to, MoveReason reason, Room* only_from = nullptr) {
+    std::lock_guard<std::mutex> move_lock(client->move_mutex);
+    Room* from = client->room.load(std::memory_order_relaxed);
+    if (!from || from == &to || (only_from && from != only_from)) return from;
+    client->room.store(&to, std::memory_order_release);
+    const std::string& nick = client->nickname;
+    if (reason == MoveReason::Join) {
+        // The leaver gets its own "has left" before JOIN_SUCCESS, as it always has.
+        std::string left = "SYS_MSG [" + from->name + "] " + nick + " has left.";
+        post_leave(*from, client, left);
+        post_enter(to, client, left, "SYS_MSG [" + to.name + "] " + nick + " has joined!");
+    } else if (reason == MoveReason::Kick) {
+        post_leave(*from, client, "SYS_MSG [" + from->name + "] " + nick + " was kicked by an admin.");
+        post_enter(to, client, "SYS_MSG You have been kicked back to the Lobby by an admin.", "");
+    } else {
+        post_leave(*from, client, "");
+        post_enter(to, client, "SYS_MSG Room '" + from->name + "' has been deleted. You are now in the Lobby.", "");
+    }
+    return from;
+}
+
+// Puts a client that has just logged in into its first room. Clients start out
+// looking at the Lobby; one resuming into another room is shown it.
+inline void place_client(const std::shared_ptr<ClientInfo>& client, Room& room, std::string announcement) {
+    std::lock_guard<std::mutex> move_lock(client->move_mutex);
+    client->room.store(&room, std::memory_order_release);
+    actor_pool.post(room.actor, [&room, client, announcement = std::move(announcement)] {
+        if (client->room.load(std::memory_order_acquire) != &room) return;
+        room_add(room, client);
+        if (&room != lobby_room) post_join_success(client, room);
+        broadcast_to_room(room, announcement);
+    });
+}
+
+// Puts a client handed over by the previous server back in its room. Nobody is
+// told: as far as the room can see, the client never left.
+inline void restore_client(const std::shared_ptr<ClientInfo>& client, Room& room) {
+    std::lock_guard<std::mutex> move_lock(client->move_mutex);
+    client->room.store(&room, std::memory_order_release);
+    actor_pool.post(room.actor, [&room, client] {
+        if (client->room.load(std::memory_order_acquire) == &room) room_add(room, client);
+    });
+}
+
+// Takes the client out of the chat for good and returns the room it was in.
+inline Room* remove_client(const std::shared_ptr<ClientInfo>& client) {
+    std::lock_guard<std::mutex> move_lock(client->move_mutex);
+    Room* from = client->room.exchange(nullptr, std::memory_order_acq_rel);
+    if (from) post_leave(*from, client, "SYS_MSG [" + from->name + "] " + client->nickname + " has left the chat.");
+    return from;
+}
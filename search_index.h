@@ -0,0 +1,520 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "file_io.h"
+#include "varint.h"
+
+// Full-text index over one room's chat history, for /search. It is built from
+// the history segments as they are written, never from the broadcast path.
+// Newly indexed messages collect in an in-memory open segment; once it holds
+// SEARCH_SEGMENT_DOCS messages or has been open for SEARCH_SEGMENT_AGE_SECONDS
+// it is sealed and written to the room's history directory, and every
+// SEARCH_MERGE_FACTOR sealed segments of one level are merged into one of the
+// next. A segment file is
+//
+//     "CTCIDX" | version byte | varint level | varint first doc id | varint doc count
+//     docs:  varint history segment delta | varint offset from the previous line's end
+//            | varint line length | zigzag varint time delta
+//     varint term count
+//     terms: varint prefix shared with the previous term | varint suffix length | suffix
+//            | varint doc count | varint posting bytes | doc id deltas as varints
+//
+// with terms in sorted order. Doc ids count a room's messages from 0; a message
+// is found again by its history segment and offset. Anything not yet in a file
+// when the server stops is indexed again from the history on the next start.
+#define SEARCH_MAGIC "CTCIDX"
+#define SEARCH_MAGIC_BYTES 6
+#define SEARCH_VERSION 1
+#define SEARCH_SEGMENT_DOCS 4096
+#define SEARCH_SEGMENT_AGE_SECONDS 60
+#define SEARCH_MERGE_FACTOR 8
+#define SEARCH_MAX_LEVEL 4 // segments this big are not merged further
+#define SEARCH_MIN_TERM 2
+#define SEARCH_MAX_TERM 32
+#define SEARCH_MAX_RESULTS 50
+
+// Held while index files are written or removed. hand_off keeps it, so a new
+// server can load the files without the old one changing them underneath.
+inline std::mutex search_write_mutex;
+
+struct IndexDoc {
+    uint64_t log = 0;    // history segment index
+    uint64_t offset = 0; // of the line in that segment
+    uint32_t length = 0; // of the line, with its '\n'
+    int64_t time = 0;    // unix seconds
+};
+
+struct IndexTerm {
+    std::string text;
+    uint64_t count = 0;  // documents
+    size_t offset = 0;   // of the posting list in IndexSegment::bytes
+    size_t size = 0;
+};
+
+// A sealed segment. Immutable, so queries keep using it while it is merged away.
+struct IndexSegment {
+    std::string path;  // empty if it could not be written
+    std::string bytes; // the encoded segment, as in the file
+    uint64_t level = 0;
+    uint64_t first_doc = 0;
+    std::vector<IndexDoc> docs; // doc id first_doc + i
+    std::vector<IndexTerm> terms;
+    int64_t max_time = 0;
+};
+
+struct SearchQuery {
+    std::vector<std::string> terms; // a message must contain all of them
+    int64_t since = 0;
+    int64_t until = INT64_MAX;
+};
+
+typedef std::vector<std::pair<std::string_view, const std::vector<uint64_t>*>> IndexPostings; // sorted by term
+
+inline bool search_word_char(char c) {
+    unsigned char u = (unsigned char)c;
+    return (u >= '0' && u <= '9') || (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') || u >= 0x80;
+}
+
+// Words are runs of letters and digits, lowercased; bytes of multi-byte UTF-8
+// characters count as letters. Words outside SEARCH_MIN_TERM..SEARCH_MAX_TERM
+// bytes are not indexed.
+template <typename Emit>
+inline void search_words(std::string_view text, Emit&& emit) {
+    std::string word;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !search_word_char(text[i])) ++i;
+        size_t start = i;
+        while (i < text.size() && search_word_char(text[i])) ++i;
+        if (i - start < SEARCH_MIN_TERM || i - start > SEARCH_MAX_TERM) continue;
+        word.assign(text.substr(start, i - start));
+        for (char& c : word) {
+            if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        }
+        emit(word);
+    }
+}
+
+// The sender is indexed as one term, "@nickname", so from:<nick> is a lookup too.
+inline std::string search_sender_term(std::string_view nickname) {
+    std::string term = "@";
+    for (char c : nickname) term += (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+    return term;
+}
+
+// "30s", "15m", "2h", "7d"; a bare number is seconds.
+inline bool search_parse_age(std::string_view text, int64_t& seconds) {
+    int64_t unit = 1;
+    if (!text.empty()) {
+        switch (text.back()) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            default: unit = 0; break;
+        }
+        if (unit) text.remove_suffix(1);
+        else unit = 1;
+    }
+    if (text.empty() || text.size() > 9) return false;
+    int64_t value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        value = value * 10 + (c - '0');
+    }
+    seconds = value * unit;
+    return true;
+}
+
+inline std::string search_encode(uint64_t level, uint64_t first_doc, const std::vector<IndexDoc>& docs, const IndexPostings& terms) {
+    std::string out(SEARCH_MAGIC);
+    out += (char)SEARCH_VERSION;
+    put_varint64(out, level);
+    put_varint64(out, first_doc);
+    put_varint64(out, docs.size());
+    uint64_t log = 0, end = 0;
+    int64_t time = 0;
+    for (const IndexDoc& doc : docs) {
+        if (doc.log != log) end = 0;
+        put_varint64(out, doc.log - log);
+        put_varint64(out, doc.offset - end);
+        put_varint64(out, doc.length);
+        int64_t delta = doc.time - time;
+        put_varint64(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        log = doc.log;
+        end = doc.offset + doc.length;
+        time = doc.time;
+    }
+    put_varint64(out, terms.size());
+    std::string_view previous;
+    std::string postings;
+    for (const auto& term : terms) {
+        size_t shared = 0;
+        while (shared < previous.size() && shared < term.first.size() && previous[shared] == term.first[shared]) ++shared;
+        put_varint64(out, shared);
+        put_varint64(out, term.first.size() - shared);
+        out.append(term.first.substr(shared));
+        postings.clear();
+        uint64_t last = first_doc;
+        for (uint64_t doc : *term.second) {
+            put_varint64(postings, doc - last);
+            last = doc;
+        }
+        put_varint64(out, term.second->size());
+        put_varint64(out, postings.size());
+        out += postings;
+        previous = term.first;
+    }
+    return out;
+}
+
+// Returns null if `bytes` is not a whole, valid segment.
+inline std::shared_ptr<IndexSegment> search_decode(std::string bytes) {
+    auto segment = std::make_shared<IndexSegment>();
+    segment->bytes = std::move(bytes);
+    const char* begin = segment->bytes.data();
+    const char* pos = begin;
+    const char* end = begin + segment->bytes.size();
+    if (segment->bytes.size() < SEARCH_MAGIC_BYTES + 1 || std::memcmp(pos, SEARCH_MAGIC, SEARCH_MAGIC_BYTES) != 0 ||
+        pos[SEARCH_MAGIC_BYTES] != SEARCH_VERSION) {
+        return nullptr;
+    }
+    pos += SEARCH_MAGIC_BYTES + 1;
+    uint64_t count;
+    if (!get_varint64(pos, end, segment->level) || !get_varint64(pos, end, segment->first_doc) ||
+        !get_varint64(pos, end, count) || count > (uint64_t)(end - pos)) {
+        return nullptr;
+    }
+    segment->docs.resize(count);
+    uint64_t log = 0, line_end = 0;
+    int64_t time = 0;
+    for (IndexDoc& doc : segment->docs) {
+        uint64_t log_delta, offset, length, time_delta;
+        if (!get_varint64(pos, end, log_delta) || !get_varint64(pos, end, offset) ||
+            !get_varint64(pos, end, length) || !get_varint64(pos, end, time_delta)) {
+            return nullptr;
+        }
+        if (log_delta) line_end = 0;
+        log += log_delta;
+        time += (int64_t)(time_delta >> 1) ^ -(int64_t)(time_delta & 1);
+        doc.log = log;
+        doc.offset = line_end + offset;
+        doc.length = (uint32_t)length;
+        doc.time = time;
+        line_end = doc.offset + doc.length;
+        segment->max_time = std::max(segment->max_time, time);
+    }
+    if (!get_varint64(pos, end, count) || count > (uint64_t)(end - pos)) return nullptr;
+    segment->terms.resize(count);
+    std::string_view previous;
+    for (IndexTerm& term : segment->terms) {
+        uint64_t shared, suffix, size;
+        if (!get_varint64(pos, end, shared) || shared > previous.size() || !get_varint64(pos, end, suffix) ||
+            suffix > (uint64_t)(end - pos)) {
+            return nullptr;
+        }
+        term.text.assign(previous.substr(0, shared));
+        term.text.append(pos, suffix);
+        pos += suffix;
+        if (!get_varint64(pos, end, term.count) || !get_varint64(pos, end, size) || size > (uint64_t)(end - pos)) {
+            return nullptr;
+        }
+        term.offset = (size_t)(pos - begin);
+        term.size = (size_t)size;
+        pos += size;
+        previous = term.text;
+    }
+    return pos == end ? segment : nullptr;
+}
+
+inline void search_postings(const IndexSegment& segment, const IndexTerm& term, std::vector<uint64_t>& docs) {
+    const char* pos = segment.bytes.data() + term.offset;
+    const char* end = pos + term.size;
+    uint64_t doc = segment.first_doc, delta;
+    docs.clear();
+    for (uint64_t i = 0; i < term.count && get_varint64(pos, end, delta); ++i) {
+        doc += delta;
+        docs.push_back(doc);
+    }
+}
+
+inline const IndexTerm* search_find_term(const IndexSegment& segment, const std::string& text) {
+    auto it = std::lower_bound(segment.terms.begin(), segment.terms.end(), text,
+                               [](const IndexTerm& term, const std::string& key) { return term.text < key; });
+    return it != segment.terms.end() && it->text == text ? &*it : nullptr;
+}
+
+// Intersects sorted doc id lists, shortest first.
+inline void search_intersect(std::vector<const std::vector<uint64_t>*> lists, std::vector<uint64_t>& matches) {
+    std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+    matches = *lists[0];
+    std::vector<uint64_t> next;
+    for (size_t i = 1; i < lists.size() && !matches.empty(); ++i) {
+        next.clear();
+        std::set_intersection(matches.begin(), matches.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(next));
+        matches.swap(next);
+    }
+}
+
+// Adds matches to `results`, newest first, until there are `limit` of them.
+inline void search_collect(const std::vector<uint64_t>& matches, const std::vector<IndexDoc>& docs, uint64_t first_doc,
+                           const SearchQuery& query, size_t limit, std::vector<IndexDoc>& results) {
+    for (auto it = matches.rbegin(); it != matches.rend() && results.size() < limit; ++it) {
+        const IndexDoc& doc = docs[*it - first_doc];
+        if (doc.time >= query.since && doc.time <= query.until) results.push_back(doc);
+    }
+}
+
+// The index of one room. Only the indexer thread calls load, add and maintain;
+// search may be called from any thread.
+class RoomIndex {
+public:
+    explicit RoomIndex(std::string dir) : dir_(std::move(dir)) {}
+
+    // Loads the segment files. Leftovers of a merge that was cut short are
+    // removed: half-written files, and segments a merged one already covers.
+    void load() {
+        std::vector<std::shared_ptr<IndexSegment>> found;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_, ec)) {
+            std::string path = entry.path().string();
+            if (entry.path().extension() == ".tmp") {
+                std::filesystem::remove(entry.path(), ec);
+                continue;
+            }
+            if (entry.path().extension() != ".idx") continue;
+            MappedFile mapped;
+            std::shared_ptr<IndexSegment> segment;
+            if (map_file(path, mapped)) {
+                segment = search_decode(std::string(mapped.data ? mapped.data : "", mapped.size));
+                unmap_file(mapped);
+            }
+            if (!segment) {
+                std::cout << "[ERROR] Search index file " << path << " is damaged; removing it." << std::endl;
+                std::filesystem::remove(entry.path(), ec);
+                continue;
+            }
+            segment->path = path;
+            found.push_back(std::move(segment));
+        }
+        std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) {
+            return a->first_doc != b->first_doc ? a->first_doc < b->first_doc : a->docs.size() > b->docs.size();
+        });
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& segment : found) {
+            if (segment->first_doc < open_first_) {
+                std::filesystem::remove(segment->path, ec);
+                continue;
+            }
+            open_first_ = segment->first_doc + segment->docs.size();
+            if (!segment->docs.empty()) {
+                end_log_ = segment->docs.back().log;
+                end_offset_ = segment->docs.back().offset + segment->docs.back().length;
+            }
+            segments_.push_back(std::move(segment));
+        }
+    }
+
+    // Set by the indexer once the history on disk at startup has been indexed.
+    bool caught_up() const { return caught_up_.load(std::memory_order_acquire); }
+    void set_caught_up() { caught_up_.store(true, std::memory_order_release); }
+
+    // Where indexing picks up: the history segment and offset after the last
+    // message indexed.
+    uint64_t end_log() const { return end_log_; }
+    uint64_t end_offset() const { return end_offset_; }
+
+    // Indexes the complete lines of `data`, which starts at `offset` in history
+    // segment `log`. Lines already indexed are skipped, so the same history can
+    // arrive both from the writer and from a catch-up scan.
+    void add(uint64_t log, uint64_t offset, std::string_view data, int64_t time) {
+        std::vector<std::string> terms;
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t newline = data.find('\n', pos);
+            if (newline == std::string_view::npos) break;
+            uint64_t line_offset = offset + pos;
+            std::string_view line = data.substr(pos, newline - pos);
+            pos = newline + 1;
+            if (log < end_log_ || (log == end_log_ && line_offset < end_offset_)) continue;
+            end_log_ = log;
+            end_offset_ = line_offset + line.size() + 1;
+            line_terms(line, terms);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                uint64_t doc = open_first_ + open_docs_.size();
+                if (open_docs_.empty()) open_since_ = time;
+                open_docs_.push_back({log, line_offset, (uint32_t)(line.size() + 1), time});
+                for (const std::string& term : terms) open_postings_[term].push_back(doc);
+            }
+            if (open_docs_.size() >= SEARCH_SEGMENT_DOCS) seal();
+        }
+    }
+
+    // Seals the open segment once it is old enough, then runs any merges due.
+    void maintain(int64_t now) {
+        if (!open_docs_.empty() && now - open_since_ >= SEARCH_SEGMENT_AGE_SECONDS) seal();
+        while (merge()) {}
+    }
+
+    void search(const SearchQuery& query, size_t limit, std::vector<IndexDoc>& results) {
+        std::vector<std::shared_ptr<const IndexSegment>> segments;
+        std::vector<const std::vector<uint64_t>*> lists;
+        std::vector<uint64_t> matches;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const std::string& term : query.terms) {
+                auto it = open_postings_.find(term);
+                if (it == open_postings_.end()) break;
+                lists.push_back(&it->second);
+            }
+            if (lists.size() == query.terms.size()) {
+                search_intersect(lists, matches);
+                search_collect(matches, open_docs_, open_first_, query, limit, results);
+            }
+            segments = segments_;
+        }
+        std::vector<std::vector<uint64_t>> postings(query.terms.size());
+        for (auto it = segments.rbegin(); it != segments.rend() && results.size() < limit; ++it) {
+            const IndexSegment& segment = **it;
+            if (segment.max_time < query.since) continue;
+            lists.clear();
+            for (size_t i = 0; i < query.terms.size(); ++i) {
+                const IndexTerm* term = search_find_term(segment, query.terms[i]);
+                if (!term) break;
+                search_postings(segment, *term, postings[i]);
+                lists.push_back(&postings[i]);
+            }
+            if (lists.size() < query.terms.size()) continue;
+            search_intersect(lists, matches);
+            search_collect(matches, segment.docs, segment.first_doc, query, limit, results);
+        }
+    }
+
+private:
+    // "MSG <id> <nickname> [room] text": the sender, then the words of the text.
+    static void line_terms(std::string_view line, std::vector<std::string>& terms) {
+        terms.clear();
+        if (line.substr(0, 4) == "MSG ") {
+            std::string_view fields[3];
+            line.remove_prefix(4);
+            for (std::string_view& field : fields) {
+                size_t space = std::min(line.find(' '), line.size());
+                field = line.substr(0, space);
+                line.remove_prefix(std::min(space + 1, line.size()));
+            }
+            if (!fields[1].empty()) terms.push_back(search_sender_term(fields[1]));
+        }
+        search_words(line, [&](const std::string& word) { terms.push_back(word); });
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    }
+
+    // Writes the segment to a temporary file and renames it into place.
+    void write(IndexSegment& segment) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "/index-%016llu-%08llu.idx", (unsigned long long)segment.first_doc,
+                      (unsigned long long)segment.docs.size());
+        std::string path = dir_ + name;
+        std::lock_guard<std::mutex> lock(search_write_mutex);
+        int fd = open_truncate(path + ".tmp");
+        bool ok = fd != -1 && write_all(fd, segment.bytes) && sync_file(fd);
+        if (fd != -1) close_file(fd);
+        if (ok && replace_file(path + ".tmp", path)) {
+            segment.path = path;
+        } else {
+            std::cout << "[ERROR] Could not write search index file " << path << "." << std::endl;
+        }
+    }
+
+    void seal() {
+        // Queries only read the open segment, so it can be encoded without the lock.
+        IndexPostings terms;
+        terms.reserve(open_postings_.size());
+        for (const auto& entry : open_postings_) terms.emplace_back(entry.first, &entry.second);
+        std::sort(terms.begin(), terms.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::shared_ptr<IndexSegment> segment = search_decode(search_encode(0, open_first_, open_docs_, terms));
+        write(*segment);
+        std::lock_guard<std::mutex> lock(mutex_);
+        segments_.push_back(std::move(segment));
+        open_first_ += open_docs_.size();
+        open_docs_.clear();
+        open_postings_.clear();
+    }
+
+    // Merges the oldest SEARCH_MERGE_FACTOR segments of the lowest level that has
+    // that many. Segments of one level always sit next to each other, since every
+    // level is older than the ones below it. Returns false if nothing was due.
+    bool merge() {
+        std::vector<std::shared_ptr<const IndexSegment>> segments = segments_; // only this thread changes segments_
+        size_t first = segments.size();
+        for (uint64_t level = 0; level < SEARCH_MAX_LEVEL && first == segments.size(); ++level) {
+            size_t run = 0;
+            for (size_t i = 0; i < segments.size(); ++i) {
+                run = segments[i]->level == level ? run + 1 : 0;
+                if (run == SEARCH_MERGE_FACTOR) {
+                    first = i + 1 - run;
+                    break;
+                }
+            }
+        }
+        if (first == segments.size()) return false;
+        std::vector<IndexDoc> docs;
+        std::map<std::string, std::vector<uint64_t>> postings;
+        std::vector<uint64_t> decoded;
+        for (size_t i = first; i < first + SEARCH_MERGE_FACTOR; ++i) {
+            const IndexSegment& segment = *segments[i];
+            docs.insert(docs.end(), segment.docs.begin(), segment.docs.end());
+            for (const IndexTerm& term : segment.terms) {
+                search_postings(segment, term, decoded);
+                std::vector<uint64_t>& list = postings[term.text];
+                list.insert(list.end(), decoded.begin(), decoded.end());
+            }
+        }
+        IndexPostings terms;
+        terms.reserve(postings.size());
+        for (const auto& entry : postings) terms.emplace_back(entry.first, &entry.second);
+        std::shared_ptr<IndexSegment> merged = search_decode(search_encode(segments[first]->level + 1, segments[first]->first_doc, docs, terms));
+        write(*merged);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            segments_.erase(segments_.begin() + first, segments_.begin() + first + SEARCH_MERGE_FACTOR);
+            segments_.insert(segments_.begin() + first, std::move(merged));
+        }
+        std::lock_guard<std::mutex> lock(search_write_mutex);
+        std::error_code ec;
+        for (size_t i = first; i < first + SEARCH_MERGE_FACTOR; ++i) {
+            if (!segments[i]->path.empty()) std::filesystem::remove(segments[i]->path, ec);
+        }
+        return true;
+    }
+
+    std::string dir_;
+    std::atomic<bool> caught_up_{false};
+
+    // Guards what queries read: the sealed segments and the open segment.
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<const IndexSegment>> segments_; // oldest first
+    uint64_t open_first_ = 0;                                   // doc id of the open segment's first message
+    std::vector<IndexDoc> open_docs_;
+    std::unordered_map<std::string, std::vector<uint64_t>> open_postings_;
+
+    // Indexer thread only.
+    int64_t open_since_ = 0;
+    uint64_t end_log_ = 0;
+    uint64_t end_offset_ = 0;
+};
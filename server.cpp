@@ -3,402 +3,1676 @@
 #include <vector>
 #include <thread>
 #include <mutex>
-#include <fstream>
-#include <sstream>
 #include <algorithm>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <deque>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <chrono>
+#include <charconv>
+#include <atomic>
+#include <shared_mutex>
+#include <functional>
+#include <condition_variable>
 
-#pragma comment(lib, "ws2_32.lib")
+#include "platform.h"
+#include "frame.h"
+#include "protocol.h"
+#include "line_framer.h"
+#include "user_store.h"
+#include "history.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
+#include "actor_pool.h"
+#include "snapshot.h"
+#include "auth_pool.h"
+#include "session.h"
+#include "timing_wheel.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "cluster.h"
+#include "config.h"
+#include "connection.h"
+#include "rooms.h"
+#include "tokenizer.h"
+#include "commands.h"
+#ifdef USE_EPOLL
+#include "handoff.h"
+#endif
 
-#define MAX_BUFFER_SIZE 4096
+#define MAX_EVENTS 256
+#define POLL_TIMEOUT_MS 50
+#define TIMER_TICK_MS 100 // resolution of the per-loop timing wheels
+#define HEARTBEAT_REPLY "PONG"
 
-struct User {
-    std::string username;
-    std::string password;
-    bool isAdmin;
-    std::string nickname;
+#ifdef USE_EPOLL
+// Hot restart (see handoff.h). While draining, the loops neither accept nor
+// watch their connections, and their timers stand still. Each frozen loop has
+// added its connections to `state` and waits for the handoff to end.
+struct Handoff {
+    SOCKET listener = INVALID_SOCKET; // where the next server connects
+    std::atomic<bool> draining{false};
+    std::mutex mutex;
+    std::condition_variable changed;
+    HandoffState state;
+    std::vector<int> fds; // the connections' sockets, in state order
+    size_t frozen = 0;
+    uint64_t attempt = 0; // bumped when a successor gives up, which thaws the loops
 };
 
-struct ClientInfo {
-    SOCKET socket;
-    std::string username;
-    std::string nickname;
-    int id;
-    std::string current_room;
-    bool isAdmin;
+Handoff handoff;
+#endif
+
+uint64_t seconds_to_ticks(unsigned seconds) {
+    return (uint64_t)seconds * 1000 / TIMER_TICK_MS;
+}
+
+// Called by the loop once it owns the connection.
+void start_auth_timer(EventLoop& loop, Connection& conn) {
+    conn.timer.owner = &conn;
+    conn.last_read_tick = loop.tick;
+    if (config.auth_timeout_seconds) loop.timers.schedule(conn.timer, loop.tick + seconds_to_ticks(config.auth_timeout_seconds));
+}
+
+// Replaces the login deadline once the client is in.
+void start_heartbeat_timer(EventLoop& loop, Connection& conn) {
+    conn.last_read_tick = loop.tick;
+    if (config.ping_interval_seconds) {
+        loop.timers.schedule(conn.timer, loop.tick + seconds_to_ticks(config.ping_interval_seconds));
+    } else {
+        loop.timers.cancel(conn.timer);
+    }
+}
+
+// Lists a connection that has logged in as an online client.
+std::shared_ptr<ClientInfo> add_client(Connection& conn) {
+    auto client = std::make_shared<ClientInfo>();
+    client->out = conn.out;
+    client->username = conn.username;
+    client->nickname = conn.nickname;
+    client->id = conn.id;
+    client->isAdmin = conn.isAdmin;
+    client->loop_index = conn.out->loop->index;
+    conn.client = client;
+    registry_add(client);
+    return client;
+}
+
+// Everything after the AUTH_SUCCESS line uses the protocol the client negotiated,
+// starting with the SESSION line that hands the client a token for RESUME.
+void enter_chat(Connection& conn, bool binary, Room& room) {
+    conn.state = ConnState::Chatting;
+    if (binary) {
+        conn.out->binary = true;
+        conn.framer.set_length_prefixed();
+    }
+    send_to_client(*conn.out, "SESSION " + session_token_issue(conn.username));
+    start_heartbeat_timer(*conn.out->loop, conn);
+    std::shared_ptr<ClientInfo> client = add_client(conn);
+    std::string welcome_message = "[" + room.name + "] " + conn.nickname + " has joined!";
+    std::cout << welcome_message << std::endl;
+    place_client(client, room, "SYS_MSG " + welcome_message);
+}
+
+// What an auth worker found out about one LOGIN or SIGNUP.
+struct AuthResult {
+    bool ok = false;
+    std::string error; // the AUTH_FAIL text
+    User user;         // username and nickname as sent; filled in on success
+    bool binary = false;
+    MetricHistogram latency;
+    uint64_t started;
 };
 
-std::vector<ClientInfo> clients;
-std::vector<std::string> rooms;
-std::mutex clients_mutex;
-std::mutex rooms_mutex;
-std::mutex user_file_mutex;
-int next_client_id = 1;
+bool process_lines(Connection& conn);
 
-void send_to_client(SOCKET sock, const std::string& message) {
-    std::string formatted_msg = message + "\n";
-    send(sock, formatted_msg.c_str(), (int)formatted_msg.length(), 0);
+void send_auth_success(Connection& conn, const User& user, bool binary) {
+    send_to_client(*conn.out, "AUTH_SUCCESS " + std::string(user.isAdmin ? "true" : "false") + " " + user.nickname +
+                                  (binary ? " " PROTOCOL_BINARY_TOKEN : ""));
+    conn.username = user.username;
+    conn.nickname = user.nickname;
+    conn.isAdmin = user.isAdmin;
 }
 
-// An "unlocked" version for use when the mutex is already held
-void broadcast_to_room_unlocked(const std::string& room_name, const std::string& message) {
-    for (const auto& client : clients) {
-        if (client.current_room == room_name) {
-            send_to_client(client.socket, message);
+// Runs on the connection's own loop once its auth worker is done, then carries on
+// with whatever the client sent after the LOGIN/SIGNUP line.
+void finish_auth(Connection& conn, const AuthResult& result) {
+    if (result.ok) {
+        send_auth_success(conn, result.user, result.binary);
+        enter_chat(conn, result.binary, *lobby_room);
+    } else {
+        send_to_client(*conn.out, "AUTH_FAIL " + result.error);
+        conn.state = ConnState::Authenticating;
+        metrics_count(COUNTER_AUTH_FAILURES);
+    }
+    metrics_record(result.latency, metrics_now() - result.started);
+#ifdef USE_EPOLL
+    if (handoff.draining.load()) return; // what the client sent next goes to the successor unread
+#endif
+    pause_reads(conn, false);
+    if (!process_lines(conn)) shutdown(conn.socket, SHUT_RDWR);
+}
+
+// Runs on an auth worker: the password KDF is far too slow for an event loop.
+void check_credentials(AuthResult& result, bool signup, const std::string& password) {
+    User user;
+    if (!signup) {
+        if (!find_user(result.user.username, user)) {
+            // Spend the same time on unknown users, so the reply time does not tell them apart.
+            static const std::string unknown_user_hash = hash_password("", user_store.kdf_iterations);
+            verify_password(unknown_user_hash, password);
+            result.error = "Invalid credentials";
+        } else if (!verify_password(user.password, password)) {
+            result.error = "Invalid credentials";
+        } else {
+            if (!is_password_hash(user.password)) upgrade_password(user.username, hash_password(password, user_store.kdf_iterations));
+            result.user = user;
+            result.ok = true;
         }
+        return;
+    }
+    // add_user has the final say; this only saves hashing for a name that is taken.
+    SignupResult created = SignupResult::Exists;
+    if (!find_user(result.user.username, user)) {
+        result.user.password = hash_password(password, user_store.kdf_iterations);
+        created = add_user(result.user);
+    }
+    if (created == SignupResult::Created) {
+        result.ok = true;
+        const User& account = result.user;
+        if (cluster.enabled) cluster_broadcast_account(account.username, account.nickname, account.password);
+    } else if (created == SignupResult::Exists) {
+        result.error = "User already exists";
+    } else if (created == SignupResult::Invalid) {
+        result.error = "Usernames and nicknames cannot contain commas.";
+    } else {
+        result.error = "Could not save your account, please try again later.";
     }
 }
 
-void broadcast_to_room(const std::string& room_name, const std::string& message) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    broadcast_to_room_unlocked(room_name, message);
+// RESUME <token> <room> [BINARY]. Checking the token is one HMAC, so unlike a
+// password it is done right here on the loop.
+void resume_session(Connection& conn, Tokenizer& tokens) {
+    MetricsTimer timer(HIST_RESUME);
+    std::string_view token = tokens.next();
+    std::string room_name(tokens.next());
+    bool binary = tokens.next() == PROTOCOL_BINARY_TOKEN;
+    std::string username = session_token_verify(token);
+    User user;
+    if (username.empty() || !find_user(username, user)) {
+        send_to_client(*conn.out, "AUTH_FAIL Session expired, please log in again.");
+        metrics_count(COUNTER_AUTH_FAILURES);
+        return;
+    }
+    // The room may have been deleted while the client was away.
+    std::shared_ptr<const RoomList> list = room_list.load();
+    bool room_exists = std::find(list->names.begin(), list->names.end(), room_name) != list->names.end();
+    send_auth_success(conn, user, binary);
+    metrics_count(COUNTER_SESSIONS_RESUMED);
+    enter_chat(conn, binary, room_exists ? *intern_room(room_name) : *lobby_room);
 }
 
-std::vector<User> load_users() {
-    std::lock_guard<std::mutex> lock(user_file_mutex);
-    std::vector<User> users;
-    std::ifstream file("users.csv");
-    std::string line;
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        std::string username, password, isAdminStr, nickname;
-        if (std::getline(ss, username, ',') && std::getline(ss, password, ',') && std::getline(ss, isAdminStr, ',') && std::getline(ss, nickname)) {
-            users.push_back({username, password, (isAdminStr == "true"), nickname});
+void handle_auth_message(Connection& conn, std::string_view message) {
+    Tokenizer tokens(message);
+    std::string_view command = tokens.next();
+    if (command == "RESUME") {
+        resume_session(conn, tokens);
+        return;
+    }
+    std::string username(tokens.next());
+    std::string password(tokens.next());
+    std::string nickname(tokens.next());
+    bool binary = tokens.next() == PROTOCOL_BINARY_TOKEN;
+    bool signup = command == "SIGNUP";
+
+    if (!signup && command != "LOGIN") {
+        send_to_client(*conn.out, "AUTH_FAIL Invalid command");
+        metrics_count(COUNTER_AUTH_FAILURES);
+        return;
+    }
+    if (signup && (nickname == "N/A" || nickname.empty())) {
+        send_to_client(*conn.out, "AUTH_FAIL Nickname cannot be empty.");
+        metrics_count(COUNTER_AUTH_FAILURES);
+        return;
+    }
+    if (signup && (!is_user_field(username) || !is_user_field(nickname))) {
+        send_to_client(*conn.out, "AUTH_FAIL Usernames and nicknames cannot contain commas.");
+        metrics_count(COUNTER_AUTH_FAILURES);
+        return;
+    }
+    auto result = std::make_shared<AuthResult>();
+    result->user = {username, "", false, nickname};
+    result->binary = binary;
+    result->latency = signup ? HIST_SIGNUP : HIST_LOGIN;
+    result->started = metrics_now();
+    std::shared_ptr<Outbound> out = conn.out;
+    bool queued = auth_pool.try_submit([out, result, signup, password = std::move(password)] {
+        {
+            std::lock_guard<std::mutex> lock(out->mutex);
+            if (out->closed) return; // gave up while waiting in the queue
         }
+        check_credentials(*result, signup, password);
+        mailbox_post(*out->loop, new MailboxItem([out, result] {
+            {
+                std::lock_guard<std::mutex> lock(out->mutex);
+                if (out->closed) return;
+            }
+            finish_auth(*out->conn, *result);
+        }));
+    });
+    if (!queued) {
+        // Refused before any hashing, so a reconnect storm costs the loops next to nothing.
+        send_to_client(*conn.out, "AUTH_FAIL Server busy, please try again.");
+        metrics_count(COUNTER_AUTH_REJECTED);
+        return;
+    }
+    conn.state = ConnState::Verifying;
+    pause_reads(conn, true);
+}
+
+// Takes a token, or counts the refusal. Only the first refusal after an accepted
+// line is answered (see refuse_flood), so a flood does not buy itself a reply per line.
+bool take_token(Connection& conn, TokenBucket& bucket) {
+    if (bucket.try_take(metrics_now())) {
+        conn.throttle_warned = false;
+        return true;
+    }
+    metrics_count(COUNTER_RATE_LIMITED);
+    return false;
+}
+
+void refuse_flood(Connection& conn, const std::string& reason) {
+    if (conn.throttle_warned) return;
+    conn.throttle_warned = true;
+    send_to_client(*conn.out, "CMD_RESP [Error] " + reason + " Please slow down.");
+}
+
+// The common case: a chat line goes straight to the room. The connection's
+// cached room is all it needs, so no shared index is consulted. The room's actor
+// fans the line out, so it lands in order with the room's joins and leaves.
+void send_chat(Connection& conn, std::string_view message) {
+    Room* room = conn.client->room.load(std::memory_order_acquire);
+    if (!room) return;
+    if (!take_token(conn, conn.chat_limit)) {
+        refuse_flood(conn, "You are sending messages too fast; some were dropped.");
+        return;
+    }
+    if (!take_token(conn, room->chat_limit)) {
+        refuse_flood(conn, "Room '" + room->name + "' is too busy right now; your message was dropped.");
+        return;
+    }
+    char id_buf[16];
+    int id_len = std::snprintf(id_buf, sizeof(id_buf), "%d", conn.id);
+    FrameRef frame = encode_frame({"MSG ", std::string_view(id_buf, id_len), " ", conn.nickname, " [", room->name, "] ", message});
+    actor_pool.post(room->actor, [room, frame] { room_broadcast(*room, frame, true); });
+}
+
+// Returns false when the client asked to leave and the connection should be closed.
+bool handle_chat_message(Connection& conn, std::string_view message) {
+    Tokenizer args(message);
+    std::string_view command = args.next();
+    // Lines that are not a known command, including unknown "/..." ones, are chat.
+    const CommandEntry* entry = command.empty() || command.front() != '/' ? nullptr : find_command(command);
+    if (!entry) {
+        MetricsTimer timer(HIST_CHAT);
+        send_chat(conn, message);
+        return true;
     }
-    return users;
+    if (entry->admin_only && !conn.isAdmin) {
+        send_to_client(*conn.out, "CMD_RESP [Error] You do not have permission to use this command.");
+        return true;
+    }
+    if (entry->budget != Budget::None && !take_token(conn, entry->budget == Budget::Msg ? conn.msg_limit : conn.command_limit)) {
+        refuse_flood(conn, std::string(entry->name) + " is rate limited; that one was ignored.");
+        return true;
+    }
+
+    Room* room = conn.client->room.load(std::memory_order_acquire);
+    if (!room) return true;
+    CommandContext ctx{conn, *conn.out, *room};
+    MetricsTimer timer(entry->latency);
+    return entry->handler(ctx, args);
+}
+
+void leave_chat(const Connection& conn) {
+    Room* final_room = remove_client(conn.client);
+    registry_remove(*conn.client);
+    if (!final_room) return;
+    std::cout << "[" + final_room->name + "] " + conn.nickname + " has left the chat." << std::endl;
 }
 
-bool save_user(const User& user) {
-    auto all_users = load_users();
-    for (const auto& u : all_users) {
-        if (u.username == user.username) {
+// Records a line for --capture. Auth lines keep their shape for the replay tool,
+// but the password, or the session token apart from its username, is blanked out.
+void capture_line(const Connection& conn, std::string_view line) {
+    Tokenizer tokens(line);
+    std::string_view command = tokens.next();
+    if (conn.state != ConnState::Authenticating) {
+        trace_record(TRACE_LINE, (uint64_t)conn.id, line);
+        return;
+    }
+    if (command != "RESUME" && command != "LOGIN" && command != "SIGNUP") {
+        trace_record(TRACE_AUTH, (uint64_t)conn.id, line);
+        return;
+    }
+    std::string redacted(command);
+    redacted += " ";
+    if (command == "RESUME") {
+        // <username>:<expiry>:<mac>
+        std::string_view token = tokens.next();
+        size_t mac_start = token.rfind(':');
+        size_t expiry_start = mac_start == std::string_view::npos || mac_start == 0 ? mac_start : token.rfind(':', mac_start - 1);
+        redacted += expiry_start == std::string_view::npos ? std::string_view(TRACE_REDACTED) : token.substr(0, expiry_start);
+    } else {
+        redacted += tokens.next();
+        tokens.next();
+        redacted += " " TRACE_REDACTED;
+    }
+    std::string_view rest = tokens.remainder();
+    if (!rest.empty()) redacted += " " + std::string(rest);
+    trace_record(TRACE_AUTH, (uint64_t)conn.id, redacted);
+}
+
+// Runs every complete line (or binary LINE frame) in the framer through the
+// connection's state machine, in order, so pipelined commands from one read are
+// all handled. Stops early while a password is being checked; the rest waits in
+// the framer. Returns false when the connection should be closed.
+bool process_lines(Connection& conn) {
+    std::string_view line;
+    LineFramer::Result result;
+    while (conn.state != ConnState::Verifying && (result = conn.framer.next_line(line)) != LineFramer::Result::NeedMore) {
+        if (result == LineFramer::Result::Invalid) return false;
+        if (result == LineFramer::Result::TooLong) {
+            send_to_client(*conn.out, "CMD_RESP [Error] Line too long (max " + std::to_string(config.max_line_length) + " bytes); it was discarded.");
+            continue;
+        }
+        if (conn.framer.length_prefixed()) {
+            BinaryMessage msg;
+            if (!decode_binary_message(line, msg)) return false;
+            if (msg.opcode != OP_LINE) continue; // opcodes from newer clients are skipped
+            line = msg.strings[0];
+            // Still one line: text clients and the history logs are line-based.
+            if (line.find_first_of("\r\n") != std::string_view::npos) {
+                thread_local std::string flattened;
+                flattened.assign(line);
+                std::replace_if(flattened.begin(), flattened.end(), [](char c) { return c == '\r' || c == '\n'; }, ' ');
+                line = flattened;
+            }
+        }
+        if (line.empty() || line == HEARTBEAT_REPLY) continue; // a PONG has done its job by arriving
+        metrics_count(COUNTER_LINES_IN);
+        if (trace_log.enabled) capture_line(conn, line);
+        if (conn.state == ConnState::Authenticating) {
+            handle_auth_message(conn, line);
+        } else if (!handle_chat_message(conn, line)) {
             return false;
         }
     }
-    std::lock_guard<std::mutex> lock(user_file_mutex);
-    std::ofstream file("users.csv", std::ios::app);
-    file << user.username << "," << user.password << "," << (user.isAdmin ? "true" : "false") << "," << user.nickname << "\n";
     return true;
 }
 
-void handle_client(SOCKET client_socket, int id) {
-    char buffer[MAX_BUFFER_SIZE];
-    std::string current_username;
-    std::string current_nickname;
-    bool is_admin = false;
-    bool authenticated = false;
-
-    while (!authenticated) {
-        int bytes_received = recv(client_socket, buffer, MAX_BUFFER_SIZE - 1, 0);
-        if (bytes_received <= 0) { closesocket(client_socket); return; }
-        buffer[bytes_received] = '\0';
-        std::stringstream ss(buffer);
-        std::string command, username, password, nickname;
-        ss >> command >> username >> password >> nickname;
-
-        if (command == "LOGIN") {
-            auto users = load_users();
-            bool found = false;
-            for (const auto& user : users) {
-                if (user.username == username && user.password == password) {
-                    send_to_client(client_socket, "AUTH_SUCCESS " + std::string(user.isAdmin ? "true" : "false") + " " + user.nickname);
-                    current_username = user.username;
-                    current_nickname = user.nickname;
-                    is_admin = user.isAdmin;
-                    authenticated = true;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) send_to_client(client_socket, "AUTH_FAIL Invalid credentials");
-        } else if (command == "SIGNUP") {
-            if (nickname == "N/A" || nickname.empty()){
-                send_to_client(client_socket, "AUTH_FAIL Nickname cannot be empty.");
-            }
-            else if (save_user({username, password, false, nickname})) {
-                send_to_client(client_socket, "AUTH_SUCCESS false " + nickname);
-                current_username = username;
-                current_nickname = nickname;
-                is_admin = false;
-                authenticated = true;
-            } else {
-                send_to_client(client_socket, "AUTH_FAIL User already exists");
-            }
-        } else {
-            send_to_client(client_socket, "AUTH_FAIL Invalid command");
+// Reads whatever is available on a readable socket and processes it. While reads
+// are paused only a hangup gets here. Returns false when the connection should
+// be closed.
+bool on_readable(Connection& conn, bool hung_up) {
+    if (conn.out->read_paused) return !hung_up;
+    int bytes_received = recv(conn.socket, conn.framer.write_ptr(), (int)conn.framer.write_space(), 0);
+    if (bytes_received == SOCKET_ERROR && would_block()) return true;
+    if (bytes_received <= 0) return false;
+    conn.framer.commit(bytes_received);
+    conn.last_read_tick = conn.out->loop->tick;
+    metrics_count(COUNTER_BYTES_IN, (uint64_t)bytes_received);
+    return process_lines(conn);
+}
+
+// Binds the chat port. With reuse_port set, every event loop binds its own socket
+// and the kernel spreads incoming connections over them.
+SOCKET open_listener(bool reuse_port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+#ifdef SO_REUSEPORT
+    int one = 1;
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&one, sizeof(one)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+#else
+    (void)reuse_port;
+#endif
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((uint16_t)config.port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sock, (sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR || listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// A listener handed over by the previous server replaces the loop's own.
+bool event_loop_init(EventLoop& loop, SOCKET listener = INVALID_SOCKET) {
+#ifdef USE_EPOLL
+    loop.epoll_fd = epoll_create1(0);
+    loop.wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    loop.listener = listener != INVALID_SOCKET ? listener : open_listener(true);
+    if (loop.epoll_fd == -1 || loop.wakeup_fd == -1 || loop.listener == INVALID_SOCKET || !set_non_blocking(loop.listener)) return false;
+    // The addresses of the two fields tag their events apart from connections.
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop.wakeup_fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.wakeup_fd, &ev) == -1) return false;
+    ev.data.ptr = &loop.listener;
+    return epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listener, &ev) != -1;
+#else
+    (void)loop; (void)listener;
+    return true;
+#endif
+}
+
+// Called from the accept thread; the loop takes ownership of conn. Returns false,
+// leaving conn to the caller, if the loop cannot watch it.
+bool event_loop_add(EventLoop& loop, Connection* conn) {
+#ifdef USE_EPOLL
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev) == -1) return false;
+    conn->loop_slot = loop.connections.size();
+    loop.connections.push_back(conn);
+    start_auth_timer(loop, *conn); // the epoll loops accept on their own thread
+#else
+    std::lock_guard<std::mutex> lock(loop.pending_mutex);
+    loop.pending.push_back(conn);
+#endif
+    return true;
+}
+
+Connection* make_connection(EventLoop& loop, SOCKET client_socket, int id) {
+    Connection* conn = new Connection(client_socket, id, std::make_shared<Outbound>(), config.max_line_length);
+    conn->out->socket = client_socket;
+    conn->out->loop = &loop;
+    conn->out->conn = conn;
+    conn->chat_limit.configure(config.chat_limit);
+    conn->msg_limit.configure(config.msg_limit);
+    conn->command_limit.configure(config.command_limit);
+    return conn;
+}
+
+Connection* new_connection(EventLoop& loop, SOCKET client_socket) {
+    metrics_count(COUNTER_CONNECTIONS_ACCEPTED);
+    // Output is already batched per loop iteration, so Nagle would only add delay.
+    int nodelay = config.tcp_nodelay ? 1 : 0;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+    int id = cluster_client_id(next_client_id.fetch_add(1, std::memory_order_relaxed));
+    Connection* conn = make_connection(loop, client_socket, id);
+    if (trace_log.enabled) trace_record(TRACE_OPEN, (uint64_t)id);
+    return conn;
+}
+
+#ifdef USE_EPOLL
+// Takes every connection waiting on this loop's own listener; the loop owns them
+// from the start, so no other thread ever hands it a socket.
+void accept_connections(EventLoop& loop, SOCKET listener) {
+    while (true) {
+        SOCKET client_socket = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+        if (client_socket == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        Connection* conn = new_connection(loop, client_socket);
+        if (!event_loop_add(loop, conn)) {
+            closesocket(client_socket);
+            delete conn;
         }
     }
+}
+#endif
+
+// Keeps a loop on one core, so its connections' state stays in that core's caches.
+void pin_to_core(unsigned core) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (core % (sizeof(DWORD_PTR) * 8)));
+#else
+    (void)core;
+#endif
+}
 
-    std::string initial_room = "Lobby";
+void close_connection(EventLoop& loop, Connection* conn) {
     {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.push_back({client_socket, current_username, current_nickname, id, initial_room, is_admin});
+        // Once closed is set no other thread will write to or re-arm this socket.
+        std::lock_guard<std::mutex> lock(conn->out->mutex);
+        conn->out->closed = true;
+        conn->out->frames.clear();
+        if (conn->out->flush_scheduled) {
+            loop.dirty.erase(std::remove(loop.dirty.begin(), loop.dirty.end(), conn->out.get()), loop.dirty.end());
+        }
     }
-    std::string welcome_message = "[" + initial_room + "] " + current_nickname + " has joined!";
-    std::cout << welcome_message << std::endl;
-    broadcast_to_room(initial_room, "SYS_MSG " + welcome_message);
+    loop.timers.cancel(conn->timer);
+    if (conn->state == ConnState::Chatting) leave_chat(*conn);
+#ifdef USE_EPOLL
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, conn->socket, nullptr);
+    loop.connections[conn->loop_slot] = loop.connections.back();
+    loop.connections[conn->loop_slot]->loop_slot = conn->loop_slot;
+    loop.connections.pop_back();
+#else
+    (void)loop;
+#endif
+    closesocket(conn->socket);
+    if (trace_log.enabled) trace_record(TRACE_CLOSE, (uint64_t)conn->id);
+    delete conn;
+    metrics_count(COUNTER_CONNECTIONS_CLOSED);
+}
 
-    while (true) {
-        int bytes_received = recv(client_socket, buffer, MAX_BUFFER_SIZE - 1, 0);
-        if (bytes_received <= 0) break;
-        
-        buffer[bytes_received] = '\0';
-        std::string message(buffer);
-        std::stringstream msg_stream(message);
-        std::string command;
-        msg_stream >> command;
-        
-        std::string user_current_room;
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            auto it = std::find_if(clients.begin(), clients.end(), [id](const ClientInfo& c){ return c.id == id; });
-            if(it != clients.end()) user_current_room = it->current_room;
+// Writes out everything queued on this loop's thread since the last flush, once
+// the flush window has passed.
+void flush_dirty(EventLoop& loop) {
+    if (loop.dirty.empty()) return;
+    if (config.flush_window_us &&
+        std::chrono::steady_clock::now() - loop.dirty_since < std::chrono::microseconds(config.flush_window_us)) return;
+    loop.flushing.swap(loop.dirty);
+    for (Outbound* out : loop.flushing) {
+        // The read side then sees the error and closes the connection as usual.
+        if (!flush_outbound(*out)) shutdown(out->socket, SHUT_RDWR);
+    }
+    loop.flushing.clear();
+}
+
+uint64_t clock_tick() {
+    auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() / TIMER_TICK_MS;
+}
+
+// Shutting the socket down sends the connection through the usual farewell path.
+void evict(Connection& conn, const char* reason) {
+    std::cout << "[INFO] Disconnecting connection " << conn.id << (conn.nickname.empty() ? "" : " (" + conn.nickname + ")") << ": " << reason << std::endl;
+    metrics_count(COUNTER_CONNECTIONS_TIMED_OUT);
+    shutdown(conn.socket, SHUT_RDWR);
+}
+
+void on_connection_timer(EventLoop& loop, Connection& conn) {
+    if (conn.state != ConnState::Chatting) {
+        evict(conn, "no login in time");
+        return;
+    }
+    if (conn.ping_outstanding) {
+        if (conn.last_read_tick < conn.ping_sent_tick) {
+            evict(conn, "no answer to PING");
+            return;
         }
+        conn.ping_outstanding = false;
+    }
+    uint64_t quiet_until = conn.last_read_tick + seconds_to_ticks(config.ping_interval_seconds);
+    if (loop.tick < quiet_until) {
+        loop.timers.schedule(conn.timer, quiet_until);
+        return;
+    }
+    send_to_client(*conn.out, "PING");
+    conn.ping_outstanding = true;
+    conn.ping_sent_tick = loop.tick;
+    loop.timers.schedule(conn.timer, loop.tick + std::max<uint64_t>(1, seconds_to_ticks(config.ping_timeout_seconds)));
+}
+
+// Fires every timer due at or before the loop's current tick.
+void run_timers(EventLoop& loop) {
+    loop.timers.advance(loop.tick + 1, [&loop](TimerNode& node) {
+        on_connection_timer(loop, *static_cast<Connection*>(node.owner));
+    });
+}
 
-        if (command == "/exit") {
+// How long the loop may sleep without holding back queued output, in milliseconds.
+int flush_timeout_ms(const EventLoop& loop, int idle_timeout_ms) {
+    if (loop.dirty.empty()) return idle_timeout_ms;
+    auto left = loop.dirty_since + std::chrono::microseconds(config.flush_window_us) - std::chrono::steady_clock::now();
+    if (left <= std::chrono::steady_clock::duration::zero()) return 0;
+    // Rounded up: the poll calls only take whole milliseconds.
+    int ms = (int)std::chrono::ceil<std::chrono::milliseconds>(left).count();
+    return idle_timeout_ms < 0 ? ms : std::min(ms, idle_timeout_ms);
+}
+
+void run_event_loop(EventLoop& loop) {
+    current_loop = &loop;
+    if (config.pin_reactors) pin_to_core((unsigned)loop.index % std::max(1u, std::thread::hardware_concurrency()));
+    loop.tick = clock_tick();
+    run_timers(loop); // starts the empty wheel at the current tick
+#ifdef USE_EPOLL
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        // With timers armed the loop wakes every tick; the wheel makes that cheap.
+        int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, flush_timeout_ms(loop, loop.timers.size() ? TIMER_TICK_MS : -1));
+        loop.tick = clock_tick();
+        if (n == -1) {
+            if (errno == EINTR) continue;
             break;
-        } else if (command == "/who") {
-            std::string user_list_msg = "CMD_RESP --- Users in [" + user_current_room + "] ---";
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            for (const auto& client : clients) {
-                if (client.current_room == user_current_room) {
-                    user_list_msg += "| - " + client.nickname;
-                }
-            }
-            send_to_client(client_socket, user_list_msg);
-        } else if (command == "/whoall") {
-            if (!is_admin) {
-                send_to_client(client_socket, "CMD_RESP [Error] You do not have permission to use this command.");
-            } else {
-                std::string user_list_msg = "CMD_RESP --- All Online Users ---";
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                for (const auto& client : clients) {
-                    user_list_msg += "| - " + client.nickname + " (" + client.username + ") in [" + client.current_room + "]";
-                }
-                send_to_client(client_socket, user_list_msg);
-            }
-        } else if (command == "/list") {
-            std::string room_list_msg = "CMD_RESP --- Active Rooms ---";
-            std::lock_guard<std::mutex> lock(rooms_mutex);
-            if (rooms.empty()) {
-                room_list_msg += "|[No rooms available yet]";
-            } else {
-                for (const auto& room : rooms) {
-                    room_list_msg += "| - " + room;
-                }
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == &loop.wakeup_fd) {
+                mailbox_drain(loop);
+                continue;
             }
-            send_to_client(client_socket, room_list_msg);
-        } else if (command == "/create") {
-            std::string room_name;
-            msg_stream >> room_name;
-            if (room_name.empty() || room_name == "Lobby") {
-                send_to_client(client_socket, "CMD_RESP [Error] Invalid room name.");
-            } else {
-                std::lock_guard<std::mutex> lock(rooms_mutex);
-                if (std::find(rooms.begin(), rooms.end(), room_name) != rooms.end()) {
-                    send_to_client(client_socket, "CMD_RESP [Error] Room '" + room_name + "' already exists.");
-                } else {
-                    rooms.push_back(room_name);
-                    send_to_client(client_socket, "CMD_RESP Room '" + room_name + "' created successfully.");
-                }
+            if (handoff.draining.load(std::memory_order_relaxed)) continue; // left over from before the loop stopped watching
+            if (events[i].data.ptr == &loop.listener) {
+                accept_connections(loop, loop.listener);
+                continue;
             }
-        } else if (command == "/join") {
-            std::string room_name;
-            msg_stream >> room_name;
-            bool room_exists;
-            {
-                std::lock_guard<std::mutex> lock(rooms_mutex);
-                room_exists = (std::find(rooms.begin(), rooms.end(), room_name) != rooms.end());
+            Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+            bool keep = true;
+            if (events[i].events & EPOLLOUT) keep = flush_outbound(*conn->out);
+            if (keep && (events[i].events & ~EPOLLOUT)) keep = on_readable(*conn, events[i].events & (EPOLLHUP | EPOLLERR));
+            if (!keep) close_connection(loop, conn);
+        }
+        if (!handoff.draining.load(std::memory_order_relaxed)) run_timers(loop);
+        flush_dirty(loop);
+    }
+#else
+    std::vector<pollfd> fds;
+    std::vector<MailboxItem*> tasks;
+    while (true) {
+        loop.tick = clock_tick();
+        {
+            std::lock_guard<std::mutex> lock(loop.pending_mutex);
+            for (Connection* conn : loop.pending) start_auth_timer(loop, *conn);
+            loop.connections.insert(loop.connections.end(), loop.pending.begin(), loop.pending.end());
+            loop.pending.clear();
+            tasks.swap(loop.pending_tasks);
+        }
+        for (MailboxItem* item : tasks) {
+            mailbox_deliver(*item);
+            delete item;
+        }
+        tasks.clear();
+        flush_dirty(loop);
+        if (loop.connections.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS));
+            continue;
+        }
+        fds.resize(loop.connections.size());
+        for (size_t i = 0; i < loop.connections.size(); ++i) {
+            Outbound& out = *loop.connections[i]->out;
+            std::lock_guard<std::mutex> lock(out.mutex);
+            fds[i].fd = loop.connections[i]->socket;
+            fds[i].events = (out.read_paused ? 0 : POLLIN) | (out.write_armed ? POLLOUT : 0);
+            fds[i].revents = 0;
+        }
+        // The timeout bounds how long a freshly accepted connection waits to be picked up.
+        if (poll_sockets(fds.data(), fds.size(), flush_timeout_ms(loop, POLL_TIMEOUT_MS)) <= 0) {
+            loop.tick = clock_tick();
+            run_timers(loop);
+            flush_dirty(loop);
+            continue;
+        }
+        loop.tick = clock_tick();
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            bool keep = true;
+            if (fds[i].revents & POLLOUT) keep = flush_outbound(*loop.connections[i]->out);
+            if (keep && (fds[i].revents & ~POLLOUT)) keep = on_readable(*loop.connections[i], fds[i].revents & (POLLHUP | POLLERR | POLLNVAL));
+            if (!keep) {
+                close_connection(loop, loop.connections[i]);
+                loop.connections[i] = nullptr;
             }
-             if (!room_exists && room_name != "Lobby") {
-                send_to_client(client_socket, "CMD_RESP [Error] Room '" + room_name + "' does not exist.");
-            } else if (user_current_room == room_name) {
-                send_to_client(client_socket, "CMD_RESP [Error] You are already in that room.");
-            } else {
-                broadcast_to_room(user_current_room, "SYS_MSG [" + user_current_room + "] " + current_nickname + " has left.");
-                {
-                    std::lock_guard<std::mutex> lock(clients_mutex);
-                    for (auto& client : clients) { if (client.id == id) { client.current_room = room_name; break; } }
-                }
-                send_to_client(client_socket, "JOIN_SUCCESS " + room_name);
-                broadcast_to_room(room_name, "SYS_MSG [" + room_name + "] " + current_nickname + " has joined!");
+        }
+        run_timers(loop);
+        flush_dirty(loop);
+        loop.connections.erase(std::remove(loop.connections.begin(), loop.connections.end(), nullptr), loop.connections.end());
+    }
+#endif
+}
+
+// Messages from other cluster nodes, on the bus thread. Anything that touches a
+// room's members or presence runs on the room's actor, after everything the
+// sending node said about the room before it.
+void on_bus_message(int node, const BusMessage& msg) {
+    metrics_count(COUNTER_BUS_MESSAGES_IN);
+    std::string name(msg.strings[0]);
+    switch (msg.opcode) {
+    case BUS_ONLINE:
+        directory_add((int)msg.ids[0], name, std::string(msg.strings[1]));
+        break;
+    case BUS_OFFLINE:
+        directory_remove((int)msg.ids[0]);
+        break;
+    case BUS_ACCOUNT: {
+        // Admin rights come only from each node's own users.csv, never from the bus,
+        // and an account with a comma, which could forge one in the journal, is
+        // dropped. add_user waits for the journal's fsync, so it runs on the auth pool
+        // rather than holding up every other node's messages.
+        User account{name, std::string(msg.strings[2]), false, std::string(msg.strings[1])};
+        if (!is_valid_account(account)) {
+            std::cout << "[ERROR] Dropped a malformed account from node " << node << "." << std::endl;
+            break;
+        }
+        auth_pool.submit([account] {
+            User user;
+            if (!find_user(account.username, user)) add_user(account);
+        });
+        break;
+    }
+    case BUS_ROOM_CREATE:
+        if (is_valid_room_name(name)) add_room_name(name);
+        break;
+    case BUS_ROOM_DELETE:
+        if (remove_room_name(name)) evacuate_room(name, std::string(msg.strings[1]));
+        break;
+    case BUS_MEMBER: {
+        Room* room = intern_room(name);
+        if (!room_is_local(*room)) break;
+        bool entered = msg.ids[0] != 0;
+        PresenceEntry member{(int)msg.ids[1], std::string(msg.strings[1]), std::string(msg.strings[2])};
+        actor_pool.post(room->actor, [room, node, entered, member] {
+            if (publish_presence(*room, member, entered)) room->remote_members[node] += entered ? 1 : -1;
+        });
+        break;
+    }
+    case BUS_RELAY:
+    case BUS_DELIVER: {
+        Room* room = intern_room(name);
+        bool relay = msg.opcode == BUS_RELAY;
+        if (relay && !room_is_local(*room)) break;
+        bool chat = msg.ids[0] != 0;
+        FrameRef frame = encode_frame({msg.strings[1]});
+        actor_pool.post(room->actor, [room, frame, chat, relay] {
+            if (relay) room_broadcast(*room, frame, chat);
+            else deliver_to_room(*room, frame, chat);
+        });
+        break;
+    }
+    case BUS_PMSG: {
+        std::shared_ptr<ClientInfo> target = registry_find_username(name);
+        if (target) send_to_client(*target->out, "P_MSG (from " + std::string(msg.strings[1]) + "): " + std::string(msg.strings[2]));
+        break;
+    }
+    case BUS_KICK:
+        cluster_send(node, BUS_REPLY, {msg.ids[0]}, {kick_user(name)});
+        break;
+    case BUS_WHO: {
+        Room* room = intern_room(name);
+        uint32_t reply_to = msg.ids[0];
+        actor_pool.post(room->actor, [room, node, reply_to] {
+            cluster_send(node, BUS_REPLY, {reply_to}, {who_reply(*room, *room->presence.load())});
+        });
+        break;
+    }
+    case BUS_REPLY:
+        if (std::shared_ptr<ClientInfo> client = registry_find_id((int)msg.ids[0])) send_to_client(*client->out, name);
+        break;
+    }
+}
+
+std::vector<Room*> rooms_owned_by(int node) {
+    std::vector<Room*> owned;
+    std::shared_lock<std::shared_mutex> lock(room_index_mutex);
+    for (const auto& room : room_table) {
+        if (room->owner == node) owned.push_back(room.get());
+    }
+    return owned;
+}
+
+// Queues this node's state for a node whose link just came up: signups it missed,
+// who is online here and which rooms exist, then, from the rooms' actors, which of
+// this node's clients are in the rooms that node owns. Runs with the peer's lock
+// held, so it appends to the outbox instead of calling cluster_send.
+void bus_sync(int node, BusPeer& peer) {
+    std::string& outbox = peer.outbox;
+    for (const FrameRef& account : peer.missed_accounts) {
+        bus_append(outbox, account);
+        peer.unsent_accounts.emplace_back(peer.written_bytes + outbox.size(), account);
+    }
+    peer.missed_accounts.clear();
+    for (RegistryShard& shard : registry) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto& entry : shard.by_id) {
+            const ClientInfo& client = *entry.second;
+            bus_append(outbox, bus_message(BUS_ONLINE, {(uint32_t)client.id}, {client.username, client.nickname}));
+        }
+    }
+    for (const std::string& name : room_list.load()->names) {
+        bus_append(outbox, bus_message(BUS_ROOM_CREATE, {}, {name}));
+    }
+    for (Room* room : rooms_owned_by(node)) {
+        actor_pool.post(room->actor, [room] {
+            std::vector<std::shared_ptr<ClientInfo>> members;
+            room_members(*room, members);
+            for (const auto& client : members) {
+                cluster_send(room->owner, BUS_MEMBER, {1, (uint32_t)client->id}, {room->name, client->nickname, client->username});
             }
-        } else if (command == "/leave") {
-            if (user_current_room == "Lobby") {
-                send_to_client(client_socket, "CMD_RESP [Error] You are already in the Lobby.");
-            } else {
-                std::string old_room = user_current_room;
-                std::string new_room = "Lobby";
-                broadcast_to_room(old_room, "SYS_MSG [" + old_room + "] " + current_nickname + " has left.");
-                {
-                    std::lock_guard<std::mutex> lock(clients_mutex);
-                    for (auto& client : clients) { if (client.id == id) { client.current_room = new_room; break; } }
-                }
-                send_to_client(client_socket, "JOIN_SUCCESS " + new_room);
-                broadcast_to_room(new_room, "SYS_MSG [" + new_room + "] " + current_nickname + " has joined!");
+        });
+    }
+}
+
+// Forgets what a node told us, when it says HELLO again or its link to us
+// closes: its clients, and its members of the rooms owned here.
+void bus_forget_node(int node) {
+    directory_remove_node(node);
+    for (Room* room : rooms_owned_by(cluster.self)) {
+        actor_pool.post(room->actor, [room, node] { forget_node_members(*room, node); });
+    }
+}
+
+// A connection another node opened to send to us. Only the bus thread uses these.
+struct BusInbound {
+    explicit BusInbound(SOCKET socket) : socket(socket) {}
+
+    SOCKET socket;
+    int node = -1; // known once a valid HELLO arrives
+    std::string challenge;
+    std::string buffer;
+};
+
+SOCKET bus_listener = INVALID_SOCKET;
+std::vector<BusInbound> bus_inbound;
+std::vector<bool> bus_refused; // per claimed node: refused since its last good HELLO, so it is logged once
+
+bool connect_in_progress() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+void bus_connect(BusPeer& peer) {
+    peer.next_attempt = std::chrono::steady_clock::now() + std::chrono::milliseconds(BUS_RETRY_MS);
+    SOCKET sock = socket(peer.address.ss_family, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return;
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one)); // batching is done by the outbox
+    if (!set_non_blocking(sock) || (connect(sock, (sockaddr*)&peer.address, peer.address_length) == SOCKET_ERROR && !connect_in_progress())) {
+        closesocket(sock);
+        return;
+    }
+    peer.socket = sock;
+    peer.connecting = true;
+}
+
+// The link is up: HELLO, answering the node's challenge, goes first, then this
+// node's state, then whatever is queued from now on.
+void bus_link_up(int node, BusPeer& peer, std::string_view challenge) {
+    peer.connecting = false;
+    peer.awaiting_challenge = false;
+    peer.waiting_writable = false;
+    {
+        std::lock_guard<std::mutex> lock(peer.mutex);
+        peer.outbox.clear();
+        peer.written_bytes = 0;
+        bus_append(peer.outbox, bus_message(BUS_HELLO, {(uint32_t)cluster.self}, {bus_hello_mac(challenge, cluster.self, node)}));
+        bus_sync(node, peer);
+        peer.up = true;
+        peer.flush_scheduled = true;
+    }
+    std::cout << "[INFO] Cluster: linked to node " << node << " at " << peer.host << ":" << peer.port << "." << std::endl;
+}
+
+void bus_link_down(int node, BusPeer& peer) {
+    closesocket(peer.socket);
+    peer.socket = INVALID_SOCKET;
+    peer.connecting = false;
+    peer.awaiting_challenge = false;
+    peer.waiting_writable = false;
+    peer.inbox.clear();
+    bool was_up;
+    {
+        std::lock_guard<std::mutex> lock(peer.mutex);
+        was_up = peer.up;
+        peer.up = false;
+        peer.flush_scheduled = false;
+        peer.outbox.clear();
+        // Whatever of these was not written may never have arrived.
+        for (auto& entry : peer.unsent_accounts) peer.missed_accounts.push_back(std::move(entry.second));
+        peer.unsent_accounts.clear();
+    }
+    if (was_up) std::cout << "[INFO] Cluster: lost the link to node " << node << "." << std::endl;
+}
+
+// Writes everything queued for the node since the last pass in one send.
+// Returns false on a socket error.
+bool bus_flush(BusPeer& peer) {
+    std::lock_guard<std::mutex> lock(peer.mutex);
+    peer.flush_scheduled = false;
+    if (peer.outbox.empty()) return true;
+    long sent = send(peer.socket, peer.outbox.data(), (int)peer.outbox.size(), MSG_NOSIGNAL);
+    metrics_count(COUNTER_BUS_WRITES);
+    if (sent == SOCKET_ERROR) {
+        if (!would_block()) return false;
+        sent = 0;
+    }
+    peer.outbox.erase(0, (size_t)sent);
+    peer.written_bytes += (uint64_t)sent;
+    while (!peer.unsent_accounts.empty() && peer.unsent_accounts.front().first <= peer.written_bytes) peer.unsent_accounts.pop_front();
+    // Whatever is left goes out when the socket is writable again.
+    peer.waiting_writable = !peer.outbox.empty();
+    peer.flush_scheduled = peer.waiting_writable;
+    return true;
+}
+
+// Reads the challenge the node sends on a connection we opened, and brings the
+// link up once it is complete. Returns false when the connection should be closed.
+bool bus_read_challenge(int node, BusPeer& peer) {
+    char chunk[256];
+    while (true) {
+        long received = recv(peer.socket, chunk, sizeof(chunk), 0);
+        if (received == 0) return false;
+        if (received == SOCKET_ERROR) {
+            if (would_block()) break;
+            return false;
+        }
+        peer.inbox.append(chunk, (size_t)received);
+        if (peer.inbox.size() > sizeof(chunk)) return false;
+    }
+    std::string_view payload;
+    size_t consumed;
+    FrameStatus status = next_binary_frame(peer.inbox.data(), peer.inbox.size(), payload, consumed);
+    if (status == FrameStatus::NeedMore) return true;
+    BusMessage msg;
+    if (status == FrameStatus::Invalid || !decode_bus_message(payload, msg) || msg.opcode != BUS_CHALLENGE || consumed != peer.inbox.size()) return false;
+    bus_link_up(node, peer, msg.strings[0]);
+    peer.inbox.clear();
+    return true;
+}
+
+// Reads what the node sent and handles every complete message. Returns false
+// when the connection should be closed.
+bool bus_read(size_t index) {
+    char chunk[BUS_READ_BYTES];
+    while (true) {
+        long received = recv(bus_inbound[index].socket, chunk, sizeof(chunk), 0);
+        if (received == 0) return false;
+        if (received == SOCKET_ERROR) {
+            if (would_block()) break;
+            return false;
+        }
+        bus_inbound[index].buffer.append(chunk, (size_t)received);
+    }
+    std::string& buffer = bus_inbound[index].buffer;
+    size_t offset = 0;
+    while (true) {
+        std::string_view payload;
+        size_t consumed;
+        FrameStatus status = next_binary_frame(buffer.data() + offset, buffer.size() - offset, payload, consumed);
+        if (status == FrameStatus::NeedMore) break;
+        BusMessage msg;
+        if (status == FrameStatus::Invalid || !decode_bus_message(payload, msg)) return false;
+        offset += consumed;
+        int& node = bus_inbound[index].node;
+        if (node >= 0) {
+            on_bus_message(node, msg);
+            continue;
+        }
+        if (msg.opcode != BUS_HELLO || (int)msg.ids[0] == cluster.self || msg.ids[0] >= cluster.peers.size()) return false;
+        if (!constant_time_equals(bus_hello_mac(bus_inbound[index].challenge, (int)msg.ids[0], cluster.self), msg.strings[0])) {
+            if (!bus_refused[msg.ids[0]]) {
+                std::cout << "[ERROR] Cluster: refused a bus connection claiming to be node " << msg.ids[0]
+                          << ": wrong key. Is session.key the same on every node?" << std::endl;
             }
-        } else if (command == "/msg") {
-            std::string target_username;
-            std::string private_message;
-            msg_stream >> target_username;
-            std::getline(msg_stream >> std::ws, private_message);
-
-            if (target_username.empty() || private_message.empty()) {
-                send_to_client(client_socket, "CMD_RESP [Error] Usage: /msg <username> <message>");
-            } else if (target_username == current_username) {
-                send_to_client(client_socket, "CMD_RESP [Error] You cannot send a private message to yourself.");
-            } else {
-                SOCKET target_socket = INVALID_SOCKET;
-                std::string target_nickname;
-                {
-                    std::lock_guard<std::mutex> lock(clients_mutex);
-                    for(const auto& client : clients) {
-                        if (client.username == target_username) {
-                            target_socket = client.socket;
-                            target_nickname = client.nickname;
-                            break;
-                        }
-                    }
+            bus_refused[msg.ids[0]] = true;
+            return false;
+        }
+        node = (int)msg.ids[0];
+        bus_refused[node] = false;
+        // A node that reconnects may still have its old connection lying around here.
+        for (size_t i = 0; i < bus_inbound.size(); ++i) {
+            if (i != index && bus_inbound[i].node == node) bus_inbound[i].node = -1;
+        }
+        bus_forget_node(node);
+    }
+    buffer.erase(0, offset);
+    return true;
+}
+
+// The bus thread: connects to every other node and keeps trying while one is
+// down, accepts their connections to us, and writes each outbox in one send per
+// wakeup. Senders wake it through the eventfd on Linux; elsewhere it polls
+// every BUS_POLL_MS.
+void run_cluster_bus() {
+    std::vector<pollfd> fds;
+    std::vector<int> peer_slots; // fds index of each peer's socket, or -1
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        fds.clear();
+        peer_slots.assign(cluster.peers.size(), -1);
+#ifdef __linux__
+        fds.push_back({cluster.wakeup_fd, POLLIN, 0});
+#endif
+        fds.push_back({bus_listener, POLLIN, 0});
+        for (size_t node = 0; node < cluster.peers.size(); ++node) {
+            BusPeer& peer = *cluster.peers[node];
+            if ((int)node == cluster.self) continue;
+            if (peer.socket == INVALID_SOCKET && now >= peer.next_attempt) bus_connect(peer);
+            if (peer.socket == INVALID_SOCKET) continue;
+            // After the challenge nothing is sent back on these, so readable means closed.
+            peer_slots[node] = (int)fds.size();
+            fds.push_back({peer.socket, (short)(POLLIN | (peer.connecting || peer.waiting_writable ? POLLOUT : 0)), 0});
+        }
+        size_t first_inbound = fds.size();
+        for (const BusInbound& in : bus_inbound) fds.push_back({in.socket, POLLIN, 0});
+#ifdef __linux__
+        poll_sockets(fds.data(), fds.size(), POLL_TIMEOUT_MS);
+        if (fds[0].revents & POLLIN) {
+            uint64_t signals;
+            if (read(cluster.wakeup_fd, &signals, sizeof(signals)) < 0) {} // EAGAIN: nothing was signalled
+        }
+        const pollfd& listener = fds[1];
+#else
+        poll_sockets(fds.data(), fds.size(), BUS_POLL_MS);
+        const pollfd& listener = fds[0];
+#endif
+        if (listener.revents & POLLIN) {
+            SOCKET sock;
+            while ((sock = accept(bus_listener, nullptr, nullptr)) != INVALID_SOCKET) {
+                if (!set_non_blocking(sock)) {
+                    closesocket(sock);
+                    continue;
                 }
-                if (target_socket == INVALID_SOCKET) {
-                    send_to_client(client_socket, "CMD_RESP [Error] User '" + target_username + "' not found or is not online.");
-                } else {
-                    std::string formatted_to_sender = "P_MSG (to " + target_nickname + "): " + private_message;
-                    std::string formatted_to_receiver = "P_MSG (from " + current_nickname + "): " + private_message;
-                    send_to_client(target_socket, formatted_to_receiver);
-                    send_to_client(client_socket, formatted_to_sender);
+                // The challenge is the only thing ever sent on an accepted connection.
+                BusInbound& in = bus_inbound.emplace_back(sock);
+                in.challenge = random_hex(16);
+                FrameRef challenge = bus_message(BUS_CHALLENGE, {}, {in.challenge});
+                if (send(sock, challenge.data(), (int)challenge.size(), MSG_NOSIGNAL) != (long)challenge.size()) {
+                    closesocket(sock);
+                    in.socket = INVALID_SOCKET;
                 }
             }
-        } else if (command == "/kick") {
-             if (!is_admin) {
-                send_to_client(client_socket, "CMD_RESP [Error] You do not have permission to use this command.");
-            } else {
-                std::string target_username;
-                msg_stream >> target_username;
-                std::string kicked_from_room, target_nickname;
-                SOCKET target_socket = INVALID_SOCKET;
-                bool success = false;
-                
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                auto it = std::find_if(clients.begin(), clients.end(), [&](const ClientInfo& c){ return c.username == target_username; });
-                if (it == clients.end()) {
-                    send_to_client(client_socket, "CMD_RESP [Error] User '" + target_username + "' not found.");
-                } else if (it->isAdmin) {
-                    send_to_client(client_socket, "CMD_RESP [Error] You cannot kick another admin.");
-                } else if (it->current_room == "Lobby") {
-                    send_to_client(client_socket, "CMD_RESP [Info] User '" + target_username + "' is already in the Lobby.");
+        }
+        for (size_t node = 0; node < cluster.peers.size(); ++node) {
+            BusPeer& peer = *cluster.peers[node];
+            if (peer.socket == INVALID_SOCKET) continue;
+            short revents = peer_slots[node] >= 0 ? fds[peer_slots[node]].revents : 0;
+            if (peer.connecting) {
+                if (!revents) continue;
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if ((revents & (POLLERR | POLLHUP)) || getsockopt(peer.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0) {
+                    bus_link_down((int)node, peer);
+                    continue;
                 }
-                else {
-                    kicked_from_room = it->current_room;
-                    target_nickname = it->nickname;
-                    target_socket = it->socket;
-                    it->current_room = "Lobby";
-                    success = true;
-                }
-
-                if(success) {
-                    send_to_client(target_socket, "SYS_MSG You have been kicked back to the Lobby by an admin.");
-                    send_to_client(target_socket, "JOIN_SUCCESS Lobby");
-                    broadcast_to_room_unlocked(kicked_from_room, "SYS_MSG [" + kicked_from_room + "] " + target_nickname + " was kicked by an admin.");
-                    send_to_client(client_socket, "CMD_RESP User '" + target_nickname + "' has been kicked to the Lobby.");
+                peer.connecting = false;
+                peer.awaiting_challenge = true;
+                peer.handshake_deadline = now + std::chrono::milliseconds(BUS_HANDSHAKE_MS);
+                continue;
+            } else if (peer.awaiting_challenge) {
+                if ((revents && !bus_read_challenge((int)node, peer)) || (peer.awaiting_challenge && now >= peer.handshake_deadline)) {
+                    bus_link_down((int)node, peer);
                 }
+                if (peer.awaiting_challenge || peer.socket == INVALID_SOCKET) continue;
+            } else if (revents & (POLLIN | POLLERR | POLLHUP)) {
+                bus_link_down((int)node, peer);
+                continue;
             }
-        } else if (command == "/deleteroom") {
-            if (!is_admin) {
-                send_to_client(client_socket, "CMD_RESP [Error] You do not have permission to use this command.");
-            } else {
-                std::string room_to_delete;
-                msg_stream >> room_to_delete;
-                if (room_to_delete == "Lobby") {
-                    send_to_client(client_socket, "CMD_RESP [Error] You cannot delete the Lobby.");
-                } else {
-                    bool room_found_and_deleted = false;
-                    {
-                        std::lock_guard<std::mutex> lock(rooms_mutex);
-                        auto room_it = std::find(rooms.begin(), rooms.end(), room_to_delete);
-                        if (room_it != rooms.end()) {
-                            rooms.erase(room_it);
-                            room_found_and_deleted = true;
-                        }
-                    }
-
-                    if (!room_found_and_deleted) {
-                        send_to_client(client_socket, "CMD_RESP [Error] Room '" + room_to_delete + "' does not exist.");
-                    } else {
-                        std::string admin_msg = "SYS_MSG [SYSTEM] Room '" + room_to_delete + "' was deleted by " + current_nickname + ".";
-                        std::string user_msg = "SYS_MSG [SYSTEM] Room '" + room_to_delete + "' has been deleted.";
-                        
-                        std::lock_guard<std::mutex> lock(clients_mutex);
-                        for (auto& client : clients) {
-                            if (client.current_room == room_to_delete) {
-                                client.current_room = "Lobby";
-                                send_to_client(client.socket, "SYS_MSG Room '" + room_to_delete + "' has been deleted. You are now in the Lobby.");
-                                send_to_client(client.socket, "JOIN_SUCCESS Lobby");
-                            }
-                        }
-                        send_to_client(client_socket, "CMD_RESP Room '" + room_to_delete + "' has been deleted.");
-                        
-                        // Send differentiated messages to the Lobby
-                        for (const auto& client : clients) {
-                            if(client.current_room == "Lobby") {
-                                if(client.isAdmin) {
-                                    send_to_client(client.socket, admin_msg);
-                                } else {
-                                    send_to_client(client.socket, user_msg);
-                                }
-                            }
-                        }
-                    }
-                }
+            if ((!peer.waiting_writable || (revents & POLLOUT)) && !bus_flush(peer)) bus_link_down((int)node, peer);
+        }
+        for (size_t i = 0; i < bus_inbound.size(); ++i) {
+            if (first_inbound + i >= fds.size() || !fds[first_inbound + i].revents) continue;
+            if (bus_read(i)) continue;
+            closesocket(bus_inbound[i].socket);
+            bus_inbound[i].socket = INVALID_SOCKET;
+            if (bus_inbound[i].node >= 0) {
+                std::cout << "[INFO] Cluster: node " << bus_inbound[i].node << " went away." << std::endl;
+                bus_forget_node(bus_inbound[i].node);
             }
         }
-        else {
-            std::string msg_body = message;
-            std::string formatted_message = "MSG " + std::to_string(id) + " " + current_nickname + " [" + user_current_room + "] " + msg_body;
-            broadcast_to_room(user_current_room, formatted_message);
+        bus_inbound.erase(std::remove_if(bus_inbound.begin(), bus_inbound.end(), [](const BusInbound& in) { return in.socket == INVALID_SOCKET; }),
+                          bus_inbound.end());
+    }
+}
+
+// Looks a bus address up once, at startup, so the bus thread never waits on
+// DNS. Names, IPv4 and IPv6 addresses all work; the first result is used.
+bool bus_resolve(BusPeer& peer) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    addrinfo* found = nullptr;
+    std::string port = std::to_string(peer.port);
+    if (getaddrinfo(peer.host.c_str(), port.c_str(), &hints, &found) != 0 || !found) return false;
+    std::memcpy(&peer.address, found->ai_addr, found->ai_addrlen);
+    peer.address_length = (socklen_t)found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+// Sets the cluster up from --cluster and --node-id and binds the bus to this
+// node's own address from the list, not to every interface. Must run before any
+// room is interned, since every room asks the ring for its owner.
+bool cluster_open() {
+    std::vector<std::pair<std::string, int>> nodes;
+    if (!parse_cluster_nodes(config.cluster_nodes, nodes) || config.node_id < 0 || config.node_id >= (int)nodes.size()) {
+        std::cout << "[ERROR] --cluster needs host:port,... with an entry for --node-id." << std::endl;
+        return false;
+    }
+    cluster.self = config.node_id;
+    for (const auto& node : nodes) {
+        cluster.peers.push_back(std::make_unique<BusPeer>());
+        BusPeer& peer = *cluster.peers.back();
+        peer.host = node.first;
+        peer.port = node.second;
+        if (!bus_resolve(peer)) {
+            std::cout << "[ERROR] Cannot resolve cluster node address " << peer.host << "." << std::endl;
+            return false;
+        }
+    }
+    cluster.ring.build(nodes.size());
+    // Every node already shares session.key, so the bus key is derived from it.
+    cluster.key = hmac_sha256_hex(session_keys.key, "cluster bus");
+    bus_refused.assign(nodes.size(), false);
+    BusPeer& self = *cluster.peers[cluster.self];
+    bus_listener = socket(self.address.ss_family, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(bus_listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+    if (bus_listener == INVALID_SOCKET || bind(bus_listener, (sockaddr*)&self.address, self.address_length) == SOCKET_ERROR ||
+        listen(bus_listener, SOMAXCONN) == SOCKET_ERROR || !set_non_blocking(bus_listener)) {
+        std::cout << "[ERROR] Cannot listen for cluster nodes on " << self.host << ":" << self.port << "." << std::endl;
+        return false;
+    }
+#ifdef __linux__
+    cluster.wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (cluster.wakeup_fd == -1) return false;
+#endif
+    cluster.enabled = true;
+    return true;
+}
+
+#ifdef USE_EPOLL
+// Runs the task on every loop's own thread and waits until all of them have.
+// Everything posted to the loops before it has been delivered by then.
+void run_on_loops(const std::function<void(EventLoop&)>& task) {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t left = event_loops.size();
+    for (auto& loop : event_loops) {
+        EventLoop* target = loop.get();
+        mailbox_post(*target, new MailboxItem([&, target] {
+            task(*target);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--left == 0) done.notify_all();
+        }));
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return left == 0; });
+}
+
+// True if no room actor is running or has tasks waiting. `batches` is the sum of
+// their batch counts, which stays put only while they all stay idle.
+bool actors_idle(uint64_t& batches) {
+    batches = 0;
+    std::shared_lock<std::shared_mutex> lock(room_index_mutex);
+    for (const auto& room : room_table) {
+        if (room->actor.scheduled.load() || !room->actor.inbox.empty()) return false;
+        batches += room->actor.batches.load(std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// Waits until nothing is left that could write to a connection: no password
+// being checked, no room task waiting or running, nothing in a loop's mailbox.
+// Once the loops stop reading, only those start new work for each other.
+void wait_until_quiet() {
+    uint64_t last = UINT64_MAX;
+    while (true) {
+        while (!auth_pool.idle()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        run_on_loops([](EventLoop&) {});
+        uint64_t batches;
+        bool idle = actors_idle(batches);
+        if (idle && batches == last) return;
+        last = idle ? batches : UINT64_MAX;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Stops accepting and stops watching every connection, hangups included, so
+// nothing a client does reaches this server again unless the handoff fails.
+void stop_loop(EventLoop& loop) {
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, loop.listener, nullptr);
+    for (Connection* conn : loop.connections) epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, conn->socket, nullptr);
+}
+
+// Undoes stop_loop and handles whatever input piled up in the meantime.
+void resume_loop(EventLoop& loop) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop.listener;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listener, &ev);
+    std::vector<Connection*> connections = loop.connections;
+    for (Connection* conn : connections) {
+        {
+            std::lock_guard<std::mutex> lock(conn->out->mutex);
+            conn->out->read_paused = conn->state == ConnState::Verifying;
+            ev.events = (conn->out->read_paused ? 0u : EPOLLIN | EPOLLRDHUP) | (conn->out->write_armed ? EPOLLOUT : 0u);
+            ev.data.ptr = conn;
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev);
+        }
+        if (conn->state != ConnState::Verifying && !process_lines(*conn)) shutdown(conn->socket, SHUT_RDWR);
+    }
+}
+
+// The loop's last task before its connections go to the successor: it writes
+// them down, then waits, touching nothing, until the handoff is over. If the
+// successor gives up, the loop carries on where it stopped.
+void freeze_loop(EventLoop& loop) {
+    std::vector<HandoffConnection> frozen;
+    std::vector<int> fds;
+    for (Connection* conn : loop.connections) {
+        if (conn->state == ConnState::Verifying) continue; // none are left once the auth pool is idle
+        HandoffConnection entry;
+        {
+            std::lock_guard<std::mutex> lock(conn->out->mutex);
+            if (conn->out->closed) continue;
+            size_t offset = conn->out->front_offset;
+            for (const FrameRef& frame : conn->out->frames) {
+                entry.pending.append(frame.data() + offset, frame.size() - offset);
+                offset = 0;
+            }
+            entry.binary = conn->out->binary;
         }
+        entry.id = (uint64_t)conn->id;
+        entry.chatting = conn->state == ConnState::Chatting;
+        entry.is_admin = conn->isAdmin;
+        entry.username = conn->username;
+        entry.nickname = conn->nickname;
+        Room* room = conn->client ? conn->client->room.load(std::memory_order_acquire) : nullptr;
+        entry.room = room ? room->name : lobby_room->name;
+        entry.framer = conn->framer.save();
+        frozen.push_back(std::move(entry));
+        fds.push_back(conn->socket);
     }
-    
-    std::string final_room;
-    std::string final_nickname;
+    std::unique_lock<std::mutex> lock(handoff.mutex);
+    handoff.state.connections.insert(handoff.state.connections.end(), std::make_move_iterator(frozen.begin()), std::make_move_iterator(frozen.end()));
+    handoff.fds.insert(handoff.fds.end(), fds.begin(), fds.end());
+    ++handoff.frozen;
+    handoff.changed.notify_all();
+    uint64_t attempt = handoff.attempt;
+    handoff.changed.wait(lock, [attempt] { return handoff.attempt != attempt; });
+    lock.unlock();
+    resume_loop(loop);
+}
+
+// Runs on the handoff thread once a successor has connected. Returns only if
+// the successor did not take over, with this server serving again.
+void hand_off(SOCKET successor) {
+    handoff_set_timeout(successor);
+    handoff.draining.store(true);
+    run_on_loops(stop_loop);
+    wait_until_quiet();
+    // Signups are on disk by now; keep the snapshot and the search index files
+    // still while the successor loads them.
+    std::unique_lock<std::mutex> compact_lock(user_store.compact_mutex);
+    std::unique_lock<std::mutex> index_lock(search_write_mutex);
+    std::unique_lock<std::mutex> lock(handoff.mutex);
+    handoff.state = HandoffState{};
+    handoff.fds.clear();
+    handoff.frozen = 0;
+    for (auto& loop : event_loops) {
+        EventLoop* target = loop.get();
+        mailbox_post(*target, new MailboxItem([target] { freeze_loop(*target); }));
+    }
+    handoff.changed.wait(lock, [] { return handoff.frozen == event_loops.size(); });
+    history_flush();
+    handoff.state.next_client_id = (uint64_t)next_client_id.load();
+    handoff.state.listeners = event_loops.size();
     {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.erase(std::remove_if(clients.begin(), clients.end(), [&](const ClientInfo& c) {
-            if (c.id == id) { 
-                final_room = c.current_room; 
-                final_nickname = c.nickname;
-                return true; 
-            } 
-            return false; 
-        }), clients.end());
-    }
-    std::string farewell_message = "[" + final_room + "] " + final_nickname + " has left the chat.";
-    std::cout << farewell_message << std::endl;
-    broadcast_to_room(final_room, "SYS_MSG " + farewell_message);
-    closesocket(client_socket);
-}
-
-int main() {
+        std::shared_lock<std::shared_mutex> index_lock(room_index_mutex);
+        for (const auto& room : room_table) handoff.state.room_ids.push_back(room->name);
+    }
+    handoff.state.rooms = room_list.load()->names;
+    std::vector<int> fds;
+    for (auto& loop : event_loops) fds.push_back(loop->listener);
+    fds.insert(fds.end(), handoff.fds.begin(), handoff.fds.end());
+    char ready = 0;
+    if (handoff_send_state(successor, handoff.state) && handoff_send_fds(successor, fds) &&
+        handoff_recv_all(successor, &ready, 1) && ready == HANDOFF_READY) {
+        std::cout << "[SERVER] Handed " << handoff.state.connections.size() << " connection(s) to the new server; exiting." << std::endl;
+        _exit(0);
+    }
+    std::cout << "[ERROR] The new server did not take over; carrying on." << std::endl;
+    handoff.draining.store(false);
+    ++handoff.attempt;
+    handoff.changed.notify_all();
+}
+
+void run_handoff_listener() {
+    while (true) {
+        SOCKET successor = accept(handoff.listener, nullptr, nullptr);
+        if (successor == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cout << "[ERROR] The handoff socket failed; hot restarts are off." << std::endl;
+            return;
+        }
+        if (!handoff_peer_is_self(successor)) {
+            std::cout << "[ERROR] Refused a handoff from a process of another user." << std::endl;
+            closesocket(successor);
+            continue;
+        }
+        std::cout << "[SERVER] A new server is taking over." << std::endl;
+        hand_off(successor);
+        closesocket(successor);
+    }
+}
+
+// Connects to the server already running on --handoff, if there is one, and
+// receives its state and sockets. `predecessor` stays INVALID_SOCKET when there
+// is nobody to take over from. Returns false if the handoff failed; the old
+// server then carries on, so this one must not start.
+bool take_over(SOCKET& predecessor, HandoffState& state, std::vector<int>& fds) {
+    predecessor = handoff_connect(config.handoff_path);
+    if (predecessor == INVALID_SOCKET) return true;
+    if (!handoff_peer_is_self(predecessor)) {
+        std::cout << "[ERROR] The server on " << config.handoff_path << " runs as another user; not taking over." << std::endl;
+        return false;
+    }
+    std::cout << "[SERVER] Taking over from the server on " << config.handoff_path << "." << std::endl;
+    if (handoff_recv_state(predecessor, state) && handoff_recv_fds(predecessor, state.listeners + state.connections.size(), fds)) return true;
+    std::cout << "[ERROR] The handoff failed; the running server carries on." << std::endl;
+    return false;
+}
+
+// Rebuilds a connection as the previous server left it and puts its client
+// back in its room. Returns null if the connection cannot be carried over.
+Connection* adopt_connection(EventLoop& loop, SOCKET sock, const HandoffConnection& entry) {
+    Connection* conn = make_connection(loop, sock, (int)entry.id);
+    if (!conn->framer.restore(entry.framer)) { // --max-line is smaller than before
+        closesocket(sock);
+        delete conn;
+        return nullptr;
+    }
+    conn->username = entry.username;
+    conn->nickname = entry.nickname;
+    conn->isAdmin = entry.is_admin;
+    conn->out->binary = entry.binary;
+    if (!entry.pending.empty()) {
+        Frame* frame = allocate_frame(entry.pending.size());
+        std::memcpy(frame->data(), entry.pending.data(), entry.pending.size());
+        conn->out->frames.push_back(FrameRef(frame));
+        conn->out->queued_bytes = entry.pending.size();
+    }
+    if (entry.chatting) {
+        conn->state = ConnState::Chatting;
+        Room* room = find_room(entry.room);
+        restore_client(add_client(*conn), room ? *room : *lobby_room);
+    }
+    return conn;
+}
+
+// Runs on the loop: starts watching its adopted connections, sends what they
+// still had queued and handles any whole lines they had sent.
+void watch_adopted(EventLoop& loop, const std::vector<Connection*>& adopted) {
+    for (Connection* conn : adopted) {
+        if (!event_loop_add(loop, conn)) {
+            if (conn->state == ConnState::Chatting) leave_chat(*conn);
+            closesocket(conn->socket);
+            delete conn;
+            continue;
+        }
+        if (conn->state == ConnState::Chatting) start_heartbeat_timer(loop, *conn);
+        if (!flush_outbound(*conn->out) || !process_lines(*conn)) shutdown(conn->socket, SHUT_RDWR);
+    }
+}
+
+// Recreates the predecessor's rooms, with the same ids, and its connections.
+// Every client is back in its room before any loop runs, so nothing said after
+// the handoff misses a member who has not been adopted yet. A predecessor with
+// more loops than this server also hands over more listeners than it needs; the
+// first loop takes the connections queued on the extras and closes them.
+void adopt_handoff(HandoffState& state, std::vector<int>& fds) {
+    for (const std::string& name : state.room_ids) intern_room(name);
+    for (const std::string& name : state.rooms) add_room_name(name);
+    next_client_id.store((int)state.next_client_id);
+    std::vector<std::vector<Connection*>> adopted(event_loops.size());
+    for (size_t i = 0; i < state.connections.size(); ++i) {
+        EventLoop& loop = *event_loops[i % event_loops.size()];
+        if (Connection* conn = adopt_connection(loop, fds[state.listeners + i], state.connections[i])) adopted[loop.index].push_back(conn);
+    }
+    for (auto& loop : event_loops) {
+        EventLoop* target = loop.get();
+        std::vector<SOCKET> extra;
+        for (size_t i = event_loops.size(); target->index == 0 && i < state.listeners; ++i) extra.push_back(fds[i]);
+        mailbox_post(*target, new MailboxItem([target, share = std::move(adopted[target->index]), extra] {
+            watch_adopted(*target, share);
+            for (SOCKET listener : extra) {
+                accept_connections(*target, listener);
+                closesocket(listener);
+            }
+        }));
+    }
+    std::cout << "[SERVER] Took over " << state.connections.size() << " connection(s) in " << state.room_ids.size() << " room(s)." << std::endl;
+}
+#endif
+
+#ifndef _WIN32
+// Each idle connection costs one descriptor, so lift the soft limit as far as the hard limit allows.
+void raise_fd_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+#endif
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --outbound-high <bytes>            congest a client once this much output is queued (default 262144)\n"
+              << "  --outbound-low <bytes>             uncongest once the queue drains below this (default 65536)\n"
+              << "  --outbound-limit <bytes>           disconnect once even control frames exceed this (default 4194304)\n"
+              << "  --slow-consumer <drop|disconnect>  what to do with a congested client (default drop)\n"
+              << "  --max-line <bytes>                 longest line a client may send (default 4096)\n"
+              << "  --compact-interval <seconds>       how often users.journal is folded into users.csv (default 300)\n"
+              << "  --history <on|off>                 keep per-room chat history on disk (default on)\n"
+              << "  --history-dir <path>               directory for the history segment logs (default history)\n"
+              << "  --history-replay <count>           messages replayed when entering a room (default 20)\n"
+              << "  --metrics-file <path>              Prometheus text file for the server metrics (default metrics.prom)\n"
+              << "  --metrics-interval <seconds>       how often the metrics file is rewritten, 0 to disable (default 10)\n"
+              << "  --reactors <count>                 event loops, 0 for one per core (default 0)\n"
+              << "  --pin <on|off>                     pin each event loop to a core (default on)\n"
+              << "  --room-workers <count>             threads running the room actors, 0 for one per core (default 0)\n"
+              << "  --flush-window <us>                how long queued output may wait to be batched (default 0)\n"
+              << "  --nodelay <on|off>                 set TCP_NODELAY on client sockets (default on)\n"
+              << "  --cork <on|off>                    cork flushes that need several writes, Linux only (default off)\n"
+              << "  --auth-workers <count>             threads hashing passwords, 0 for one per core (default 0)\n"
+              << "  --auth-queue <count>               logins that may wait for a worker before new ones are refused (default 1024)\n"
+              << "  --kdf-iterations <count>           PBKDF2 iterations for new password hashes (default 100000)\n"
+              << "  --session-ttl <seconds>            how long a session token can be used to RESUME (default 86400)\n"
+              << "  --auth-timeout <seconds>           time allowed to log in, 0 for no limit (default 30)\n"
+              << "  --ping-interval <seconds>          silence before a client is sent PING, 0 to turn heartbeats off (default 30)\n"
+              << "  --ping-timeout <seconds>           time allowed to answer a PING (default 15)\n"
+              << "  --chat-limit <rate>[:<burst>]      chat lines per second per connection, 0 for no limit (default 5:10)\n"
+              << "  --msg-limit <rate>[:<burst>]       /msg per second per connection (default 2:5)\n"
+              << "  --command-limit <rate>[:<burst>]   costly commands per second per connection (default 1:5)\n"
+              << "  --room-chat-limit <rate>[:<burst>] chat lines per second per room, all senders together (default 200:400)\n"
+              << "  --capture <path>                   record every inbound line to a binary trace for the replay tool (default off)\n"
+              << "  --port <port>                      port clients connect to (default 10000)\n"
+              << "  --cluster <host:port,...>          bus address of every cluster node, in node id order (default: no cluster)\n"
+              << "  --node-id <index>                  this server's entry in --cluster (default 0)\n"
+              << "  --handoff <path>                   Unix socket for hot restarts: take over from the server on it, then wait there for the next (default off)\n"
+              << "  --data-dir <path>                  directory for users, session key, history and metrics; other relative paths start there (default .)" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], ServerConfig& cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { print_usage(argv[0]); return false; }
+        std::string value = argv[++i];
+        if (arg == "--outbound-high") cfg.outbound_high_watermark = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--outbound-low") cfg.outbound_low_watermark = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--outbound-limit") cfg.outbound_hard_limit = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--slow-consumer" && value == "drop") cfg.slow_consumer_policy = SlowConsumerPolicy::DropOldestChat;
+        else if (arg == "--slow-consumer" && value == "disconnect") cfg.slow_consumer_policy = SlowConsumerPolicy::Disconnect;
+        else if (arg == "--max-line") cfg.max_line_length = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--compact-interval") cfg.compact_interval_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--history" && (value == "on" || value == "off")) cfg.history_enabled = value == "on";
+        else if (arg == "--history-dir") cfg.history_dir = value;
+        else if (arg == "--history-replay") cfg.history_replay = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--metrics-file") cfg.metrics_file = value;
+        else if (arg == "--metrics-interval") cfg.metrics_interval_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--reactors") cfg.reactors = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--pin" && (value == "on" || value == "off")) cfg.pin_reactors = value == "on";
+        else if (arg == "--room-workers") cfg.room_workers = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--flush-window") cfg.flush_window_us = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--nodelay" && (value == "on" || value == "off")) cfg.tcp_nodelay = value == "on";
+        else if (arg == "--cork" && (value == "on" || value == "off")) cfg.tcp_cork = value == "on";
+        else if (arg == "--auth-workers") cfg.auth_workers = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--auth-queue") cfg.auth_queue = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--kdf-iterations") cfg.kdf_iterations = (uint32_t)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--session-ttl") cfg.session_ttl_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--auth-timeout") cfg.auth_timeout_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--ping-interval") cfg.ping_interval_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--ping-timeout") cfg.ping_timeout_seconds = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--chat-limit" && parse_rate_limit(value, cfg.chat_limit)) {}
+        else if (arg == "--msg-limit" && parse_rate_limit(value, cfg.msg_limit)) {}
+        else if (arg == "--command-limit" && parse_rate_limit(value, cfg.command_limit)) {}
+        else if (arg == "--room-chat-limit" && parse_rate_limit(value, cfg.room_chat_limit)) {}
+        else if (arg == "--capture") cfg.capture_file = value;
+        else if (arg == "--port") cfg.port = std::atoi(value.c_str());
+        else if (arg == "--cluster") cfg.cluster_nodes = value;
+        else if (arg == "--node-id") cfg.node_id = std::atoi(value.c_str());
+        else if (arg == "--handoff") cfg.handoff_path = value;
+        else if (arg == "--data-dir") cfg.data_dir = value;
+        else { print_usage(argv[0]); return false; }
+    }
+    if (cfg.max_line_length == 0 || cfg.compact_interval_seconds == 0 || cfg.kdf_iterations == 0 || cfg.session_ttl_seconds == 0) {
+        std::cout << "[ERROR] --max-line, --compact-interval, --kdf-iterations and --session-ttl must be positive." << std::endl;
+        return false;
+    }
+    if (cfg.port <= 0 || cfg.port > 65535) {
+        std::cout << "[ERROR] --port must be between 1 and 65535." << std::endl;
+        return false;
+    }
+#ifndef USE_EPOLL
+    if (!cfg.handoff_path.empty()) {
+        std::cout << "[ERROR] --handoff is only supported on Linux." << std::endl;
+        return false;
+    }
+#endif
+    if (!cfg.handoff_path.empty() && !cfg.cluster_nodes.empty()) {
+        std::cout << "[ERROR] --handoff cannot be combined with --cluster." << std::endl;
+        return false;
+    }
+    if (cfg.outbound_low_watermark > cfg.outbound_high_watermark || cfg.outbound_high_watermark > cfg.outbound_hard_limit) {
+        std::cout << "[ERROR] Expected outbound-low <= outbound-high <= outbound-limit." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv, config)) return 1;
+    if (!config.data_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(config.data_dir, ec);
+        std::filesystem::current_path(config.data_dir, ec);
+        if (ec) {
+            std::cout << "[ERROR] Cannot use " << config.data_dir << " as the data directory." << std::endl;
+            return 1;
+        }
+    }
+#ifdef _WIN32
     WSADATA wsaData; if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return 1;
-    SOCKET server_socket = socket(AF_INET, SOCK_STREAM, 0); if (server_socket == INVALID_SOCKET) { WSACleanup(); return 1; }
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(10000);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(server_socket, (sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) { closesocket(server_socket); WSACleanup(); return 1; }
-    if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) { closesocket(server_socket); WSACleanup(); return 1; }
-    std::ifstream f("users.csv");
-    if (!f.good() || f.peek() == std::ifstream::traits_type::eof()) { save_user({"admin", "admin", true, "Admin"}); std::cout << "[INFO] users.csv created with default admin user." << std::endl; }
-    f.close();
-    std::cout << "[SERVER] Started and listening on port 10000." << std::endl;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+#endif
+#ifdef USE_EPOLL
+    // Before anything else: the old server stops serving from here on, and its
+    // signups and history are on disk by the time this returns.
+    SOCKET predecessor = INVALID_SOCKET;
+    HandoffState inherited;
+    std::vector<int> inherited_fds;
+    if (!config.handoff_path.empty() && !take_over(predecessor, inherited, inherited_fds)) return 1;
+#endif
+    unsigned num_loops = config.reactors ? config.reactors : std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < num_loops; ++i) {
+        event_loops.push_back(std::make_unique<EventLoop>());
+        event_loops.back()->index = i;
+        SOCKET listener = INVALID_SOCKET;
+#ifdef USE_EPOLL
+        if (i < inherited.listeners) listener = inherited_fds[i];
+#endif
+        if (!event_loop_init(*event_loops.back(), listener)) { std::cout << "[ERROR] Cannot listen on port " << config.port << "." << std::endl; WSACleanup(); return 1; }
+    }
+#ifndef USE_EPOLL
+    SOCKET server_socket = open_listener(false);
+    if (server_socket == INVALID_SOCKET) { std::cout << "[ERROR] Cannot listen on port " << config.port << "." << std::endl; WSACleanup(); return 1; }
+#endif
+    user_store.compact_interval = std::chrono::seconds(config.compact_interval_seconds);
+    user_store.kdf_iterations = config.kdf_iterations;
+    if (!user_store_open("users.csv", "users.journal")) { WSACleanup(); return 1; }
+    if (user_store.index.empty()) {
+        user_store.index.emplace("admin", User{"admin", hash_password("admin", user_store.kdf_iterations), true, "Admin"});
+        if (!user_store_compact()) { WSACleanup(); return 1; }
+        std::cout << "[INFO] users.csv created with default admin user." << std::endl;
+    }
+    user_store_start();
+    session_keys.ttl = std::chrono::seconds(config.session_ttl_seconds);
+    if (!session_key_open("session.key")) { WSACleanup(); return 1; }
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    auth_pool.start(config.auth_workers ? config.auth_workers : cores, config.auth_queue);
+    history_log.enabled = config.history_enabled;
+    history_log.dir = config.history_dir;
+    history_log.replay_count = config.history_replay;
+    history_start();
+    if (!config.cluster_nodes.empty() && !cluster_open()) { WSACleanup(); return 1; }
+    // After the loops and the cluster exist: every room keeps one member list per
+    // loop and asks the ring for its owner.
+    lobby_room = intern_room("Lobby");
+#ifdef USE_EPOLL
+    if (predecessor != INVALID_SOCKET) adopt_handoff(inherited, inherited_fds);
+#endif
+    actor_pool.start(config.room_workers ? config.room_workers : cores);
+    metrics.file_path = config.metrics_file;
+    metrics.interval_seconds = config.metrics_interval_seconds;
+    metrics_start(sample_gauges);
+    if (!config.capture_file.empty() && !trace_start(config.capture_file)) { WSACleanup(); return 1; }
+    if (cluster.enabled) {
+        std::thread(run_cluster_bus).detach();
+        std::cout << "[SERVER] Cluster node " << cluster.self << " of " << cluster.peers.size() << ", bus on "
+                  << cluster.peers[cluster.self]->host << ":" << cluster.peers[cluster.self]->port << "." << std::endl;
+    }
+
+    std::cout << "[SERVER] Started and listening on port " << config.port << " with " << num_loops << " event loop(s) and "
+              << actor_pool.size() << " room worker(s)." << std::endl;
+#ifdef USE_EPOLL
+    if (predecessor != INVALID_SOCKET) {
+        // The old server exits on this; until then it can still carry on if we fail.
+        char ready = HANDOFF_READY;
+        if (!handoff_send_all(predecessor, &ready, 1)) {
+            std::cout << "[ERROR] The old server gave up on the handoff and carries on." << std::endl;
+            return 1;
+        }
+        closesocket(predecessor);
+    }
+    if (!config.handoff_path.empty()) {
+        handoff.listener = handoff_listen(config.handoff_path);
+        if (handoff.listener == INVALID_SOCKET) {
+            std::cout << "[ERROR] Cannot listen for a successor on " << config.handoff_path << "." << std::endl;
+        } else {
+            std::thread(run_handoff_listener).detach();
+        }
+    }
+    // Every loop accepts on its own socket, so this thread simply becomes the first loop.
+    for (unsigned i = 1; i < num_loops; ++i) {
+        std::thread(run_event_loop, std::ref(*event_loops[i])).detach();
+    }
+    run_event_loop(*event_loops[0]);
+#else
+    for (auto& loop : event_loops) {
+        std::thread(run_event_loop, std::ref(*loop)).detach();
+    }
+    size_t next_loop = 0;
     while (true) {
         SOCKET client_socket = accept(server_socket, nullptr, nullptr);
         if (client_socket == INVALID_SOCKET) continue;
-        std::thread(handle_client, client_socket, next_client_id++).detach();
+        if (!set_non_blocking(client_socket)) { closesocket(client_socket); continue; }
+        EventLoop& loop = *event_loops[next_loop++ % num_loops];
+        event_loop_add(loop, new_connection(loop, client_socket));
     }
     closesocket(server_socket);
+#endif
     WSACleanup();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "crypto.h"
+#include "file_io.h"
+
+// Session tokens let a dropped client log back in with RESUME instead of its
+// password. A token is "<username>:<expiry>:<mac>", where the expiry is in Unix
+// seconds and the mac is HMAC-SHA256 over the first two fields with a server key.
+// Checking one is a single HMAC; the server keeps no per-session state. The key
+// lives in a file, so tokens survive a restart.
+struct SessionKeys {
+    std::string key;
+    std::chrono::seconds ttl{24 * 3600};
+};
+
+inline SessionKeys session_keys;
+
+// Loads the key, or creates a random one the first time. Anyone who can read
+// the key can forge a token for any account, so the file is created owner-only
+// and an existing one that others can read is refused.
+inline bool session_key_open(const std::string& path) {
+    MappedFile mapped;
+    if (map_file(path, mapped) && mapped.size >= 64) {
+        if (!file_is_private(path)) {
+            unmap_file(mapped);
+            std::cout << "[ERROR] " << path << " can be read or written by other users. Run 'chmod 600 " << path << "' or delete it to start with a new key." << std::endl;
+            return false;
+        }
+        session_keys.key.assign(mapped.data, 64);
+        unmap_file(mapped);
+        return true;
+    }
+    if (mapped.data) unmap_file(mapped);
+    session_keys.key = random_hex(32);
+    int fd = open_truncate(path, 0600);
+    bool ok = fd != -1 && write_all(fd, session_keys.key + "\n") && sync_file(fd);
+    if (fd != -1) close_file(fd);
+    if (!ok) std::cout << "[ERROR] Cannot write " << path << "." << std::endl;
+    return ok;
+}
+
+inline int64_t session_now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline std::string session_token_issue(const std::string& username) {
+    std::string body = username + ":" + std::to_string(session_now() + session_keys.ttl.count());
+    return body + ":" + hmac_sha256_hex(session_keys.key, body);
+}
+
+// Returns the username the token was issued to, or an empty string if the token
+// is forged, malformed or expired.
+inline std::string session_token_verify(std::string_view token) {
+    size_t mac_start = token.rfind(':');
+    if (mac_start == std::string_view::npos || mac_start == 0) return "";
+    size_t expiry_start = token.rfind(':', mac_start - 1);
+    if (expiry_start == std::string_view::npos || expiry_start == 0) return "";
+    std::string_view body = token.substr(0, mac_start);
+    if (!constant_time_equals(hmac_sha256_hex(session_keys.key, body), token.substr(mac_start + 1))) return "";
+    int64_t expiry = std::strtoll(std::string(token.substr(expiry_start + 1, mac_start - expiry_start - 1)).c_str(), nullptr, 10);
+    if (expiry < session_now()) return "";
+    return std::string(token.substr(0, expiry_start));
+}
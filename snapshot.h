@@ -0,0 +1,26 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+// A value that is replaced, never modified. Readers take the current version with
+// one atomic load and keep it alive for as long as they hold the pointer; a writer
+// builds the next version off to the side and swaps it in. Writers that may race
+// must be serialized by the caller.
+template <typename T>
+class Snapshot {
+public:
+    Snapshot() : current_(std::make_shared<const T>()) {}
+
+    std::shared_ptr<const T> load() const {
+        return std::atomic_load_explicit(&current_, std::memory_order_acquire);
+    }
+
+    void store(std::shared_ptr<const T> next) {
+        std::atomic_store_explicit(&current_, std::move(next), std::memory_order_release);
+    }
+
+private:
+    std::shared_ptr<const T> current_;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Hierarchical timing wheel, in the style of the classic Linux kernel timers.
+// Level 0 has one slot per tick; each level above covers WHEEL_SLOTS times the
+// span of the one below it. A timer goes into the lowest level whose span reaches
+// its expiry and moves down a level each time the wheel below it wraps, so insert
+// and cancel are O(1) and advancing one tick touches one slot, plus a cascade
+// every WHEEL_SLOTS ticks. Timers are intrusive nodes owned by the caller. Not
+// thread-safe: each event loop keeps its own wheel.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4 // 2^24 ticks, about 19 days at 100 ms per tick
+
+struct TimerNode {
+    TimerNode* prev = nullptr; // null while the timer is not armed
+    TimerNode* next = nullptr;
+    uint64_t expires = 0;      // tick at which it fires
+    void* owner = nullptr;
+
+    bool armed() const { return prev != nullptr; }
+};
+
+class TimingWheel {
+public:
+    TimingWheel() {
+        for (auto& level : slots_) {
+            for (TimerNode& head : level) head.prev = head.next = &head;
+        }
+    }
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    // The first tick that has not been processed yet.
+    uint64_t now() const { return current_; }
+    size_t size() const { return size_; }
+
+    // Arms (or re-arms) the timer. An expiry in the past fires on the next advance.
+    void schedule(TimerNode& node, uint64_t expires) {
+        if (node.armed()) cancel(node);
+        node.expires = expires < current_ ? current_ : expires;
+        insert(node);
+        ++size_;
+    }
+
+    void cancel(TimerNode& node) {
+        if (!node.armed()) return;
+        unlink(node);
+        --size_;
+    }
+
+    // Processes every tick before `until` and calls on_expire(node) for each timer
+    // that fires. The callback may schedule or cancel any timer, including this one.
+    template <typename Fn>
+    void advance(uint64_t until, Fn on_expire) {
+        if (size_ == 0 && until > current_) current_ = until; // nothing to fire on the way
+        while (current_ < until) {
+            uint32_t index = (uint32_t)(current_ & WHEEL_MASK);
+            // Entering a new lap of a level: move the next slot of the level above down.
+            for (int level = 1; level < WHEEL_LEVELS && index == 0; ++level) {
+                index = (uint32_t)((current_ >> (WHEEL_BITS * level)) & WHEEL_MASK);
+                cascade(slots_[level][index]);
+            }
+            TimerNode& head = slots_[0][current_ & WHEEL_MASK];
+            ++current_;
+            if (head.next == &head) continue;
+            // Detach the slot first, so timers re-armed by the callback are not seen again.
+            TimerNode expired;
+            splice(head, expired);
+            while (expired.next != &expired) {
+                TimerNode& node = *expired.next;
+                unlink(node);
+                if (node.expires >= current_) {
+                    insert(node); // beyond the top level when armed; not due yet
+                    continue;
+                }
+                --size_;
+                on_expire(node);
+            }
+        }
+    }
+
+private:
+    void insert(TimerNode& node) {
+        uint64_t delta = node.expires - current_;
+        int level = 0;
+        while (level + 1 < WHEEL_LEVELS && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) ++level;
+        uint64_t expires = node.expires;
+        uint64_t limit = current_ + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        if (expires > limit) expires = limit; // comes round early and is put back
+        TimerNode& head = slots_[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    static void unlink(TimerNode& node) {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    // Moves every node of `from` onto the empty list `to`.
+    static void splice(TimerNode& from, TimerNode& to) {
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        from.prev = from.next = &from;
+    }
+
+    void cascade(TimerNode& head) {
+        if (head.next == &head) return;
+        TimerNode moving;
+        splice(head, moving);
+        while (moving.next != &moving) {
+            TimerNode& node = *moving.next;
+            unlink(node);
+            insert(node);
+        }
+    }
+
+    TimerNode slots_[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t current_ = 0;
+    size_t size_ = 0;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string_view>
+
+// Splits a line into whitespace-separated tokens without copying it, the way
+// operator>> and getline(>> std::ws) used to.
+class Tokenizer {
+public:
+    explicit Tokenizer(std::string_view text) : rest_(text) {}
+
+    std::string_view next() {
+        skip_space();
+        size_t end = 0;
+        while (end < rest_.size() && !is_space(rest_[end])) ++end;
+        std::string_view token = rest_.substr(0, end);
+        rest_.remove_prefix(end);
+        return token;
+    }
+
+    // Everything after the tokens taken so far, without its leading whitespace.
+    std::string_view remainder() {
+        skip_space();
+        return rest_;
+    }
+
+private:
+    static bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+    void skip_space() {
+        while (!rest_.empty() && is_space(rest_.front())) rest_.remove_prefix(1);
+    }
+
+    std::string_view rest_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "file_io.h"
+#include "varint.h"
+
+// Traffic capture. With --capture the server records every connection it accepts,
+// every line it handles and every connection it closes, in order, to a compact
+// binary trace that the replay tool can play back against another server:
+//
+//     "CTCTRACE" | version byte | records...
+//     record: kind byte | varint ns since the previous record | varint connection id
+//             | for TRACE_AUTH and TRACE_LINE: varint length, line bytes
+//
+// Varints are varint.h's, up to 64 bits. Passwords and session tokens are
+// blanked out before a line is recorded, so a trace can be handed around.
+#define TRACE_MAGIC "CTCTRACE"
+#define TRACE_MAGIC_BYTES 8
+#define TRACE_VERSION 1
+#define TRACE_FLUSH_MS 100
+#define TRACE_REDACTED "*"
+
+enum TraceKind : uint8_t {
+    TRACE_OPEN = 1,  // connection accepted
+    TRACE_AUTH = 2,  // a line sent before logging in: LOGIN, SIGNUP, RESUME or junk
+    TRACE_LINE = 3,  // one command or chat line from a logged-in client
+    TRACE_CLOSE = 4, // connection closed, by either side
+};
+
+struct TraceRecord {
+    TraceKind kind = TRACE_OPEN;
+    uint64_t time_ns = 0; // since the first record
+    uint64_t conn_id = 0;
+    std::string_view line;
+};
+
+// Records are appended to an in-memory buffer under one short lock, with the
+// timestamp taken inside it so the file is in time order whichever loop wrote a
+// record. A writer thread moves the buffer to disk every TRACE_FLUSH_MS.
+struct TraceLog {
+    bool enabled = false;
+    int fd = -1;
+
+    std::mutex mutex;
+    std::string buffer;
+    std::chrono::steady_clock::time_point last;
+    bool started = false;
+};
+
+inline TraceLog trace_log;
+
+inline void trace_record(TraceKind kind, uint64_t conn_id, std::string_view line = {}) {
+    std::lock_guard<std::mutex> lock(trace_log.mutex);
+    auto now = std::chrono::steady_clock::now();
+    uint64_t delta = trace_log.started ? (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - trace_log.last).count() : 0;
+    trace_log.last = now;
+    trace_log.started = true;
+    trace_log.buffer += (char)kind;
+    put_varint64(trace_log.buffer, delta);
+    put_varint64(trace_log.buffer, conn_id);
+    if (kind == TRACE_AUTH || kind == TRACE_LINE) {
+        put_varint64(trace_log.buffer, line.size());
+        trace_log.buffer.append(line.data(), line.size());
+    }
+}
+
+inline void run_trace_writer() {
+    std::string batch;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(TRACE_FLUSH_MS));
+        {
+            std::lock_guard<std::mutex> lock(trace_log.mutex);
+            batch.swap(trace_log.buffer);
+        }
+        if (batch.empty()) continue;
+        if (!write_all(trace_log.fd, batch)) std::cout << "[ERROR] Could not write the capture file." << std::endl;
+        batch.clear();
+    }
+}
+
+// Starts a new trace at `path`, replacing any old one.
+inline bool trace_start(const std::string& path) {
+    trace_log.fd = open_truncate(path);
+    if (trace_log.fd == -1) {
+        std::cout << "[ERROR] Could not open capture file " << path << "." << std::endl;
+        return false;
+    }
+    std::string header(TRACE_MAGIC, TRACE_MAGIC_BYTES);
+    header += (char)TRACE_VERSION;
+    if (!write_all(trace_log.fd, header)) return false;
+    trace_log.enabled = true;
+    std::thread(run_trace_writer).detach();
+    return true;
+}
+
+// Walks the records of a trace held in memory.
+class TraceReader {
+public:
+    bool open(std::string_view data) {
+        if (data.size() < TRACE_MAGIC_BYTES + 1 || std::memcmp(data.data(), TRACE_MAGIC, TRACE_MAGIC_BYTES) != 0 ||
+            data[TRACE_MAGIC_BYTES] != TRACE_VERSION) return false;
+        pos_ = data.data() + TRACE_MAGIC_BYTES + 1;
+        end_ = data.data() + data.size();
+        return true;
+    }
+
+    // False at the end of the trace, or at a record cut short by a crash.
+    bool next(TraceRecord& record) {
+        if (pos_ >= end_) return false;
+        record.kind = (TraceKind)*pos_++;
+        uint64_t delta;
+        if (!get_varint64(pos_, end_, delta) || !get_varint64(pos_, end_, record.conn_id)) return false;
+        time_ns_ += delta;
+        record.time_ns = time_ns_;
+        record.line = {};
+        if (record.kind == TRACE_AUTH || record.kind == TRACE_LINE) {
+            uint64_t length;
+            if (!get_varint64(pos_, end_, length) || length > (uint64_t)(end_ - pos_)) return false;
+            record.line = std::string_view(pos_, (size_t)length);
+            pos_ += length;
+        }
+        return true;
+    }
+
+private:
+    const char* pos_ = nullptr;
+    const char* end_ = nullptr;
+    uint64_t time_ns_ = 0;
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "crypto.h"
+#include "file_io.h"
+
+struct User {
+    std::string username;
+    std::string password; // a password hash; see hash_password
+    bool isAdmin;
+    std::string nickname;
+};
+
+// Accounts live in a hash index that is loaded once at startup. users.csv is the
+// snapshot and keeps its original "username,password,isAdmin,nickname" lines;
+// signups are appended to users.journal in the same format and made durable in
+// group commits: a single writer thread writes and fsyncs everything that queued
+// up while the previous fsync was in flight. Compaction periodically folds the
+// journal back into a fresh snapshot.
+struct UserStore {
+    std::string snapshot_path;
+    std::string journal_path;
+
+    std::shared_mutex index_mutex;
+    std::unordered_map<std::string, User> index;
+
+    std::mutex journal_mutex;
+    std::condition_variable journal_cv;   // wakes the writer
+    std::condition_variable committed_cv; // wakes signups waiting for their fsync
+    std::string pending;                  // encoded records not yet written
+    size_t pending_records = 0;
+    uint64_t last_seq = 0;        // sequence number of the newest queued record
+    uint64_t durable_seq = 0;     // every record up to here has been written (or failed)
+    uint64_t failed_from_seq = 0; // after an I/O error the journal stops accepting signups
+    size_t journal_records = 0;   // records in the journal since the last compaction
+    size_t rehashed_records = 0;  // plaintext passwords hashed since the last compaction
+    int journal_fd = -1;
+    // Held while the snapshot is rewritten; a server handing off to a successor
+    // takes it so the successor never reads the files halfway through.
+    std::mutex compact_mutex;
+    std::chrono::seconds compact_interval{300};
+    uint32_t kdf_iterations = 100000;
+};
+
+inline UserStore user_store;
+
+enum class SignupResult { Created, Exists, Invalid, IoError };
+
+// Passwords are stored as "pbkdf2$<iterations>$<salt>$<hash>" with a random
+// per-user salt and PBKDF2-HMAC-SHA256. Older files hold plaintext passwords;
+// they still verify and are hashed the first time their user logs in.
+#define PASSWORD_HASH_PREFIX "pbkdf2$"
+
+inline std::string hash_password(std::string_view password, uint32_t iterations) {
+    std::string salt = random_hex(16);
+    return PASSWORD_HASH_PREFIX + std::to_string(iterations) + "$" + salt + "$" + pbkdf2_sha256_hex(password, salt, iterations);
+}
+
+inline bool is_password_hash(std::string_view stored) {
+    return stored.compare(0, std::strlen(PASSWORD_HASH_PREFIX), PASSWORD_HASH_PREFIX) == 0;
+}
+
+// Slow on purpose for hashed passwords: run it on the auth workers.
+inline bool verify_password(std::string_view stored, std::string_view password) {
+    if (!is_password_hash(stored)) return constant_time_equals(stored, password);
+    std::string_view rest = stored.substr(std::strlen(PASSWORD_HASH_PREFIX));
+    size_t salt_start = rest.find('$');
+    size_t hash_start = salt_start == std::string_view::npos ? salt_start : rest.find('$', salt_start + 1);
+    if (hash_start == std::string_view::npos) return false;
+    uint32_t iterations = (uint32_t)std::strtoul(std::string(rest.substr(0, salt_start)).c_str(), nullptr, 10);
+    if (iterations == 0) return false;
+    std::string_view salt = rest.substr(salt_start + 1, hash_start - salt_start - 1);
+    return constant_time_equals(pbkdf2_sha256_hex(password, salt, iterations), rest.substr(hash_start + 1));
+}
+
+// A field of a user line: nothing that would split it into more fields or lines.
+inline bool is_user_field(std::string_view field) {
+    return field.find_first_of(",\r\n") == std::string_view::npos;
+}
+
+// What add_user accepts. A comma in a name would let a signup write extra
+// fields, such as an admin flag, into its own journal line.
+inline bool is_valid_account(const User& user) {
+    return !user.username.empty() && !user.nickname.empty() && is_user_field(user.username) && is_user_field(user.password) &&
+           is_user_field(user.nickname);
+}
+
+// Parses one "username,password,isAdmin,nickname" line. A line with more than
+// four fields is refused.
+inline bool parse_user_line(std::string_view line, User& user) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    size_t first = line.find(',');
+    if (first == std::string_view::npos) return false;
+    size_t second = line.find(',', first + 1);
+    if (second == std::string_view::npos) return false;
+    size_t third = line.find(',', second + 1);
+    if (third == std::string_view::npos || line.find(',', third + 1) != std::string_view::npos) return false;
+    user.username.assign(line.data(), first);
+    user.password.assign(line.data() + first + 1, second - first - 1);
+    user.isAdmin = line.substr(second + 1, third - second - 1) == "true";
+    user.nickname.assign(line.data() + third + 1, line.size() - third - 1);
+    return true;
+}
+
+inline void append_user_line(std::string& out, const User& user) {
+    out += user.username;
+    out += ',';
+    out += user.password;
+    out += user.isAdmin ? ",true," : ",false,";
+    out += user.nickname;
+    out += '\n';
+}
+
+// Loads every complete line of a snapshot or journal into the index. A torn last
+// line from a crash mid-append is ignored; a username seen again is skipped.
+inline size_t load_user_file(const std::string& path) {
+    MappedFile mapped;
+    if (!map_file(path, mapped)) return 0;
+    size_t loaded = 0;
+    const char* pos = mapped.data;
+    const char* end = mapped.data + mapped.size;
+    User user;
+    while (pos < end) {
+        const char* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+        if (!newline) break;
+        if (parse_user_line(std::string_view(pos, newline - pos), user) && !user_store.index.count(user.username)) {
+            user_store.index.emplace(user.username, user);
+            ++loaded;
+        }
+        pos = newline + 1;
+    }
+    unmap_file(mapped);
+    return loaded;
+}
+
+// Loads the snapshot and then replays the journal on top of it.
+inline bool user_store_open(const std::string& snapshot_path, const std::string& journal_path) {
+    user_store.snapshot_path = snapshot_path;
+    user_store.journal_path = journal_path;
+    size_t from_snapshot = load_user_file(snapshot_path);
+    size_t from_journal = load_user_file(journal_path);
+    user_store.journal_records = from_journal;
+    user_store.journal_fd = open_append(journal_path);
+    if (user_store.journal_fd == -1) {
+        std::cout << "[ERROR] Cannot open " << journal_path << " for appending." << std::endl;
+        return false;
+    }
+    std::cout << "[INFO] Loaded " << from_snapshot << " user(s) from " << snapshot_path << " and "
+              << from_journal << " from " << journal_path << "." << std::endl;
+    return true;
+}
+
+// Writes the whole index to a new snapshot and empties the journal. Only the
+// journal writer thread (or main, before it starts) may call this: records it has
+// already written are in the index, so none are lost when the journal is truncated.
+inline bool user_store_compact() {
+    std::lock_guard<std::mutex> compact_lock(user_store.compact_mutex);
+    std::string contents;
+    {
+        std::shared_lock<std::shared_mutex> lock(user_store.index_mutex);
+        contents.reserve(user_store.index.size() * 48);
+        for (const auto& entry : user_store.index) append_user_line(contents, entry.second);
+    }
+    std::string tmp_path = user_store.snapshot_path + ".tmp";
+    int fd = open_truncate(tmp_path);
+    if (fd == -1) return false;
+    bool ok = write_all(fd, contents) && sync_file(fd);
+    close_file(fd);
+    if (!ok || !replace_file(tmp_path, user_store.snapshot_path)) return false;
+    // A crash between the rename and the truncate only leaves duplicates, which replay skips.
+    if (!truncate_file(user_store.journal_fd)) return false;
+    user_store.journal_records = 0;
+    return true;
+}
+
+inline void run_user_journal_writer() {
+    auto next_compaction = std::chrono::steady_clock::now() + user_store.compact_interval;
+    std::unique_lock<std::mutex> lock(user_store.journal_mutex);
+    while (true) {
+        user_store.journal_cv.wait_until(lock, next_compaction, [] { return !user_store.pending.empty(); });
+        if (!user_store.pending.empty()) {
+            std::string batch;
+            batch.swap(user_store.pending);
+            size_t records = user_store.pending_records;
+            uint64_t last = user_store.last_seq;
+            user_store.pending_records = 0;
+            lock.unlock();
+            bool ok = user_store.failed_from_seq == 0 && write_all(user_store.journal_fd, batch) && sync_file(user_store.journal_fd);
+            lock.lock();
+            if (!ok && user_store.failed_from_seq == 0) {
+                user_store.failed_from_seq = last - records + 1;
+                std::cout << "[ERROR] Writing " << user_store.journal_path << " failed; new signups are disabled." << std::endl;
+            }
+            user_store.journal_records += records;
+            user_store.durable_seq = last;
+            user_store.committed_cv.notify_all();
+        }
+        if (std::chrono::steady_clock::now() >= next_compaction) {
+            if ((user_store.journal_records > 0 || user_store.rehashed_records > 0) && user_store.failed_from_seq == 0) {
+                size_t rehashed = user_store.rehashed_records;
+                lock.unlock();
+                bool ok = user_store_compact();
+                lock.lock();
+                // Passwords hashed while the snapshot was being written wait for the next one.
+                if (ok) user_store.rehashed_records -= rehashed;
+                if (!ok) std::cout << "[ERROR] Compacting " << user_store.snapshot_path << " failed; will retry." << std::endl;
+            }
+            next_compaction = std::chrono::steady_clock::now() + user_store.compact_interval;
+        }
+    }
+}
+
+inline void user_store_start() {
+    std::thread(run_user_journal_writer).detach();
+}
+
+inline bool find_user(const std::string& username, User& user) {
+    std::shared_lock<std::shared_mutex> lock(user_store.index_mutex);
+    auto it = user_store.index.find(username);
+    if (it == user_store.index.end()) return false;
+    user = it->second;
+    return true;
+}
+
+// Replaces a plaintext password with its hash in the index. The next compaction
+// writes it out; until then a crash just leaves the plaintext to be hashed again.
+inline void upgrade_password(const std::string& username, const std::string& hash) {
+    {
+        std::unique_lock<std::shared_mutex> lock(user_store.index_mutex);
+        auto it = user_store.index.find(username);
+        if (it == user_store.index.end() || is_password_hash(it->second.password)) return;
+        it->second.password = hash;
+    }
+    std::lock_guard<std::mutex> lock(user_store.journal_mutex);
+    ++user_store.rehashed_records;
+}
+
+// Inserts the account and blocks until its journal record has been fsync'd,
+// sharing that fsync with every other signup queued in the meantime.
+inline SignupResult add_user(const User& user) {
+    if (!is_valid_account(user)) return SignupResult::Invalid;
+    {
+        std::unique_lock<std::shared_mutex> lock(user_store.index_mutex);
+        if (!user_store.index.emplace(user.username, user).second) return SignupResult::Exists;
+    }
+    bool ok;
+    {
+        std::unique_lock<std::mutex> lock(user_store.journal_mutex);
+        append_user_line(user_store.pending, user);
+        ++user_store.pending_records;
+        uint64_t seq = ++user_store.last_seq;
+        user_store.journal_cv.notify_one();
+        user_store.committed_cv.wait(lock, [seq] { return user_store.durable_seq >= seq; });
+        ok = user_store.failed_from_seq == 0 || seq < user_store.failed_from_seq;
+    }
+    if (!ok) {
+        std::unique_lock<std::shared_mutex> lock(user_store.index_mutex);
+        user_store.index.erase(user.username);
+        return SignupResult::IoError;
+    }
+    return SignupResult::Created;
+}